@@ -0,0 +1,406 @@
+#include "btreestore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#define MIX_READ 0
+#define MIX_WRITE 1
+#define MIX_SCAN 2
+#define MIX_CHURN 3
+
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+#define DIST_SEQ 2
+
+#define SCAN_LENGTH 16
+#define ZIPF_THETA 0.99
+
+static const char* mix_names[] = {"read", "write", "scan", "churn"};
+static const char* dist_names[] = {"uniform", "zipf", "seq"};
+
+struct bench_config {
+
+    int mix;
+    int dist;
+    size_t payload;
+    int threads;
+    uint32_t keys;
+    uint32_t ops;
+    uint16_t branching;
+    uint32_t node_bytes;
+    char compress_keys;
+    char hash_index;
+    uint64_t memory_budget;
+    uint64_t plaintext_cache;
+    const char* checkpoint_path;
+    uint32_t checkpoint_interval_ms;
+    uint8_t n_processors;
+    uint64_t seed;
+    const char* histogram_prefix;
+};
+
+struct zipf {
+
+    uint32_t items;
+    double theta;
+    double zetan;
+    double alpha;
+    double eta;
+};
+
+struct worker {
+
+    struct bench_config* config;
+    struct zipf* zipf;
+    void* helper;
+    pthread_t thread;
+
+    uint64_t state;
+    uint32_t cursor;
+    uint64_t* latencies;
+    uint32_t count;
+};
+
+uint64_t now_ns() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*
+* xorshift64*, private to each worker so runs are reproducible for a given seed
+*/
+uint64_t next_random(uint64_t* state) {
+
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+double next_unit(uint64_t* state) {
+
+    return (next_random(state) >> 11) * (1.0/9007199254740992.0);
+}
+
+/*
+* Zipfian generator from Gray et al., "Quickly Generating Billion-Record Synthetic Databases" (as used by YCSB)
+*/
+void zipf_init(struct zipf* z, uint32_t items, double theta) {
+
+    z->items = items;
+    z->theta = theta;
+    z->zetan = 0;
+    for (uint32_t i = 1; i <= items; i++) {
+        z->zetan += 1.0/pow(i, theta);
+    }
+    double zeta2 = 1.0 + 1.0/pow(2, theta);
+    z->alpha = 1.0/(1.0-theta);
+    z->eta = (1.0 - pow(2.0/items, 1.0-theta))/(1.0 - zeta2/z->zetan);
+}
+
+uint32_t zipf_next(struct zipf* z, uint64_t* state) {
+
+    double u = next_unit(state);
+    double uz = u * z->zetan;
+    if (uz < 1.0) {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, z->theta)) {
+        return 1;
+    }
+    uint32_t ret = (uint32_t)(z->items * pow(z->eta*u - z->eta + 1, z->alpha));
+    if (ret >= z->items) {
+        ret = z->items-1;
+    }
+    return ret;
+}
+
+uint32_t next_key(struct worker* w) {
+
+    struct bench_config* config = w->config;
+    if (config->dist == DIST_ZIPF) {
+        return zipf_next(w->zipf, &w->state);
+    } else if (config->dist == DIST_SEQ) {
+        uint32_t key = w->cursor;
+        w->cursor = (w->cursor+1) % config->keys;
+        return key;
+    }
+    return next_random(&w->state) % config->keys;
+}
+
+/*
+* Picks the operation for one step of a mix. Returns 0 for a read, 1 for a write, 2 for a scan and 3 for a delete
+*/
+int next_op(struct worker* w) {
+
+    int roll = next_random(&w->state) % 100;
+    if (w->config->mix == MIX_READ) {
+        return roll < 95 ? 0 : 1;
+    } else if (w->config->mix == MIX_WRITE) {
+        return roll < 50 ? 0 : 1;
+    } else if (w->config->mix == MIX_SCAN) {
+        return roll < 95 ? 2 : 1;
+    }
+    return roll < 50 ? 3 : 1;
+}
+
+void* run_worker(void* arg) {
+
+    struct worker* w = (struct worker*)arg;
+    struct bench_config* config = w->config;
+
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    char* plaintext = malloc(config->payload);
+    char* output = malloc(config->payload);
+    memset(plaintext, 'x', config->payload);
+    struct info found;
+
+    for (uint32_t n = 0; n < w->count; n++) {
+
+        uint32_t key = next_key(w);
+        int op = next_op(w);
+
+        uint64_t start = now_ns();
+        if (op == 0) {
+            btree_decrypt(key, output, w->helper);
+        } else if (op == 1) {
+            btree_upsert(key, plaintext, config->payload, enc_key, 5, w->helper);
+        } else if (op == 2) {
+            for (uint32_t i = 0; i < SCAN_LENGTH; i++) {
+                btree_retrieve((key+i) % config->keys, &found, w->helper);
+            }
+        } else {
+            if (btree_delete(key, w->helper) != 0) {
+                btree_insert(key, plaintext, config->payload, enc_key, 5, w->helper);
+            }
+        }
+        w->latencies[n] = now_ns() - start;
+    }
+    free(plaintext);
+    free(output);
+
+    return NULL;
+}
+
+int compare_u64(const void* a, const void* b) {
+
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+uint64_t percentile(uint64_t* sorted, uint64_t count, double p) {
+
+    if (count == 0) {
+        return 0;
+    }
+    uint64_t index = (uint64_t)(p * (count-1));
+    return sorted[index];
+}
+
+/*
+* Runs a single workload configuration on a freshly preloaded store and prints one CSV row
+*/
+void run_config(struct bench_config* config) {
+
+    struct btree_config store_config;
+    btree_default_config(&store_config, config->branching, config->n_processors);
+    store_config.node_bytes = config->node_bytes;
+    store_config.compress_keys = config->compress_keys;
+    store_config.hash_index = config->hash_index;
+    store_config.memory_budget = config->memory_budget;
+    store_config.plaintext_cache_bytes = config->plaintext_cache;
+    store_config.checkpoint_path = config->checkpoint_path;
+    store_config.checkpoint_interval_ms = config->checkpoint_interval_ms;
+    //Benchmark images are throwaway, a fixed wrapping key is enough
+    uint32_t checkpoint_key[4] = {4, 3, 2, 1};
+    memcpy(store_config.checkpoint_key, checkpoint_key, sizeof(checkpoint_key));
+    void* helper = init_store_config(&store_config);
+    if (helper == NULL) {
+        fprintf(stderr, "Node size %u is too small for a node\n", config->node_bytes);
+        exit(1);
+    }
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    char* plaintext = malloc(config->payload);
+    memset(plaintext, 'x', config->payload);
+
+    for (uint32_t i = 0; i < config->keys; i++) {
+        btree_insert(i, plaintext, config->payload, enc_key, 5, helper);
+    }
+    free(plaintext);
+
+    struct zipf z;
+    if (config->dist == DIST_ZIPF) {
+        zipf_init(&z, config->keys, ZIPF_THETA);
+    }
+
+    struct worker* workers = calloc(config->threads, sizeof(struct worker));
+    uint32_t per_thread = config->ops / config->threads;
+    for (int i = 0; i < config->threads; i++) {
+        workers[i].config = config;
+        workers[i].zipf = &z;
+        workers[i].helper = helper;
+        workers[i].state = config->seed * 0x9E3779B97F4A7C15ULL + i + 1;
+        workers[i].cursor = (config->keys / config->threads) * i;
+        workers[i].count = per_thread;
+        workers[i].latencies = malloc(sizeof(uint64_t)*per_thread);
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < config->threads; i++) {
+        pthread_create(&workers[i].thread, NULL, &run_worker, &workers[i]);
+    }
+    for (int i = 0; i < config->threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t total = (uint64_t)per_thread * config->threads;
+    uint64_t* all = malloc(sizeof(uint64_t)*(total+1));
+    for (int i = 0; i < config->threads; i++) {
+        memcpy(all + (uint64_t)per_thread*i, workers[i].latencies, sizeof(uint64_t)*per_thread);
+        free(workers[i].latencies);
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    double seconds = elapsed / 1e9;
+    printf("%s,%s,%zu,%d,%llu,%.6f,%.1f,%llu,%llu,%llu\n", mix_names[config->mix], dist_names[config->dist],
+    config->payload, config->threads, (unsigned long long)total, seconds, total/seconds,
+    (unsigned long long)percentile(all, total, 0.50), (unsigned long long)percentile(all, total, 0.99),
+    (unsigned long long)percentile(all, total, 0.999));
+    fflush(stdout);
+
+    if (config->histogram_prefix != NULL) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s-%s-%s-%zu-%d.csv", config->histogram_prefix, mix_names[config->mix],
+        dist_names[config->dist], config->payload, config->threads);
+        if (btree_histogram_dump(helper, path) != 0) {
+            fprintf(stderr, "Histograms unavailable, rebuild with make bench_histograms\n");
+        }
+    }
+    if (config->checkpoint_path != NULL) {
+        struct btree_checkpoint_stats stats;
+        btree_checkpoint_stats(helper, &stats);
+        fprintf(stderr, "checkpoints %llu (%llu full), %.3f ms average, %llu bytes written, %llu lock holds\n",
+        (unsigned long long)stats.checkpoints, (unsigned long long)stats.full_checkpoints,
+        stats.checkpoints != 0 ? stats.total_duration_ns / 1e6 / stats.checkpoints : 0.0,
+        (unsigned long long)stats.total_bytes, (unsigned long long)stats.batches);
+    }
+
+    free(all);
+    free(workers);
+    close_store(helper);
+}
+
+int parse_name(const char* value, const char** names, int count) {
+
+    for (int i = 0; i < count; i++) {
+        if (strcmp(value, names[i]) == 0) {
+            return i;
+        }
+    }
+    fprintf(stderr, "Unknown value: %s\n", value);
+    exit(1);
+}
+
+void usage(const char* name) {
+
+    fprintf(stderr, "Usage: %s [-m read|write|scan|churn] [-d uniform|zipf|seq] [-s payload bytes] "
+    "[-t max threads] [-k keys] [-o ops] [-b branching] [-n node bytes] [-c compress keys] [-i hash index] [-M memory budget bytes] [-P plaintext cache bytes] [-C checkpoint image path] [-I checkpoint interval ms] [-p processors] [-r seed] [-H histogram prefix]\n", name);
+    exit(1);
+}
+
+/*
+* Runs every combination of the selected mixes, distributions, payload sizes and thread counts.
+* Without -m/-d/-s the full matrix is run; payloads default to sizes from inline records up to ones the encryption scheduler splits across threads.
+*/
+int main(int argc, char* argv[]) {
+
+    int mix = -1;
+    int dist = -1;
+    size_t payload = 0;
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct bench_config base = {.keys = 2000, .ops = 20000, .branching = 16, .n_processors = 4, .seed = 1, .checkpoint_interval_ms = 10};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:d:s:t:k:o:b:n:ciM:P:C:I:p:r:H:h")) != -1) {
+        if (opt == 'm') {
+            mix = parse_name(optarg, mix_names, 4);
+        } else if (opt == 'd') {
+            dist = parse_name(optarg, dist_names, 3);
+        } else if (opt == 's') {
+            payload = strtoull(optarg, NULL, 10);
+        } else if (opt == 't') {
+            max_threads = atoi(optarg);
+        } else if (opt == 'k') {
+            base.keys = strtoul(optarg, NULL, 10);
+        } else if (opt == 'o') {
+            base.ops = strtoul(optarg, NULL, 10);
+        } else if (opt == 'b') {
+            base.branching = atoi(optarg);
+        } else if (opt == 'n') {
+            base.node_bytes = strtoul(optarg, NULL, 10);
+        } else if (opt == 'c') {
+            base.compress_keys = 1;
+        } else if (opt == 'i') {
+            base.hash_index = 1;
+        } else if (opt == 'M') {
+            base.memory_budget = strtoull(optarg, NULL, 10);
+        } else if (opt == 'P') {
+            base.plaintext_cache = strtoull(optarg, NULL, 10);
+        } else if (opt == 'C') {
+            base.checkpoint_path = optarg;
+        } else if (opt == 'I') {
+            base.checkpoint_interval_ms = strtoul(optarg, NULL, 10);
+        } else if (opt == 'p') {
+            base.n_processors = atoi(optarg);
+        } else if (opt == 'r') {
+            base.seed = strtoull(optarg, NULL, 10);
+        } else if (opt == 'H') {
+            base.histogram_prefix = optarg;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (max_threads < 1 || base.keys == 0 || base.ops == 0 || base.branching < 3 || base.n_processors == 0) {
+        usage(argv[0]);
+    }
+
+    size_t payloads[] = {64, 512, 4096};
+    int payload_count = 3;
+    if (payload != 0) {
+        payloads[0] = payload;
+        payload_count = 1;
+    }
+
+    printf("mix,dist,payload,threads,ops,seconds,ops_per_sec,p50_ns,p99_ns,p999_ns\n");
+    for (int m = 0; m < 4; m++) {
+        if (mix != -1 && m != mix) {
+            continue;
+        }
+        for (int d = 0; d < 3; d++) {
+            if (dist != -1 && d != dist) {
+                continue;
+            }
+            for (int s = 0; s < payload_count; s++) {
+                for (int t = 1; t <= max_threads; t = (t == max_threads || t*2 <= max_threads) ? t*2 : max_threads) {
+                    struct bench_config config = base;
+                    config.mix = m;
+                    config.dist = d;
+                    config.payload = payloads[s];
+                    config.threads = t;
+                    run_config(&config);
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -1,646 +1,4629 @@
+//pthread_setaffinity_np and the CPU_* macros are GNU extensions
+#define _GNU_SOURCE
 #include "btreestore.h"
 #include <pthread.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <fcntl.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define BYTE unsigned char
 
+#define CALIBRATION_BLOCKS 32
+#define CALIBRATION_DISPATCHES 4
+#define CRYPTO_TASKS_PER_CHUNK 4
+#define CRYPTO_DEQUE_CAPACITY 64
+#define INLINE_THRESHOLD 64
+#define KEYSTREAM_BUCKETS 64
+#define MAINTENANCE_BUDGET 64
+#define MAINTENANCE_INTERVAL_MS 10
+#define CACHE_LINE 64
+#define MIN_BRANCHING 3
+#define STREAM_CHUNK 65536
+#define TRAVERSAL_TASKS_PER_CORE 4
+#define FILTER_CELLS_PER_KEY 10
+#define FILTER_PROBES 7
+#define INDEX_MIN_SLOTS 64
+#define CHECKPOINT_BATCH_BYTES 1048576
+#define CHECKPOINT_BATCH_RECORDS 4096
+
+//CTR kernels are defined with the rest of the crypto code at the end of the file
+void fill_keystream(struct btree* my_tree, uint32_t key[4], uint64_t nonce, uint64_t* tmp2, uint32_t start, uint32_t end);
+void fill_keystream_window(struct btree* my_tree, uint32_t key[4], uint64_t nonce, uint64_t* window, uint32_t start, uint32_t end);
+void calibrate_crypto(struct btree* my_tree);
+void plan_affinity(struct btree* my_tree);
+void pool_run(struct btree* my_tree, void* (*routine)(void*), void** args, uint32_t count);
+
+//Async pipeline and maintenance thread live with their APIs after btree_delete
+void free_async(struct btree* my_tree);
+void* maintenance_worker(void* arg);
+void free_maintenance(struct btree* my_tree);
+void free_crypto_pool(struct crypto_pool* pool);
+
+//Tombstone compaction rebuilds ranges with the split and bulk load code after the store merge and split code
+uint64_t compact_range(struct btree* my_tree, uint32_t lo, uint32_t hi);
+uint64_t count_below(struct btree_node* node, uint32_t key);
+
+//The checkpointer lives with its API after the store merge and split code
+int checkpoint_keyed(struct btree_config* config);
+void init_checkpointer(struct btree* my_tree);
+void free_checkpointer(struct btree* my_tree);
+
+//Negative lookup filter and hash index live with the caches after the keystream code
+void filter_init(struct btree* my_tree);
+void index_init(struct btree* my_tree);
+
+#ifdef BTREE_HISTOGRAMS
+#define HIST_START(name) uint64_t name = histogram_clock()
+#define HIST_RECORD(tree, op, phase, name) histogram_record(tree, op, phase, histogram_clock()-(name))
+#else
+#define HIST_START(name)
+#define HIST_RECORD(tree, op, phase, name)
+#endif
+
+void btree_default_config(struct btree_config * config, uint16_t branching, uint8_t n_processors) {
+
+    config->branching = branching;
+    config->node_bytes = 0;
+    config->compress_keys = 0;
+    config->n_processors = n_processors;
+    config->inline_threshold = INLINE_THRESHOLD;
+    config->crypto_block_ns = 0;
+    config->crypto_dispatch_ns = 0;
+    config->crypto_cores = 0;
+    CPU_ZERO(&config->crypto_cpus);
+    CPU_ZERO(&config->request_cpus);
+    config->async_workers = 0;
+    config->tombstone_deletes = 0;
+    config->maintenance_budget = MAINTENANCE_BUDGET;
+    config->maintenance_interval_ms = MAINTENANCE_INTERVAL_MS;
+    config->memory_budget = 0;
+    config->plaintext_cache_bytes = 0;
+    config->filter_keys = 0;
+    config->hash_index = 0;
+    config->checkpoint_path = NULL;
+    memset(config->checkpoint_key, 0, sizeof(config->checkpoint_key));
+    config->checkpoint_interval_ms = 0;
+}
+
 void * init_store(uint16_t branching, uint8_t n_processors) {
 
-    struct btree* my_tree = (struct btree*)malloc(sizeof(struct btree));
+    struct btree_config config;
+    btree_default_config(&config, branching, n_processors);
+    return init_store_config(&config);
+}
+
+/*
+* Bytes of one node with room for branching+1 records and children, the extra slot absorbs a split in progress
+*/
+size_t node_layout_size(uint32_t branching, char compress_keys) {
+
+    size_t size = sizeof(struct btree_node) + (branching+1)*(sizeof(struct dict*) + sizeof(struct btree_node*));
+    if (compress_keys != 0) {
+        //Whole 16 byte vectors so the last SIMD load of the delta array stays inside the node
+        size += (((branching+1)*sizeof(uint16_t) + 15)/16)*16;
+    }
+    return size;
+}
 
+/*
+* Picks the fanout and allocation shape. With node_bytes set the fanout is the largest one whose node fits in
+* node_bytes, and page sized nodes are page aligned. Returns 1 if the requested size cannot hold a usable node.
+*/
+int plan_nodes(struct btree* my_tree, struct btree_config* config) {
+
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0) {
+        page = 4096;
+    }
+    if (config->node_bytes == 0) {
+        my_tree->branching = config->branching;
+        my_tree->node_align = CACHE_LINE;
+        my_tree->node_size = (node_layout_size(config->branching, config->compress_keys) + CACHE_LINE-1)/CACHE_LINE*CACHE_LINE;
+        return 0;
+    }
+    if (config->node_bytes < node_layout_size(MIN_BRANCHING, config->compress_keys)) {
+        return 1;
+    }
+    size_t slot = sizeof(struct dict*) + sizeof(struct btree_node*);
+    if (config->compress_keys != 0) {
+        slot += sizeof(uint16_t);
+    }
+    size_t branching = (config->node_bytes - sizeof(struct btree_node))/slot - 1;
+    if (branching > UINT16_MAX) {
+        branching = UINT16_MAX;
+    }
+    while (node_layout_size(branching, config->compress_keys) > config->node_bytes) {
+        branching--;
+    }
     my_tree->branching = branching;
+    my_tree->node_align = config->node_bytes >= page ? page : CACHE_LINE;
+    my_tree->node_size = (config->node_bytes + my_tree->node_align-1)/my_tree->node_align*my_tree->node_align;
+    config->branching = branching;
+    return 0;
+}
+
+void * init_store_config(struct btree_config * config) {
+
+    //A zero interval spins the maintenance thread on the tree lock, a zero budget leaves btree_compact nothing to do
+    if (config->maintenance_budget == 0 || config->maintenance_interval_ms == 0) {
+        return NULL;
+    }
+    //Record keys are never written to an image in the clear
+    if (config->checkpoint_path != NULL && checkpoint_keyed(config) == 0) {
+        return NULL;
+    }
+    struct btree* my_tree = (struct btree*)malloc(sizeof(struct btree));
+    my_tree->config = *config;
+    if (plan_nodes(my_tree, &my_tree->config) != 0) {
+        free(my_tree);
+        return NULL;
+    }
+
+    uint8_t n_processors = config->n_processors;
     my_tree->n_processors = n_processors;
     my_tree->root = NULL;
     my_tree->largest_key = 0;
     my_tree->node_count = 0;
+    memset(&my_tree->counters, 0, sizeof(struct btree_counters));
 
     //Set up concurrency environment...
     pthread_mutex_init(&my_tree->mutex, NULL);
-    my_tree->pool = malloc(sizeof(pthread_t)*n_processors);
+
+    my_tree->keystreams = malloc(sizeof(struct keystream_cache));
+    pthread_mutex_init(&my_tree->keystreams->mutex, NULL);
+    my_tree->keystreams->bucket_count = KEYSTREAM_BUCKETS;
+    my_tree->keystreams->buckets = calloc(KEYSTREAM_BUCKETS, sizeof(struct keystream*));
+    my_tree->keystreams->count = 0;
+    my_tree->keystreams->bytes = 0;
+    my_tree->keystreams->clock = 0;
+    memset(&my_tree->plaintext, 0, sizeof(struct plaintext_cache));
+    if (config->plaintext_cache_bytes != 0) {
+        my_tree->plaintext.bucket_count = KEYSTREAM_BUCKETS;
+        my_tree->plaintext.buckets = calloc(KEYSTREAM_BUCKETS, sizeof(struct plaintext*));
+    }
+    my_tree->record_bytes = 0;
+    my_tree->data_bytes = 0;
+    my_tree->evictions = 0;
+    my_tree->restores = 0;
+    my_tree->crypto_active = 0;
+    filter_init(my_tree);
+    index_init(my_tree);
+    calibrate_crypto(my_tree);
+
+    my_tree->crypto = calloc(1, sizeof(struct crypto_pool));
+    pthread_mutex_init(&my_tree->crypto->mutex, NULL);
+    pthread_cond_init(&my_tree->crypto->wake, NULL);
+    pthread_cond_init(&my_tree->crypto->done, NULL);
+    plan_affinity(my_tree);
+
+    my_tree->async = calloc(1, sizeof(struct btree_async));
+    pthread_mutex_init(&my_tree->async->mutex, NULL);
+    pthread_cond_init(&my_tree->async->work, NULL);
+    pthread_cond_init(&my_tree->async->ready, NULL);
+    pthread_cond_init(&my_tree->async->idle, NULL);
+    my_tree->async->worker_count = config->async_workers != 0 ? config->async_workers : n_processors;
+    my_tree->async->workers = malloc(sizeof(pthread_t)*my_tree->async->worker_count);
+
+    memset(&my_tree->maintenance, 0, sizeof(struct btree_maintenance));
+    pthread_mutex_init(&my_tree->maintenance.mutex, NULL);
+    pthread_cond_init(&my_tree->maintenance.wake, NULL);
+    if (config->tombstone_deletes != 0) {
+        my_tree->maintenance.running = 1;
+        pthread_create(&my_tree->maintenance.thread, NULL, &maintenance_worker, my_tree);
+    }
+    init_checkpointer(my_tree);
+
+#ifdef BTREE_HISTOGRAMS
+    my_tree->histograms = calloc(BTREE_OP_COUNT*BTREE_PHASE_COUNT, sizeof(struct btree_histogram));
+#else
+    my_tree->histograms = NULL;
+#endif
 
     return my_tree;
 }
 
-int free_node(struct btree_node* node) {
+uint64_t monotonic_ns() {
 
-    //Free individual nodes and all their allocated content
-    if (node == NULL) {
-        return 1;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void lock_tree(struct btree* my_tree) {
+
+    //Only contended acquisitions pay for the clock reads
+    if (pthread_mutex_trylock(&my_tree->mutex) == 0) {
+        return;
     }
-    free(node->children);
-    for (int i = 0; i < node->link_count; i++) {
-        free(node->key_values[i]->tmp2);
-        free(node->key_values[i]->data);
-        free(node->key_values[i]);
+    uint64_t start = monotonic_ns();
+    pthread_mutex_lock(&my_tree->mutex);
+
+    __atomic_fetch_add(&my_tree->counters.mutex_waits, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&my_tree->counters.mutex_wait_ns, monotonic_ns()-start, __ATOMIC_RELAXED);
+}
+
+uint64_t histogram_clock() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+int histogram_bucket(uint64_t value) {
+
+    //Values below 2*SUB map linearly, then each power of two is split into SUB buckets
+    int sub = 1 << BTREE_HIST_SUB_BITS;
+    if (value < (uint64_t)sub) {
+        return value;
     }
-    free(node->key_values);
-    free(node);
+    int shift = (63 - __builtin_clzll(value)) - BTREE_HIST_SUB_BITS;
+    return (shift+1)*sub + (int)((value >> shift) - sub);
+}
 
-    return 0;
+uint64_t histogram_bucket_floor(int bucket) {
+
+    int sub = 1 << BTREE_HIST_SUB_BITS;
+    if (bucket < sub) {
+        return bucket;
+    }
+    int shift = bucket/sub - 1;
+    return (uint64_t)(bucket%sub + sub) << shift;
 }
 
-void postorder_traversal(struct btree_node* current) {
+void histogram_record(struct btree* my_tree, int op, int phase, uint64_t value) {
 
-    if (current == NULL) {
-        return;
+    struct btree_histogram* hist = &my_tree->histograms[op*BTREE_PHASE_COUNT + phase];
+
+    __atomic_fetch_add(&hist->buckets[histogram_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->sum_ns, value, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (value > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+uint32_t keystream_hash(struct keystream_cache* cache, uint32_t key[4], uint64_t nonce) {
+
+    uint64_t hash = nonce * 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < 4; i++) {
+        hash = (hash ^ key[i]) * 0xFF51AFD7ED558CCDULL;
     }
-    for (int i = 0; i < current->child_count; i++) {
-        postorder_traversal(current->children[i]);
+    return (hash >> 32) % cache->bucket_count;
+}
+
+struct keystream** keystream_slot(struct keystream_cache* cache, uint32_t key[4], uint64_t nonce) {
+
+    struct keystream** slot = &cache->buckets[keystream_hash(cache, key, nonce)];
+    while (*slot != NULL) {
+        if ((*slot)->nonce == nonce && memcmp((*slot)->key, key, sizeof(uint32_t)*4) == 0) {
+            break;
+        }
+        slot = &(*slot)->next;
     }
-    free_node(current);
+    return slot;
+}
 
-    return;
+void keystream_grow(struct keystream_cache* cache) {
+
+    uint32_t old_count = cache->bucket_count;
+    struct keystream** old = cache->buckets;
+
+    cache->bucket_count = old_count*2;
+    cache->buckets = calloc(cache->bucket_count, sizeof(struct keystream*));
+    for (uint32_t i = 0; i < old_count; i++) {
+        struct keystream* current = old[i];
+        while (current != NULL) {
+            struct keystream* next = current->next;
+            uint32_t bucket = keystream_hash(cache, current->key, current->nonce);
+            current->next = cache->buckets[bucket];
+            cache->buckets[bucket] = current;
+            current = next;
+        }
+    }
+    free(old);
 }
 
-void close_store(void * helper) {
+void keystream_release_locked(struct keystream_cache* cache, struct keystream* stream) {
 
-    if (helper == NULL) {
+    stream->refs -= 1;
+    if (stream->refs > 0) {
         return;
     }
-    struct btree* my_tree = (struct btree*)helper;
-    pthread_mutex_destroy(&my_tree->mutex);
-    free(my_tree->pool);
+    //Superseded entries are no longer in the table, only the current one has to be unlinked
+    struct keystream** slot = keystream_slot(cache, stream->key, stream->nonce);
+    if (*slot == stream) {
+        *slot = stream->next;
+        cache->count -= 1;
+    }
+    if (stream->blocks != NULL) {
+        cache->bytes -= sizeof(uint64_t)*stream->num_blocks;
+    }
+    free(stream->blocks);
+    free(stream);
+}
 
-    if (my_tree->root == NULL || my_tree->node_count == 0) {
-        free(helper);
+void keystream_release(struct btree* my_tree, struct keystream* stream) {
+
+    if (stream == NULL) {
         return;
     }
-    postorder_traversal(my_tree->root);
-    free(helper);
-
-    return;
+    pthread_mutex_lock(&my_tree->keystreams->mutex);
+    keystream_release_locked(my_tree->keystreams, stream);
+    pthread_mutex_unlock(&my_tree->keystreams->mutex);
 }
 
-struct btree_node* create_node(struct btree* my_tree) {
-    
-    struct btree_node* node;
+/*
+* Ends a keystream_acquire pin once the holder no longer reads blocks outside the tree lock, the reference stays
+*/
+void keystream_unpin(struct btree* my_tree, struct keystream* stream) {
+
+    pthread_mutex_lock(&my_tree->keystreams->mutex);
+    stream->pins -= 1;
+    pthread_mutex_unlock(&my_tree->keystreams->mutex);
+}
 
-    node = (struct btree_node*)malloc(sizeof(struct btree_node));
-    node->children = malloc(sizeof(struct btree_node*)*(my_tree->branching+1));
-    node->key_values = malloc(sizeof(struct dict*)*(my_tree->branching+1));
+/*
+* Rebuilds the blocks of an evicted keystream. The caller holds a reference and either a pin or the tree lock, so
+* the entry cannot be evicted again before it is used.
+*/
+void keystream_restore(struct btree* my_tree, struct keystream* stream) {
+
+    struct keystream_cache* cache = my_tree->keystreams;
+    uint64_t* blocks = malloc(sizeof(uint64_t)*(stream->num_blocks > 0 ? stream->num_blocks : 1));
+    fill_keystream(my_tree, stream->key, stream->nonce, blocks, 0, stream->num_blocks);
+
+    pthread_mutex_lock(&cache->mutex);
+    if (stream->blocks == NULL) {
+        __atomic_store_n(&stream->blocks, blocks, __ATOMIC_RELEASE);
+        cache->bytes += sizeof(uint64_t)*stream->num_blocks;
+        __atomic_fetch_add(&my_tree->restores, 1, __ATOMIC_RELAXED);
+        blocks = NULL;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    free(blocks);
+}
 
-    node->child_count = 0;
-    node->link_count = 0;
-    node->parent = NULL;
-    node->leaf = 1;
+/*
+* Blocks of a record's keystream for a reader holding the tree lock, rebuilt first if they were evicted
+*/
+uint64_t* keystream_blocks(struct btree* my_tree, struct keystream* stream) {
 
-    return node;
+    uint64_t* blocks = __atomic_load_n(&stream->blocks, __ATOMIC_ACQUIRE);
+    if (blocks == NULL) {
+        keystream_restore(my_tree, stream);
+        blocks = __atomic_load_n(&stream->blocks, __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(&stream->recent, 1, __ATOMIC_RELAXED);
+    return blocks;
 }
 
-struct dict* create_key(uint32_t key, uint64_t * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+uint32_t plaintext_hash(struct plaintext_cache* cache, uint32_t key) {
 
-    struct btree* my_tree = (struct btree*)helper;
-    
-    struct dict* new;
-    new = (struct dict*)malloc(sizeof(struct dict));
-    new->nonce = nonce;
-    new->size = count;
-    new->key = key;
-    new->tmp2 = 0;
+    return (uint32_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32) % cache->bucket_count;
+}
 
-    int block_num = ((count + (8-1))/8);
+struct plaintext** plaintext_slot(struct plaintext_cache* cache, uint32_t key) {
 
-    new->data = (uint64_t*)malloc(sizeof(uint64_t)*block_num);
-    new->tmp2 = malloc(sizeof(uint64_t)*block_num);
-    void* text = malloc(sizeof(uint64_t)*block_num);
-    memmove(text, plaintext, count);
-    memmove(new->encrypt_key, encryption_key, sizeof(uint32_t)*4);
-    
-    if (new->size > 600) {
-        btree_encrpyt(text, new->encrypt_key, new->nonce, new->data, block_num, helper, new->tmp2);
-    } else{
-        my_tea_ctr(text, new->encrypt_key, new->nonce, new->data, block_num, new->tmp2);
-    }   
-    free(text);
+    struct plaintext** slot = &cache->buckets[plaintext_hash(cache, key)];
+    while (*slot != NULL && (*slot)->key != key) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
 
-    return new;
+void plaintext_unlink(struct plaintext_cache* cache, struct plaintext** slot) {
+
+    struct plaintext* entry = *slot;
+    *slot = entry->next;
+    cache->count -= 1;
+    cache->bytes -= sizeof(struct plaintext) + entry->size;
+    free(entry);
 }
 
-struct btree_node* btree_search(uint32_t key, struct btree* helper, struct btree_node* node) {
+/*
+* Forgets the cached plaintext of key, called under the tree lock whenever its value is rewritten or deleted
+*/
+void plaintext_drop(struct btree* my_tree, uint32_t key) {
 
-    if (node == NULL) {
-        return NULL;
-    } else if (node->leaf == 1) {
-        return node;
+    struct plaintext_cache* cache = &my_tree->plaintext;
+    if (cache->count == 0) {
+        return;
     }
+    struct plaintext** slot = plaintext_slot(cache, key);
+    if (*slot != NULL) {
+        plaintext_unlink(cache, slot);
+    }
+}
 
-    for (int i = 0; i < node->link_count; i++) {
-
-        if (node->key_values[i]->key == key) {
-            return node;
+/*
+* Forgets every cached key in [lo, hi], one pass over the table instead of a lookup per deleted key
+*/
+void plaintext_drop_range(struct btree* my_tree, uint32_t lo, uint32_t hi) {
+
+    struct plaintext_cache* cache = &my_tree->plaintext;
+    for (uint32_t i = 0; i < cache->bucket_count && cache->count > 0; i++) {
+        struct plaintext** slot = &cache->buckets[i];
+        while (*slot != NULL) {
+            if ((*slot)->key >= lo && (*slot)->key <= hi) {
+                plaintext_unlink(cache, slot);
+            } else {
+                slot = &(*slot)->next;
+            }
         }
-        if (key < node->key_values[i]->key) {
-            node = btree_search(key, helper, node->children[i]);
-            break;
-        } else if (i == node->link_count-1) {
-            node = btree_search(key, helper, node->children[i+1]);
-            break;
+    }
+}
+
+/*
+* Evicts entries until the cache holds at most limit bytes. Entries hit since the hand last passed get a second
+* chance, so two passes over the table always reach the limit.
+*/
+void plaintext_shrink(struct btree* my_tree, uint64_t limit) {
+
+    struct plaintext_cache* cache = &my_tree->plaintext;
+    for (uint32_t steps = cache->bucket_count*2; steps > 0 && cache->bytes > limit; steps--) {
+        cache->clock = (cache->clock + 1) % cache->bucket_count;
+        struct plaintext** slot = &cache->buckets[cache->clock];
+        while (*slot != NULL && cache->bytes > limit) {
+            if ((*slot)->recent == 1) {
+                (*slot)->recent = 0;
+                slot = &(*slot)->next;
+                continue;
+            }
+            plaintext_unlink(cache, slot);
         }
     }
-    return node;
 }
 
-int retreive_key(struct btree_node* flag, uint32_t key) {
-    
-    int i = 0;
-    for(; i < flag->link_count; i++) {
-        if (flag->key_values[i]->key == key) {
-            return i;
+void plaintext_grow(struct plaintext_cache* cache) {
+
+    uint32_t old_count = cache->bucket_count;
+    struct plaintext** old = cache->buckets;
+
+    cache->bucket_count = old_count*2;
+    cache->buckets = calloc(cache->bucket_count, sizeof(struct plaintext*));
+    for (uint32_t i = 0; i < old_count; i++) {
+        struct plaintext* current = old[i];
+        while (current != NULL) {
+            struct plaintext* next = current->next;
+            uint32_t bucket = plaintext_hash(cache, current->key);
+            current->next = cache->buckets[bucket];
+            cache->buckets[bucket] = current;
+            current = next;
         }
     }
-    return -1;
+    free(old);
 }
 
-int retreive_child(struct btree_node* parent, struct btree_node* target) {
+/*
+* Copies the cached plaintext of record into output with a single memcpy. Returns 1 on a miss, including an
+* entry left over from an older value of the key
+*/
+int plaintext_lookup(struct btree* my_tree, struct dict* record, void * output) {
 
-    int i = 0;
-    for (; i < parent->child_count; i++) {
-        if (parent->children[i] == target) {
-            return i;
-        }
+    struct plaintext_cache* cache = &my_tree->plaintext;
+    if (cache->buckets == NULL) {
+        return 1;
     }
-    return -1;
+    struct plaintext* entry = *plaintext_slot(cache, record->key);
+    if (entry == NULL || entry->stamp != record->stamp) {
+        cache->misses += 1;
+        return 1;
+    }
+    memcpy(output, entry->data, entry->size);
+    entry->recent = 1;
+    cache->hits += 1;
+    return 0;
 }
 
-int key_shift(struct btree_node* flag, struct btree* my_tree, uint32_t key) {
+/*
+* Keeps a copy of a freshly decrypted value. Values that would take more than the whole cache are not admitted
+*/
+void plaintext_store(struct btree* my_tree, struct dict* record, const void * plaintext) {
 
-    int i = 0;
-    for (; i < flag->link_count; i++) {
-        if ((flag->key_values[i])->key > key || (flag->key_values[i]) == NULL) {
-            if ((flag->key_values[i]) != NULL) {
-                memmove(flag->key_values+(i+1), flag->key_values+i, sizeof(struct dict*)*(flag->link_count-(i)));
-            }
-            break;
-        }
+    struct plaintext_cache* cache = &my_tree->plaintext;
+    uint64_t capacity = my_tree->config.plaintext_cache_bytes;
+    if (cache->buckets == NULL || sizeof(struct plaintext) + record->size > capacity) {
+        return;
+    }
+    plaintext_drop(my_tree, record->key);
+    plaintext_shrink(my_tree, capacity - sizeof(struct plaintext) - record->size);
+
+    struct plaintext* entry = malloc(sizeof(struct plaintext) + record->size);
+    entry->key = record->key;
+    entry->stamp = record->stamp;
+    entry->size = record->size;
+    entry->recent = 0;
+    memcpy(entry->data, plaintext, record->size);
+
+    struct plaintext** slot = &cache->buckets[plaintext_hash(cache, record->key)];
+    entry->next = *slot;
+    *slot = entry;
+    cache->count += 1;
+    cache->bytes += sizeof(struct plaintext) + record->size;
+    if (cache->count > cache->bucket_count*2) {
+        plaintext_grow(cache);
     }
-    return i;
 }
 
-int child_shift(struct btree_node* flag, struct btree* my_tree, uint32_t key) {
+void free_plaintext(struct plaintext_cache* cache) {
 
-    int i = 0;
-    for (;i < flag->child_count; i++) {
-        if (flag->children[i]->key_values[0]->key > key || flag->children[i] == NULL) {
-            if ((flag->key_values[i]) != NULL) {
-                memmove(flag->children+(i+1), flag->children+i, sizeof(struct btree_node*)*(flag->child_count-(i)));
-            }
-            break;
+    for (uint32_t i = 0; i < cache->bucket_count; i++) {
+        while (cache->buckets[i] != NULL) {
+            plaintext_unlink(cache, &cache->buckets[i]);
         }
     }
-    return i;
+    free(cache->buckets);
 }
 
-int child_rearrangement(struct btree_node* flag, struct btree_node* right, struct btree_node* new_root) {
+/*
+* Sizes the filter for filter_keys live keys, about a 1% false positive rate at that load
+*/
+void filter_init(struct btree* my_tree) {
 
-    for (int i = 0; i < flag->child_count; i++) {
-        if (flag->children[i]->key_values[0]->key > flag->key_values[flag->link_count-1]->key) {
-            i++;
-            memmove(right->children, flag->children+i, sizeof(struct btree_node*)*(flag->child_count-i));
-            
-            right->child_count += (flag->child_count-i);
-            for (int j = 0; j < flag->child_count-i; j++) {
-                right->children[j]->parent = right;
-            }
-            flag->child_count -= (flag->child_count-i);
+    struct key_filter* filter = &my_tree->filter;
+    memset(filter, 0, sizeof(struct key_filter));
+    if (my_tree->config.filter_keys == 0) {
+        return;
+    }
+    uint64_t cells = 64;
+    while (cells < (uint64_t)my_tree->config.filter_keys*FILTER_CELLS_PER_KEY && cells < (1ULL << 32)) {
+        cells *= 2;
+    }
+    filter->cells = calloc(cells, sizeof(uint8_t));
+    filter->mask = cells - 1;
+    filter->probes = FILTER_PROBES;
+}
+
+/*
+* Spreads a key over 64 bits. The filter takes two cell indexes from it, probe i uses first + i*second, and the hash
+* index takes its home slot from the low bits
+*/
+uint64_t key_hash(uint32_t key) {
+
+    uint64_t hash = key + 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    return hash ^ (hash >> 31);
+}
+
+/*
+* Counts key in or out of the filter, the caller holds the tree lock. Saturated cells are never decremented so
+* a key can not be lost to an overflow
+*/
+void filter_update(struct btree* my_tree, uint32_t key, int delta) {
+
+    struct key_filter* filter = &my_tree->filter;
+    if (filter->cells == NULL) {
+        return;
+    }
+    uint64_t hash = key_hash(key);
+    uint32_t first = (uint32_t)hash;
+    uint32_t second = (uint32_t)(hash >> 32) | 1;
+    for (uint32_t i = 0; i < filter->probes; i++) {
+        uint8_t* cell = &filter->cells[(first + i*second) & filter->mask];
+        uint8_t count = __atomic_load_n(cell, __ATOMIC_RELAXED);
+        if (count != UINT8_MAX) {
+            __atomic_store_n(cell, count + delta, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+* Returns 1 if key is certainly not in the tree. Needs no lock, a key whose insert finished before the call
+* always has all of its cells set
+*/
+int filter_probe(struct key_filter* filter, uint32_t key) {
+
+    uint64_t hash = key_hash(key);
+    uint32_t first = (uint32_t)hash;
+    uint32_t second = (uint32_t)(hash >> 32) | 1;
+    for (uint32_t i = 0; i < filter->probes; i++) {
+        if (__atomic_load_n(&filter->cells[(first + i*second) & filter->mask], __ATOMIC_RELAXED) == 0) {
             return 1;
         }
     }
     return 0;
 }
 
-void create_right_node(struct btree* my_tree, struct btree_node* flag, struct btree_node* right, int median, char check) {
+/*
+* filter_probe for a lookup, counted in the filter statistics. Always 0 while the filter is disabled
+*/
+int filter_absent(struct btree* my_tree, uint32_t key) {
 
-    //Moving the right half of left sibling key_values into right sibling. Deleting median
-    if (check == 1) {
-        memmove(right->key_values, (flag->key_values+median+1), sizeof(struct dict*)*(median+1));
-        flag->key_values[median] = NULL;
-    } else {
-        memmove(right->key_values, (flag->key_values+median), sizeof(struct dict*)*(median+1));
-        right->parent = flag->parent;
+    struct key_filter* filter = &my_tree->filter;
+    if (filter->cells == NULL) {
+        return 0;
     }
-    
-    flag->link_count -= flag->link_count-median;
-    if ((my_tree->branching-1) % 2 != 0) {
-        right->link_count += median+1;
-    } else {
-        right->link_count += median;
+    __atomic_fetch_add(&filter->queries, 1, __ATOMIC_RELAXED);
+    if (filter_probe(filter, key) == 1) {
+        __atomic_fetch_add(&filter->negatives, 1, __ATOMIC_RELAXED);
+        return 1;
     }
+    return 0;
+}
 
-    int ret = child_rearrangement(flag, right, flag->parent);
-    if (ret != 0) {
-        right->leaf = 0;
-        flag->leaf = 0;
+/*
+* Records that a lookup passed by the filter found nothing in the tree
+*/
+void filter_missed(struct btree* my_tree) {
+
+    if (my_tree->filter.cells != NULL) {
+        __atomic_fetch_add(&my_tree->filter.false_positives, 1, __ATOMIC_RELAXED);
     }
 }
 
-void create_new_root(struct btree_node* flag, struct btree* my_tree, int median, int pos) {
+void index_init(struct btree* my_tree) {
 
-    struct btree_node* right = create_node(my_tree);
-    struct btree_node* new_root = create_node(my_tree);
+    memset(&my_tree->index, 0, sizeof(struct hash_index));
+    if (my_tree->config.hash_index != 0) {
+        my_tree->index.slots = calloc(INDEX_MIN_SLOTS, sizeof(struct hash_slot));
+        my_tree->index.mask = INDEX_MIN_SLOTS - 1;
+    }
+}
 
-    new_root->key_values[0] = flag->key_values[median];
-    
-    new_root->leaf = 0;
-    new_root->children[1] = right;
-    new_root->children[0] = flag;
-    new_root->child_count += 2;
-    new_root->link_count += 1;
+/*
+* Position of key, or of the empty slot that ends its probe sequence
+*/
+uint32_t index_position(struct hash_index* index, uint32_t key) {
 
-    my_tree->root = new_root;
+    uint32_t position = (uint32_t)key_hash(key) & index->mask;
+    while (index->slots[position].record != NULL && index->slots[position].key != key) {
+        position = (position + 1) & index->mask;
+    }
+    return position;
+}
 
-    flag->parent = new_root;
-    right->parent = new_root;
-    new_root->parent = NULL;
+void index_grow(struct hash_index* index) {
 
-    create_right_node(my_tree, flag, right, median, 1);
-    my_tree->node_count += 2;
-}
+    struct hash_slot* old = index->slots;
+    uint32_t old_count = index->mask + 1;
 
+    index->mask = old_count*2 - 1;
+    index->slots = calloc(old_count*2, sizeof(struct hash_slot));
+    for (uint32_t i = 0; i < old_count; i++) {
+        if (old[i].record != NULL) {
+            index->slots[index_position(index, old[i].key)] = old[i];
+        }
+    }
+    free(old);
+}
 
-void split_node(int pos, struct btree_node* flag, struct btree* my_tree) {
+/*
+* Points key at record, replacing whatever record the key had. The caller holds the tree lock
+*/
+void index_put(struct btree* my_tree, struct dict* record) {
 
-    int median = ((flag->link_count)/2);
-    if (flag->link_count % 2 == 0) {
-        median -= 1;
-    } 
-    if (flag == my_tree->root) {
-        create_new_root(flag, my_tree, median, pos);
+    struct hash_index* index = &my_tree->index;
+    if (index->slots == NULL) {
         return;
     }
-
+    uint32_t position = index_position(index, record->key);
+    if (index->slots[position].record == NULL) {
+        index->count += 1;
+    }
+    index->slots[position].key = record->key;
+    index->slots[position].record = record;
+    //At most half full keeps the probe sequences short
+    if ((uint64_t)index->count*2 > (uint64_t)index->mask + 1) {
+        index_grow(index);
+    }
+}
+
+/*
+* Forgets key once its record leaves the tree. Later entries of the probe run are shifted back into the hole, so
+* the table never needs deletion markers
+*/
+void index_remove(struct btree* my_tree, uint32_t key) {
+
+    struct hash_index* index = &my_tree->index;
+    if (index->slots == NULL) {
+        return;
+    }
+    uint32_t hole = index_position(index, key);
+    if (index->slots[hole].record == NULL) {
+        return;
+    }
+    index->count -= 1;
+    uint32_t position = hole;
+    while (1) {
+        position = (position + 1) & index->mask;
+        if (index->slots[position].record == NULL) {
+            break;
+        }
+        //An entry may fill the hole only if its home slot is not between the hole and where it sits now
+        uint32_t home = (uint32_t)key_hash(index->slots[position].key) & index->mask;
+        if (((position - home) & index->mask) >= ((position - hole) & index->mask)) {
+            index->slots[hole] = index->slots[position];
+            hole = position;
+        }
+    }
+    index->slots[hole].record = NULL;
+}
+
+struct dict* index_find(struct hash_index* index, uint32_t key) {
+
+    return index->slots[index_position(index, key)].record;
+}
+
+/*
+* Bytes held by the store given the keystream total, the caller holds the tree lock for node_count
+*/
+uint64_t memory_used(struct btree* my_tree, uint64_t keystream_bytes) {
+
+    uint64_t filter_bytes = my_tree->filter.cells != NULL ? (uint64_t)my_tree->filter.mask+1 : 0;
+    uint64_t index_bytes = my_tree->index.slots != NULL ? sizeof(struct hash_slot)*((uint64_t)my_tree->index.mask+1) : 0;
+    return (uint64_t)my_tree->node_count*my_tree->node_size + keystream_bytes + my_tree->plaintext.bytes + filter_bytes + index_bytes +
+    __atomic_load_n(&my_tree->record_bytes, __ATOMIC_RELAXED) + __atomic_load_n(&my_tree->data_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+* Drops derivable data until the store is back within memory_budget: cached plaintext first, since a miss there
+* only costs an XOR, then keystream blocks. The caller holds the tree lock so no decrypt is reading them. Pinned
+* keystreams are skipped and recently used ones get a second chance, the sweep gives up after passing every
+* bucket twice.
+*/
+void enforce_budget(struct btree* my_tree) {
+
+    uint64_t budget = my_tree->config.memory_budget;
+    if (budget == 0) {
+        return;
+    }
+    struct keystream_cache* cache = my_tree->keystreams;
+    uint64_t fixed = memory_used(my_tree, 0);
+    pthread_mutex_lock(&cache->mutex);
+    if (fixed + cache->bytes > budget) {
+        uint64_t over = fixed + cache->bytes - budget;
+        uint64_t cached = my_tree->plaintext.bytes;
+        plaintext_shrink(my_tree, cached > over ? cached - over : 0);
+        fixed -= cached - my_tree->plaintext.bytes;
+    }
+    for (uint32_t steps = cache->bucket_count*2; steps > 0 && fixed + cache->bytes > budget; steps--) {
+        cache->clock = (cache->clock + 1) % cache->bucket_count;
+        for (struct keystream* current = cache->buckets[cache->clock]; current != NULL; current = current->next) {
+            if (fixed + cache->bytes <= budget) {
+                break;
+            }
+            if (current->pins > 0 || current->blocks == NULL) {
+                continue;
+            }
+            if (__atomic_exchange_n(&current->recent, 0, __ATOMIC_RELAXED) == 1) {
+                continue;
+            }
+            cache->bytes -= sizeof(uint64_t)*current->num_blocks;
+            free(current->blocks);
+            __atomic_store_n(&current->blocks, NULL, __ATOMIC_RELEASE);
+            __atomic_fetch_add(&my_tree->evictions, 1, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+* Makes stream the current entry for its (key, nonce), a superseded entry leaves the table but lives on in the
+* records still referencing it. The caller holds the cache mutex
+*/
+void keystream_publish_locked(struct keystream_cache* cache, struct keystream* stream) {
+
+    struct keystream** slot = keystream_slot(cache, stream->key, stream->nonce);
+    if (*slot != NULL) {
+        stream->next = (*slot)->next;
+        (*slot)->next = NULL;
+        *slot = stream;
+    } else {
+        *slot = stream;
+        cache->count += 1;
+        if (cache->count > cache->bucket_count*2) {
+            keystream_grow(cache);
+        }
+    }
+}
+
+/*
+* Returns a referenced and pinned keystream covering at least num_blocks for (key, nonce), the caller unpins it
+* once it stops reading blocks outside the tree lock. Entries are immutable once
+* published: a longer request builds a new entry from the old prefix and replaces it in the table, while records
+* already holding the old entry keep using it until they are released. Extensions at least double the entry so
+* the superseded prefixes stay bounded by the size of the current one.
+*/
+struct keystream* keystream_acquire(struct btree* my_tree, uint32_t key[4], uint64_t nonce, uint32_t num_blocks) {
+
+    struct keystream_cache* cache = my_tree->keystreams;
+
+    pthread_mutex_lock(&cache->mutex);
+    struct keystream* prefix = *keystream_slot(cache, key, nonce);
+    if (prefix != NULL && prefix->num_blocks >= num_blocks) {
+        prefix->refs += 1;
+        prefix->pins += 1;
+        __atomic_store_n(&prefix->recent, 1, __ATOMIC_RELAXED);
+        char evicted = prefix->blocks == NULL;
+        pthread_mutex_unlock(&cache->mutex);
+        if (evicted == 1) {
+            keystream_restore(my_tree, prefix);
+        }
+        return prefix;
+    }
+    if (prefix != NULL) {
+        prefix->refs += 1;
+        prefix->pins += 1;
+        if (num_blocks < prefix->num_blocks*2) {
+            num_blocks = prefix->num_blocks*2;
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+
+    //Only the missing suffix is run through TEA, outside the cache lock
+    struct keystream* stream = malloc(sizeof(struct keystream));
+    memmove(stream->key, key, sizeof(uint32_t)*4);
+    stream->nonce = nonce;
+    stream->num_blocks = num_blocks;
+    stream->refs = 1;
+    stream->pins = 1;
+    stream->recent = 1;
+    stream->next = NULL;
+    stream->blocks = malloc(sizeof(uint64_t)*(num_blocks > 0 ? num_blocks : 1));
+
+    //An evicted prefix is regenerated along with the suffix rather than restored just to be copied
+    uint32_t known = 0;
+    uint64_t* prefix_blocks = prefix != NULL ? __atomic_load_n(&prefix->blocks, __ATOMIC_ACQUIRE) : NULL;
+    if (prefix_blocks != NULL) {
+        known = prefix->num_blocks;
+        memmove(stream->blocks, prefix_blocks, sizeof(uint64_t)*known);
+    }
+    fill_keystream(my_tree, key, nonce, stream->blocks, known, num_blocks);
+
+    pthread_mutex_lock(&cache->mutex);
+    if (prefix != NULL) {
+        prefix->pins -= 1;
+        keystream_release_locked(cache, prefix);
+    }
+    struct keystream** slot = keystream_slot(cache, key, nonce);
+    if (*slot != NULL && (*slot)->num_blocks >= num_blocks && (*slot)->blocks != NULL) {
+        //Another thread published a long enough keystream while this one was being generated
+        (*slot)->refs += 1;
+        (*slot)->pins += 1;
+        struct keystream* found = *slot;
+        pthread_mutex_unlock(&cache->mutex);
+        free(stream->blocks);
+        free(stream);
+        return found;
+    }
+    keystream_publish_locked(cache, stream);
+    cache->bytes += sizeof(uint64_t)*num_blocks;
+    pthread_mutex_unlock(&cache->mutex);
+
+    return stream;
+}
+
+/*
+* Returns a referenced keystream covering at least num_blocks for (key, nonce) without running TEA. A new entry is
+* published evicted, its blocks are built by the first reader through keystream_restore. Longer requests double the
+* entry the same as keystream_acquire.
+*/
+struct keystream* keystream_reserve(struct btree* my_tree, uint32_t key[4], uint64_t nonce, uint32_t num_blocks) {
+
+    struct keystream_cache* cache = my_tree->keystreams;
+
+    pthread_mutex_lock(&cache->mutex);
+    struct keystream* prefix = *keystream_slot(cache, key, nonce);
+    if (prefix != NULL && prefix->num_blocks >= num_blocks) {
+        prefix->refs += 1;
+        pthread_mutex_unlock(&cache->mutex);
+        return prefix;
+    }
+    if (prefix != NULL && num_blocks < prefix->num_blocks*2) {
+        num_blocks = prefix->num_blocks*2;
+    }
+    struct keystream* stream = malloc(sizeof(struct keystream));
+    memmove(stream->key, key, sizeof(uint32_t)*4);
+    stream->nonce = nonce;
+    stream->num_blocks = num_blocks;
+    stream->refs = 1;
+    stream->pins = 0;
+    stream->recent = 0;
+    stream->next = NULL;
+    stream->blocks = NULL;
+    keystream_publish_locked(cache, stream);
+    pthread_mutex_unlock(&cache->mutex);
+
+    return stream;
+}
+
+void free_key(struct btree* my_tree, struct dict* key) {
+
+    if (key->stream != NULL) {
+        keystream_release(my_tree, key->stream);
+    }
+    if (key->data != key->inline_data) {
+        free(key->data);
+        __atomic_fetch_sub(&my_tree->record_bytes, sizeof(struct dict), __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&my_tree->data_bytes, key->capacity, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_sub(&my_tree->record_bytes, sizeof(struct dict) + key->capacity, __ATOMIC_RELAXED);
+    }
+    free(key);
+}
+
+int is_tombstone(struct dict* key) {
+
+    return key->stream == NULL;
+}
+
+int free_node(struct btree* my_tree, struct btree_node* node) {
+
+    //Free individual nodes and all their allocated content
+    if (node == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < node->link_count; i++) {
+        free_key(my_tree, node->key_values[i]);
+    }
+    free(node);
+
+    return 0;
+}
+
+void postorder_traversal(struct btree* my_tree, struct btree_node* current) {
+
+    if (current == NULL) {
+        return;
+    }
+    for (int i = 0; i < current->child_count; i++) {
+        postorder_traversal(my_tree, current->children[i]);
+    }
+    free_node(my_tree, current);
+
+    return;
+}
+
+void free_keystreams(struct keystream_cache* cache) {
+
+    //Every record has been released by now, anything left is a leak guard
+    for (uint32_t i = 0; i < cache->bucket_count; i++) {
+        struct keystream* current = cache->buckets[i];
+        while (current != NULL) {
+            struct keystream* next = current->next;
+            free(current->blocks);
+            free(current);
+            current = next;
+        }
+    }
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache->buckets);
+    free(cache);
+}
+
+void close_store(void * helper) {
+
+    if (helper == NULL) {
+        return;
+    }
+    struct btree* my_tree = (struct btree*)helper;
+    free_checkpointer(my_tree);
+    free_async(my_tree);
+    free_crypto_pool(my_tree->crypto);
+    free_maintenance(my_tree);
+    pthread_mutex_destroy(&my_tree->mutex);
+    free(my_tree->histograms);
+    free_plaintext(&my_tree->plaintext);
+    free(my_tree->filter.cells);
+    free(my_tree->index.slots);
+
+    if (my_tree->root == NULL || my_tree->node_count == 0) {
+        free_keystreams(my_tree->keystreams);
+        free(helper);
+        return;
+    }
+    postorder_traversal(my_tree, my_tree->root);
+    free_keystreams(my_tree->keystreams);
+    free(helper);
+
+    return;
+}
+
+struct btree_node* create_node(struct btree* my_tree) {
+    
+    struct btree_node* node;
+
+    void* memory = NULL;
+    if (posix_memalign(&memory, my_tree->node_align, my_tree->node_size) != 0) {
+        return NULL;
+    }
+    node = (struct btree_node*)memory;
+    node->key_values = (struct dict**)(node+1);
+    node->children = (struct btree_node**)(node->key_values + my_tree->branching+1);
+    node->key_deltas = (uint8_t*)(node->children + my_tree->branching+1);
+    node->keys_packed = 0;
+    node->key_width = 0;
+    node->key_base = 0;
+    node->live_count = 0;
+    node->max_stamp = 0;
+
+    node->child_count = 0;
+    node->link_count = 0;
+    node->parent = NULL;
+    node->leaf = 1;
+
+    return node;
+}
+
+void xor_keystream(uint64_t* output, const void* input, size_t count, const uint64_t* keystream) {
+
+    //Reads the plaintext in place, only the trailing partial block goes through a zero padded word
+    size_t full = count/8;
+    for (size_t i = 0; i < full; i++) {
+        uint64_t word;
+        memcpy(&word, (const BYTE*)input + i*8, sizeof(uint64_t));
+        output[i] = word ^ keystream[i];
+    }
+    if (count % 8 != 0) {
+        uint64_t word = 0;
+        memcpy(&word, (const BYTE*)input + full*8, count % 8);
+        output[full] = word ^ keystream[full];
+    }
+}
+
+/*
+* XORs len bytes of input with the keystream bytes at the same offset, neither side needs to be word aligned
+*/
+void xor_bytes(BYTE* output, const BYTE* input, const BYTE* keystream, size_t len) {
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        uint64_t key;
+        memcpy(&word, input + i, sizeof(uint64_t));
+        memcpy(&key, keystream + i, sizeof(uint64_t));
+        word ^= key;
+        memcpy(output + i, &word, sizeof(uint64_t));
+    }
+    for (; i < len; i++) {
+        output[i] = input[i] ^ keystream[i];
+    }
+}
+
+/*
+* Allocates a record with room for count bytes of ciphertext, the caller fills data and stream
+*/
+struct dict* alloc_record(struct btree* my_tree, uint32_t key, size_t count, uint32_t encryption_key[4], uint64_t nonce) {
+
+    int block_num = ((count + (8-1))/8);
+    size_t data_size = sizeof(uint64_t)*block_num;
+
+    //Small payloads share one allocation with the header, larger ones get their own blob
+    struct dict* new;
+    if (count <= my_tree->config.inline_threshold) {
+        new = (struct dict*)malloc(sizeof(struct dict) + data_size);
+        new->data = new->inline_data;
+        __atomic_fetch_add(&my_tree->record_bytes, sizeof(struct dict) + data_size, __ATOMIC_RELAXED);
+    } else {
+        new = (struct dict*)malloc(sizeof(struct dict));
+        new->data = malloc(data_size);
+        __atomic_fetch_add(&my_tree->record_bytes, sizeof(struct dict), __ATOMIC_RELAXED);
+        __atomic_fetch_add(&my_tree->data_bytes, data_size, __ATOMIC_RELAXED);
+    }
+    new->capacity = data_size;
+    new->nonce = nonce;
+    new->size = count;
+    new->key = key;
+    new->stamp = __atomic_add_fetch(&my_tree->write_stamp, 1, __ATOMIC_RELAXED);
+    memmove(new->encrypt_key, encryption_key, sizeof(uint32_t)*4);
+    new->stream = NULL;
+
+    return new;
+}
+
+/*
+* Allocates a record and encrypts plaintext into it with an already acquired keystream
+*/
+struct dict* build_record(struct btree* my_tree, uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, struct keystream* stream) {
+
+    struct dict* new = alloc_record(my_tree, key, count, encryption_key, nonce);
+    new->stream = stream;
+    xor_keystream((uint64_t*)new->data, plaintext, count, new->stream->blocks);
+
+    return new;
+}
+
+struct dict* create_key(uint32_t key, uint64_t * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    
+    int block_num = ((count + (8-1))/8);
+    struct keystream* stream = keystream_acquire(my_tree, encryption_key, nonce, block_num);
+    struct dict* record = build_record(my_tree, key, plaintext, count, encryption_key, nonce, stream);
+    keystream_unpin(my_tree, stream);
+    return record;
+}
+
+void invalidate_keys(struct btree_node* node) {
+
+    node->keys_packed = 0;
+}
+
+/*
+* Recomputes live_count of a node from its own records and its children, whose counts must already be right.
+* Used after keys or children move between nodes, plain inserts and deletes go through adjust_counts.
+*/
+void recount_node(struct btree_node* node) {
+
+    uint64_t count = 0;
+    uint32_t stamp = 0;
+    for (int i = 0; i < node->link_count; i++) {
+        count += is_tombstone(node->key_values[i]) == 0;
+        if (node->key_values[i]->stamp > stamp) {
+            stamp = node->key_values[i]->stamp;
+        }
+    }
+    if (node->leaf == 0) {
+        for (int i = 0; i < node->child_count; i++) {
+            count += node->children[i]->live_count;
+            if (node->children[i]->max_stamp > stamp) {
+                stamp = node->children[i]->max_stamp;
+            }
+        }
+    }
+    node->live_count = count;
+    node->max_stamp = stamp;
+}
+
+/*
+* Adds delta to live_count of node and every ancestor
+*/
+void adjust_counts(struct btree_node* node, int64_t delta) {
+
+    for (; node != NULL; node = node->parent) {
+        node->live_count += delta;
+    }
+}
+
+/*
+* Raises max_stamp of node and its ancestors to stamp, stopping at the first one already there
+*/
+void raise_stamps(struct btree_node* node, uint32_t stamp) {
+
+    for (; node != NULL && node->max_stamp < stamp; node = node->parent) {
+        node->max_stamp = stamp;
+    }
+}
+
+/*
+* Gives a record that was just linked into node, or rewritten there, a fresh stamp. Records are built outside the
+* lock, stamping again here means a checkpoint that started at stamp S has already seen every record up to S.
+*/
+void stamp_record(struct btree* my_tree, struct btree_node* node, struct dict* record) {
+
+    record->stamp = __atomic_add_fetch(&my_tree->write_stamp, 1, __ATOMIC_RELAXED);
+    raise_stamps(node, record->stamp);
+}
+
+/*
+* Rebuilds the packed key array of a node, 8 bit deltas from the smallest key when the span allows, 16 bit
+* deltas otherwise, and no packing when even 16 bits cannot cover the span
+*/
+void pack_keys(struct btree_node* node) {
+
+    node->keys_packed = 1;
+    node->key_width = 0;
+    int n = node->link_count;
+    if (n == 0) {
+        return;
+    }
+    uint32_t base = node->key_values[0]->key;
+    uint32_t span = node->key_values[n-1]->key - base;
+    node->key_base = base;
+    if (span <= UINT8_MAX) {
+        node->key_width = 1;
+        for (int i = 0; i < n; i++) {
+            node->key_deltas[i] = node->key_values[i]->key - base;
+        }
+    } else if (span <= UINT16_MAX) {
+        node->key_width = 2;
+        uint16_t* deltas = (uint16_t*)node->key_deltas;
+        for (int i = 0; i < n; i++) {
+            deltas[i] = node->key_values[i]->key - base;
+        }
+    }
+}
+
+/*
+* Index of the first key not below key in a packed node, found stores whether it equals key. The deltas are
+* sorted, so counting the lanes below the target delta gives the index and only the first partial vector matters.
+*/
+int packed_lower_bound(struct btree_node* node, uint32_t key, char* found) {
+
+    int n = node->link_count;
+    *found = 0;
+    if (key <= node->key_base) {
+        *found = key == node->key_base;
+        return 0;
+    }
+    uint32_t delta = key - node->key_base;
+    if (delta > (node->key_width == 1 ? UINT8_MAX : UINT16_MAX)) {
+        return n;
+    }
+    int index = 0;
+#if defined(__SSE2__)
+    if (node->key_width == 1) {
+        __m128i bias = _mm_set1_epi8((char)0x80);
+        __m128i target = _mm_xor_si128(_mm_set1_epi8((char)delta), bias);
+        for (int i = 0; i < n; i += 16) {
+            __m128i lanes = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(node->key_deltas + i)), bias);
+            int mask = _mm_movemask_epi8(_mm_cmplt_epi8(lanes, target));
+            if (n-i < 16) {
+                mask &= (1 << (n-i))-1;
+            }
+            index += __builtin_popcount(mask);
+            if (mask != 0xFFFF) {
+                break;
+            }
+        }
+    } else {
+        const uint16_t* deltas = (const uint16_t*)node->key_deltas;
+        __m128i bias = _mm_set1_epi16((short)0x8000);
+        __m128i target = _mm_xor_si128(_mm_set1_epi16((short)delta), bias);
+        for (int i = 0; i < n; i += 8) {
+            __m128i lanes = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(deltas + i)), bias);
+            int mask = _mm_movemask_epi8(_mm_cmplt_epi16(lanes, target));
+            if (n-i < 8) {
+                mask &= (1 << ((n-i)*2))-1;
+            }
+            index += __builtin_popcount(mask)/2;
+            if (mask != 0xFFFF) {
+                break;
+            }
+        }
+    }
+#else
+    if (node->key_width == 1) {
+        while (index < n && node->key_deltas[index] < delta) {
+            index++;
+        }
+    } else {
+        const uint16_t* deltas = (const uint16_t*)node->key_deltas;
+        while (index < n && deltas[index] < delta) {
+            index++;
+        }
+    }
+#endif
+    if (index < n) {
+        uint32_t stored = node->key_width == 1 ? node->key_deltas[index] : ((const uint16_t*)node->key_deltas)[index];
+        *found = stored == delta;
+    }
+    return index;
+}
+
+struct btree_node* btree_search(uint32_t key, struct btree* helper, struct btree_node* node) {
+
+    if (node == NULL) {
+        return NULL;
+    } else if (node->leaf == 1) {
+        return node;
+    }
+
+    //Internal nodes with a packed key array are searched without touching the records
+    if (helper->config.compress_keys != 0) {
+        if (node->keys_packed == 0) {
+            pack_keys(node);
+        }
+        if (node->key_width != 0) {
+            char found = 0;
+            int index = packed_lower_bound(node, key, &found);
+            if (found == 1) {
+                return node;
+            }
+            return btree_search(key, helper, node->children[index]);
+        }
+    }
+
+    for (int i = 0; i < node->link_count; i++) {
+
+        if (node->key_values[i]->key == key) {
+            return node;
+        }
+        if (key < node->key_values[i]->key) {
+            node = btree_search(key, helper, node->children[i]);
+            break;
+        } else if (i == node->link_count-1) {
+            node = btree_search(key, helper, node->children[i+1]);
+            break;
+        }
+    }
+    return node;
+}
+
+int retreive_key(struct btree_node* flag, uint32_t key) {
+    
+    int i = 0;
+    for(; i < flag->link_count; i++) {
+        if (flag->key_values[i]->key == key) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int retreive_child(struct btree_node* parent, struct btree_node* target) {
+
+    int i = 0;
+    for (; i < parent->child_count; i++) {
+        if (parent->children[i] == target) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int key_shift(struct btree_node* flag, struct btree* my_tree, uint32_t key) {
+
+    invalidate_keys(flag);
+    int i = 0;
+    for (; i < flag->link_count; i++) {
+        if ((flag->key_values[i])->key > key || (flag->key_values[i]) == NULL) {
+            if ((flag->key_values[i]) != NULL) {
+                memmove(flag->key_values+(i+1), flag->key_values+i, sizeof(struct dict*)*(flag->link_count-(i)));
+            }
+            break;
+        }
+    }
+    return i;
+}
+
+int child_shift(struct btree_node* flag, struct btree* my_tree, uint32_t key) {
+
+    int i = 0;
+    for (;i < flag->child_count; i++) {
+        if (flag->children[i]->key_values[0]->key > key || flag->children[i] == NULL) {
+            if ((flag->key_values[i]) != NULL) {
+                memmove(flag->children+(i+1), flag->children+i, sizeof(struct btree_node*)*(flag->child_count-(i)));
+            }
+            break;
+        }
+    }
+    return i;
+}
+
+int child_rearrangement(struct btree_node* flag, struct btree_node* right, struct btree_node* new_root) {
+
+    for (int i = 0; i < flag->child_count; i++) {
+        if (flag->children[i]->key_values[0]->key > flag->key_values[flag->link_count-1]->key) {
+            i++;
+            memmove(right->children, flag->children+i, sizeof(struct btree_node*)*(flag->child_count-i));
+            
+            right->child_count += (flag->child_count-i);
+            for (int j = 0; j < flag->child_count-i; j++) {
+                right->children[j]->parent = right;
+            }
+            flag->child_count -= (flag->child_count-i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void create_right_node(struct btree* my_tree, struct btree_node* flag, struct btree_node* right, int median, char check) {
+
+    //Moving the right half of left sibling key_values into right sibling. Deleting median
+    invalidate_keys(flag);
+    invalidate_keys(right);
+    if (check == 1) {
+        memmove(right->key_values, (flag->key_values+median+1), sizeof(struct dict*)*(median+1));
+        flag->key_values[median] = NULL;
+    } else {
+        memmove(right->key_values, (flag->key_values+median), sizeof(struct dict*)*(median+1));
+        right->parent = flag->parent;
+    }
+    
+    flag->link_count -= flag->link_count-median;
+    if ((my_tree->branching-1) % 2 != 0) {
+        right->link_count += median+1;
+    } else {
+        right->link_count += median;
+    }
+
+    int ret = child_rearrangement(flag, right, flag->parent);
+    if (ret != 0) {
+        right->leaf = 0;
+        flag->leaf = 0;
+    }
+    recount_node(flag);
+    recount_node(right);
+}
+
+void create_new_root(struct btree_node* flag, struct btree* my_tree, int median, int pos) {
+
+    struct btree_node* right = create_node(my_tree);
+    struct btree_node* new_root = create_node(my_tree);
+
+    new_root->key_values[0] = flag->key_values[median];
+    
+    new_root->leaf = 0;
+    new_root->children[1] = right;
+    new_root->children[0] = flag;
+    new_root->child_count += 2;
+    new_root->link_count += 1;
+
+    my_tree->root = new_root;
+
+    flag->parent = new_root;
+    right->parent = new_root;
+    new_root->parent = NULL;
+
+    create_right_node(my_tree, flag, right, median, 1);
+    recount_node(new_root);
+    my_tree->node_count += 2;
+    my_tree->counters.root_growths += 1;
+}
+
+
+void split_node(int pos, struct btree_node* flag, struct btree* my_tree) {
+
+    int median = ((flag->link_count)/2);
+    if (flag->link_count % 2 == 0) {
+        median -= 1;
+    } 
+    my_tree->counters.splits += 1;
+    if (flag == my_tree->root) {
+        create_new_root(flag, my_tree, median, pos);
+        return;
+    }
+
     //Shifting the parent key_values, adding the median to the parent
     int link_pos = key_shift(flag->parent, my_tree, flag->key_values[median]->key);
     flag->parent->key_values[link_pos] = flag->key_values[median];
     flag->parent->link_count++;
 
-    memmove(flag->key_values+median, flag->key_values+median+1, sizeof(struct dict*)*(median+1));
-    flag->link_count--;  
+    memmove(flag->key_values+median, flag->key_values+median+1, sizeof(struct dict*)*(median+1));
+    flag->link_count--;  
+    invalidate_keys(flag);
+
+    if (flag->parent->child_count+1 <= my_tree->branching || flag->parent->key_values[link_pos]->key > 
+    flag->key_values[0]->key) {
+    
+        //Creating a right sibling, adding sibling to the parent
+        struct btree_node* right = create_node(my_tree);
+        int child_pos = child_shift(flag->parent, my_tree, flag->key_values[median]->key);
+        flag->parent->children[child_pos] = right;
+        flag->parent->child_count++;
+
+        create_right_node(my_tree, flag, right, median, 0);
+        my_tree->node_count += 1;
+    } else {
+        recount_node(flag);
+    }
+    if (flag->parent->link_count > my_tree->branching-1)  {
+        split_node(pos, flag->parent, my_tree);
+    }
+    return;
+}   
+
+/*
+* Places an already encrypted record in the tree, the caller holds the tree lock. Returns 1 if the key exists
+*/
+int link_key(struct btree* my_tree, struct dict* new_key) {
+
+    uint32_t key = new_key->key;
+
+    HIST_START(descent);
+    struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
+    HIST_RECORD(my_tree, BTREE_OP_INSERT, BTREE_PHASE_DESCENT, descent);
+    
+    if (my_tree->root == NULL) {
+        flag = create_node(my_tree);
+        my_tree->node_count += 1;
+        my_tree->root = flag;
+    }
+    int existing = retreive_key(flag, key);
+    if (existing != -1) {
+        if (is_tombstone(flag->key_values[existing]) == 0) {
+            return 1;
+        }
+        //A buried key is revived in its slot, the stale queue entry is skipped by the next compaction
+        free_key(my_tree, flag->key_values[existing]);
+        flag->key_values[existing] = new_key;
+        adjust_counts(flag, 1);
+        stamp_record(my_tree, flag, new_key);
+        filter_update(my_tree, key, 1);
+        index_put(my_tree, new_key);
+        enforce_budget(my_tree);
+        return 0;
+    }
+    if (key > my_tree->largest_key) {
+        my_tree->largest_key = key;
+    }
+    int pos = key_shift(flag, my_tree, key);
+
+    flag->key_values[pos] = new_key;
+    flag->link_count += 1;
+    adjust_counts(flag, 1);
+    stamp_record(my_tree, flag, new_key);
+    filter_update(my_tree, key, 1);
+    index_put(my_tree, new_key);
+
+    if (flag->link_count > my_tree->branching-1) {
+        HIST_START(structure);
+        split_node(pos, flag, my_tree);
+        HIST_RECORD(my_tree, BTREE_OP_INSERT, BTREE_PHASE_STRUCTURE, structure);
+    }
+    enforce_budget(my_tree);
+    return 0;
+}
+
+/*
+* Returns 1 if key holds a live record, so an insert of it can fail before any TEA work. Only stores with the filter
+* or the hash index look, and only for keys the filter cannot rule out, others answer 0 and find duplicates once the
+* record is built.
+*/
+int key_present(struct btree* my_tree, uint32_t key) {
+
+    if (my_tree->filter.cells == NULL && my_tree->index.slots == NULL) {
+        return 0;
+    }
+    if (my_tree->filter.cells != NULL && filter_probe(&my_tree->filter, key) == 1) {
+        return 0;
+    }
+    lock_tree(my_tree);
+    struct dict* record = NULL;
+    if (my_tree->index.slots != NULL) {
+        record = index_find(&my_tree->index, key);
+    } else if (my_tree->root != NULL) {
+        struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
+        int index = flag == NULL ? -1 : retreive_key(flag, key);
+        record = index == -1 ? NULL : flag->key_values[index];
+    }
+    char exists = record != NULL && is_tombstone(record) == 0;
+    pthread_mutex_unlock(&my_tree->mutex);
+    return exists;
+}
+
+/*
+* Encrypts plaintext under (encryption_key, nonce) and stores it as key. Returns 1 if key already holds a value.
+* With the filter or the hash index a duplicate is usually turned away by key_present without the TEA cost,
+* without them it is only found once the record is built.
+*/
+int btree_insert(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (count > UINT32_MAX) {
+        return 1;
+    }
+    HIST_START(start);
+    if (key_present(my_tree, key) == 1) {
+        return 1;
+    }
+
+    //Encrypt before taking the tree lock so other operations are not held up by the TEA cost
+    HIST_START(crypto);
+    struct dict* new_key = create_key(key, plaintext, count, encryption_key, nonce, my_tree);
+    HIST_RECORD(my_tree, BTREE_OP_INSERT, BTREE_PHASE_CRYPTO, crypto);
+
+    HIST_START(lock);
+    lock_tree(my_tree);
+    HIST_RECORD(my_tree, BTREE_OP_INSERT, BTREE_PHASE_LOCK, lock);
+    int result = link_key(my_tree, new_key);
+    pthread_mutex_unlock(&my_tree->mutex);
+
+    if (result != 0) {
+        free_key(my_tree, new_key);
+    }
+    HIST_RECORD(my_tree, BTREE_OP_INSERT, BTREE_PHASE_TOTAL, start);
+    return result;
+}
+
+/*
+* Replaces the value of key_values[index] of flag, the caller holds the tree lock and has acquired stream. The
+* ciphertext is written into the existing buffer when it fits, only a growing value needs a new allocation.
+*/
+void rewrite_key(struct btree* my_tree, struct btree_node* flag, int index, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, struct keystream* stream) {
+
+    struct dict* record = flag->key_values[index];
+    size_t capacity = record->capacity;
+    size_t needed = sizeof(uint64_t)*((count + (8-1))/8);
+    plaintext_drop(my_tree, record->key);
+
+    if (is_tombstone(record) == 1 || (needed > capacity && record->data == record->inline_data)) {
+        adjust_counts(flag, is_tombstone(record));
+        if (is_tombstone(record) == 1) {
+            filter_update(my_tree, record->key, 1);
+        }
+        flag->key_values[index] = build_record(my_tree, record->key, plaintext, count, encryption_key, nonce, stream);
+        stamp_record(my_tree, flag, flag->key_values[index]);
+        index_put(my_tree, flag->key_values[index]);
+        free_key(my_tree, record);
+        return;
+    }
+    if (needed > capacity) {
+        free(record->data);
+        record->data = malloc(needed);
+        record->capacity = needed;
+        __atomic_fetch_add(&my_tree->data_bytes, needed - capacity, __ATOMIC_RELAXED);
+    }
+    keystream_release(my_tree, record->stream);
+    record->stream = stream;
+    record->size = count;
+    stamp_record(my_tree, flag, record);
+    record->nonce = nonce;
+    memmove(record->encrypt_key, encryption_key, sizeof(uint32_t)*4);
+    xor_keystream((uint64_t*)record->data, plaintext, count, stream->blocks);
+}
+
+/*
+* Shared body of btree_update and btree_upsert. The keystream, where the TEA cost is, is built before the tree
+* lock is taken, under the lock only the XOR and the pointer swap happen.
+*/
+int write_value(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper, char upsert) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (count > UINT32_MAX) {
+        return 1;
+    }
+    int block_num = ((count + (8-1))/8);
+    struct keystream* stream = keystream_acquire(my_tree, encryption_key, nonce, block_num);
+
+    lock_tree(my_tree);
+    struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
+    int index = flag == NULL ? -1 : retreive_key(flag, key);
+    if (index != -1 && (upsert == 1 || is_tombstone(flag->key_values[index]) == 0)) {
+        rewrite_key(my_tree, flag, index, plaintext, count, encryption_key, nonce, stream);
+        keystream_unpin(my_tree, stream);
+        enforce_budget(my_tree);
+        pthread_mutex_unlock(&my_tree->mutex);
+        return 0;
+    }
+    if (upsert == 0) {
+        pthread_mutex_unlock(&my_tree->mutex);
+        keystream_unpin(my_tree, stream);
+        keystream_release(my_tree, stream);
+        return 1;
+    }
+    link_key(my_tree, build_record(my_tree, key, plaintext, count, encryption_key, nonce, stream));
+    keystream_unpin(my_tree, stream);
+    enforce_budget(my_tree);
+    pthread_mutex_unlock(&my_tree->mutex);
+    return 0;
+}
+
+int btree_update(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+
+    return write_value(key, plaintext, count, encryption_key, nonce, helper, 0);
+}
+
+int btree_upsert(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+
+    return write_value(key, plaintext, count, encryption_key, nonce, helper, 1);
+}
+
+/*
+* Starts a streamed insert of total_size bytes. The record buffer is allocated once here and every append
+* encrypts straight into it, nothing is visible in the tree until btree_insert_finish. Returns NULL on failure.
+*/
+struct btree_ingest * btree_insert_begin(uint32_t key, uint32_t encryption_key[4], uint64_t nonce, size_t total_size, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (total_size > UINT32_MAX) {
+        return NULL;
+    }
+    struct btree_ingest* ingest = malloc(sizeof(struct btree_ingest));
+    ingest->tree = my_tree;
+    ingest->written = 0;
+    ingest->record = alloc_record(my_tree, key, total_size, encryption_key, nonce);
+    ingest->scratch = malloc(STREAM_CHUNK);
+    return ingest;
+}
+
+/*
+* Encrypts the next len bytes at their CTR offset. Only the blocks the chunk touches are run through TEA, at most
+* STREAM_CHUNK bytes of them at a time into the handle's scratch buffer, so the keystream never exists in full
+* while the value is written. Returns 1 if the chunk would run past total_size.
+*/
+int btree_insert_append(struct btree_ingest * ingest, const void * chunk, size_t len) {
+
+    struct dict* record = ingest->record;
+    if (len > record->size - ingest->written) {
+        return 1;
+    }
+    const BYTE* input = (const BYTE*)chunk;
+    while (len > 0) {
+        //A block split between two appends is generated by both
+        size_t offset = ingest->written % 8;
+        size_t piece = len < STREAM_CHUNK - offset ? len : STREAM_CHUNK - offset;
+        uint32_t first = ingest->written/8;
+        fill_keystream_window(ingest->tree, record->encrypt_key, record->nonce, ingest->scratch, first, (ingest->written + piece + (8-1))/8);
+        xor_bytes((BYTE*)record->data + ingest->written, input, (const BYTE*)ingest->scratch + offset, piece);
+        ingest->written += piece;
+        input += piece;
+        len -= piece;
+    }
+    return 0;
+}
+
+void btree_insert_abort(struct btree_ingest * ingest) {
+
+    free_key(ingest->tree, ingest->record);
+    free(ingest->scratch);
+    free(ingest);
+}
+
+/*
+* Publishes a fully written record. Returns 1 if fewer than total_size bytes were appended or the key exists,
+* the handle is released either way. The record's keystream entry is reserved, not generated, the first decrypt
+* builds it.
+*/
+int btree_insert_finish(struct btree_ingest * ingest) {
+
+    struct btree* my_tree = ingest->tree;
+    struct dict* record = ingest->record;
+    if (ingest->written != record->size) {
+        btree_insert_abort(ingest);
+        return 1;
+    }
+    //Padding of the last block is encrypted zeros, the same as xor_keystream leaves it
+    uint32_t block_num = (record->size + (8-1))/8;
+    size_t tail = record->size % 8;
+    if (tail != 0) {
+        fill_keystream_window(my_tree, record->encrypt_key, record->nonce, ingest->scratch, block_num-1, block_num);
+        memcpy((BYTE*)record->data + record->size, (const BYTE*)ingest->scratch + tail, 8 - tail);
+    }
+    record->stream = keystream_reserve(my_tree, record->encrypt_key, record->nonce, block_num);
+    free(ingest->scratch);
+    free(ingest);
+
+    lock_tree(my_tree);
+    int result = link_key(my_tree, record);
+    pthread_mutex_unlock(&my_tree->mutex);
+    if (result != 0) {
+        free_key(my_tree, record);
+    }
+    return result;
+}
+
+/*
+* Live record of key or NULL, from the hash index when there is one and by descending the tree otherwise. The
+* caller holds the tree lock and has checked that the tree is not empty
+*/
+struct dict* find_record(struct btree* my_tree, uint32_t key, int op) {
+
+    struct dict* record = NULL;
+    if (my_tree->index.slots != NULL) {
+        record = index_find(&my_tree->index, key);
+    } else {
+        HIST_START(descent);
+        struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
+        HIST_RECORD(my_tree, op, BTREE_PHASE_DESCENT, descent);
+        int index = retreive_key(flag, key);
+        record = index == -1 ? NULL : flag->key_values[index];
+    }
+    if (record == NULL || is_tombstone(record) == 1) {
+        return NULL;
+    }
+    return record;
+}
+
+int btree_retrieve(uint32_t key, struct info * found, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (filter_absent(my_tree, key) == 1) {
+        return 1;
+    }
+    HIST_START(start);
+    lock_tree(my_tree);
+    HIST_RECORD(my_tree, BTREE_OP_RETRIEVE, BTREE_PHASE_LOCK, start);
+
+    //Checked under the lock, maintenance and range deletes can empty the tree at any time
+    if (my_tree->root == NULL) {
+        pthread_mutex_unlock(&my_tree->mutex);
+        filter_missed(my_tree);
+        HIST_RECORD(my_tree, BTREE_OP_RETRIEVE, BTREE_PHASE_TOTAL, start);
+        return 1;
+    }
+    struct dict* record = find_record(my_tree, key, BTREE_OP_RETRIEVE);
+    if (record != NULL) {
+        found->size = record->size;
+        found->nonce = record->nonce;
+        found->data = record->data;
+        memmove(found->key, record->encrypt_key, sizeof(uint32_t)*4);
+
+        pthread_mutex_unlock(&my_tree->mutex);
+        HIST_RECORD(my_tree, BTREE_OP_RETRIEVE, BTREE_PHASE_TOTAL, start);
+        return 0;
+    }
+    pthread_mutex_unlock(&my_tree->mutex);
+    filter_missed(my_tree);
+    HIST_RECORD(my_tree, BTREE_OP_RETRIEVE, BTREE_PHASE_TOTAL, start);
+    return 1;
+}
+
+/*
+* Copies the plaintext of key into output, the caller holds the tree lock. Returns 1 if the key does not exist
+*/
+int decrypt_key(struct btree* my_tree, uint32_t key, void * output) {
+
+    if (my_tree->root == NULL) {
+        return 1;
+    }
+    struct dict* record = find_record(my_tree, key, BTREE_OP_DECRYPT);
+    if (record == NULL) {
+        return 1;
+    }
+    HIST_START(crypto);
+    if (plaintext_lookup(my_tree, record, output) == 0) {
+        HIST_RECORD(my_tree, BTREE_OP_DECRYPT, BTREE_PHASE_CRYPTO, crypto);
+        return 0;
+    }
+    uint64_t* blocks = keystream_blocks(my_tree, record->stream);
+    xor_bytes((BYTE*)output, (const BYTE*)record->data, (const BYTE*)blocks, record->size);
+    plaintext_store(my_tree, record, output);
+    enforce_budget(my_tree);
+    HIST_RECORD(my_tree, BTREE_OP_DECRYPT, BTREE_PHASE_CRYPTO, crypto);
+
+    return 0;
+}
+
+int btree_decrypt(uint32_t key, void * output, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (filter_absent(my_tree, key) == 1) {
+        return 1;
+    }
+    HIST_START(start);
+    lock_tree(my_tree);
+    HIST_RECORD(my_tree, BTREE_OP_DECRYPT, BTREE_PHASE_LOCK, start);
+
+    int result = decrypt_key(my_tree, key, output);
+
+    pthread_mutex_unlock(&my_tree->mutex);
+    if (result != 0) {
+        filter_missed(my_tree);
+    }
+    HIST_RECORD(my_tree, BTREE_OP_DECRYPT, BTREE_PHASE_TOTAL, start);
+    return result;
+}
+
+/*
+* Decrypts the value of key in chunk_size pieces (STREAM_CHUNK when 0) through one reusable buffer and hands
+* each piece to callback. The tree lock is only held while a chunk is decrypted, never across the callback, and
+* every chunk looks the record up again. Returns 1 if the key is missing, the callback stops the stream, or the
+* value is rewritten or deleted part way, in which case the chunks already delivered belong to the old value.
+*/
+int btree_decrypt_stream(uint32_t key, btree_chunk_callback callback, void * context, size_t chunk_size, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (chunk_size == 0) {
+        chunk_size = STREAM_CHUNK;
+    }
+    if (filter_absent(my_tree, key) == 1) {
+        return 1;
+    }
+    BYTE* buffer = NULL;
+    size_t offset = 0;
+    size_t size = 0;
+    uint32_t stamp = 0;
+    int result = 0;
+
+    do {
+        lock_tree(my_tree);
+        struct dict* record = my_tree->root == NULL ? NULL : find_record(my_tree, key, BTREE_OP_DECRYPT);
+        if (record == NULL || (offset != 0 && record->stamp != stamp)) {
+            pthread_mutex_unlock(&my_tree->mutex);
+            if (offset == 0) {
+                filter_missed(my_tree);
+            }
+            result = 1;
+            break;
+        }
+        if (offset == 0) {
+            size = record->size;
+            stamp = record->stamp;
+            if (size == 0) {
+                pthread_mutex_unlock(&my_tree->mutex);
+                break;
+            }
+            buffer = (BYTE*)malloc(size < chunk_size ? size : chunk_size);
+        }
+        size_t len = size - offset < chunk_size ? size - offset : chunk_size;
+        uint64_t* blocks = keystream_blocks(my_tree, record->stream);
+        xor_bytes(buffer, (const BYTE*)record->data + offset, (const BYTE*)blocks + offset, len);
+        enforce_budget(my_tree);
+        pthread_mutex_unlock(&my_tree->mutex);
+
+        if (callback(buffer, len, context) != 0) {
+            result = 1;
+            break;
+        }
+        offset += len;
+    } while (offset < size);
+
+    free(buffer);
+    return result;
+}
+
+/*
+* Chunk callback for btree_decrypt_to_fd, retries short writes and interrupted calls
+*/
+int write_chunk(const void * chunk, size_t len, void * context) {
+
+    int fd = *(int*)context;
+    const BYTE* data = (const BYTE*)chunk;
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+/*
+* Writes the decrypted value of key to fd without ever holding the whole plaintext, see btree_decrypt_stream
+*/
+int btree_decrypt_to_fd(uint32_t key, int fd, void * helper) {
+
+    return btree_decrypt_stream(key, &write_chunk, &fd, STREAM_CHUNK, helper);
+}
+
+void delete_key(struct btree* my_tree, struct btree_node* flag, int index) {
+
+    free_key(my_tree, flag->key_values[index]);
+
+    flag->key_values[index] = NULL;
+    memmove(flag->key_values+index, flag->key_values+(index+1), sizeof(struct dict*)*(flag->link_count-(index)));
+    invalidate_keys(flag);
+
+    flag->link_count -= 1;
+}
+
+void left_swap(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* left, int target_index) {
+
+    target->key_values[0] = parent->key_values[target_index];
+    parent->key_values[target_index] = left->key_values[left->link_count-1];
+    left->key_values[left->link_count-1] = NULL;
+
+    target->link_count += 1;
+    left->link_count -= 1;
+    invalidate_keys(target);
+    invalidate_keys(parent);
+    invalidate_keys(left);
+    recount_node(target);
+    recount_node(left);
+    my_tree->counters.rotations += 1;
+}
+
+void right_swap(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* right, int target_index) {
+
+    target->key_values[0] = parent->key_values[target_index-1];
+    parent->key_values[target_index-1] = right->key_values[0];
+    memmove(right->key_values, right->key_values+1, sizeof(struct dict*)*(right->link_count-1));
+
+    target->link_count += 1;
+    right->link_count -= 1;
+    invalidate_keys(target);
+    invalidate_keys(parent);
+    invalidate_keys(right);
+    recount_node(target);
+    recount_node(right);
+    my_tree->counters.rotations += 1;
+}
+
+void left_push(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* left, int target_index) {
+
+    struct btree_node* largest_child = left->children[left->child_count-1];
+    memmove(target->children+1, target->children, sizeof(struct btree_node*)*(target->child_count));
+    target->children[0] = largest_child;
+    left->children[left->child_count-1] = NULL;
+    largest_child->parent = target;
+
+    target->child_count += 1;
+    left->child_count -= 1;
+    recount_node(target);
+    recount_node(left);
+}
+
+void right_push(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* right, int target_index) {
+
+    struct btree_node* smallest_child = right->children[0];
+    target->children[target->child_count] = smallest_child;
+    memmove(right->children, right->children+1, sizeof(struct btree_node*)*(right->child_count-1));
+    smallest_child->parent = target;
+
+    target->child_count += 1;
+    right->child_count -= 1;
+    recount_node(target);
+    recount_node(right);
+}
+
+struct btree_node* left_merge(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* left, int target_index) {
+
+    left->key_values[1] = parent->key_values[target_index];
+    parent->children[target_index+1] = NULL;
+    left->parent = parent;
+
+    memmove(parent->key_values+target_index, parent->key_values+target_index+1, sizeof(struct dict*)*(parent->link_count-(target_index+1)));
+
+    memmove(parent->children+target_index+1, parent->children+target_index+2, sizeof(struct btree_node*)*(parent->child_count-(target_index+1)));
+    memmove(left->children+left->child_count, target->children, sizeof(struct btree_node*)*(target->child_count));
+
+    for (int i = 0; i < target->child_count; i++) {
+        target->children[i]->parent = left;
+    }
+
+    parent->link_count -= 1;
+    parent->child_count -= 1;
+    my_tree->node_count -= 1;
+    my_tree->counters.merges += 1;
+    left->link_count += 1;
+    target->link_count -= 1;
+    left->child_count += target->child_count;
+    invalidate_keys(left);
+    invalidate_keys(parent);
+    recount_node(left);
+    free_node(my_tree, target);
+
+    return left;
+}
+
+struct btree_node* right_merge(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* right, int target_index) {
+
+    right->key_values[1] = right->key_values[0];
+    right->key_values[0] = parent->key_values[target_index];
+    right->parent = parent;
+    
+    memmove(parent->children+target_index, parent->children+target_index+1, sizeof(struct btree_node*)*(parent->child_count-(target_index+1)));
+    memmove(parent->key_values+target_index, parent->key_values+target_index+1, sizeof(struct dict*)*(parent->link_count-(target_index+1)));
+
+    memmove(right->children+target->child_count, right->children, sizeof(struct btree_node*)*(right->child_count));
+    memmove(right->children, target->children, sizeof(struct btree_node*)*(target->child_count));
+
+    for (int i = 0; i < target->child_count; i++) {
+        target->children[i]->parent = right;
+    }
+
+    target->link_count -= 1;
+    parent->child_count -= 1;
+    parent->link_count -= 1;
+    my_tree->node_count -= 1;
+    my_tree->counters.merges += 1;
+    right->link_count += 1;
+    right->child_count += target->child_count;
+    invalidate_keys(right);
+    invalidate_keys(parent);
+    recount_node(right);
+    free_node(my_tree, target);
+
+    return right;
+}
+
+int rearrange_keys(struct btree* my_tree, struct btree_node* target, uint32_t key) {
+
+    if (target == my_tree->root && target->link_count < 1) {
+        //An empty leaf root has no child to promote, the tree is now empty
+        my_tree->root = target->child_count > 0 ? target->children[0] : NULL;
+        if (my_tree->root != NULL) {
+            my_tree->root->parent = NULL;
+        }
+        free_node(my_tree, target);
+        my_tree->node_count -= 1;
+        return 0;
+    }
+
+    int left_index = (retreive_child(target->parent, target)-1);
+    int right_index = (left_index+2);
+
+    struct btree_node* left = NULL;
+    struct btree_node* right = NULL;
+    if (left_index >= 0) {
+         left = target->parent->children[left_index];
+    }
+    if (target->parent->child_count-1 >= right_index) {
+        right = target->parent->children[right_index];
+    }
+
+    int check = 0;
+    if (left != NULL && (left->link_count > 1 && left->leaf == 1)) {
+        left_swap(my_tree, target->parent, target, left, left_index);
+        check++;
+    }
+    if ((right != NULL && check == 0) && (right->link_count > 1 && right->leaf == 1)) {
+        right_swap(my_tree, target->parent, target, right, right_index);
+        check++;
+    }
+    if (check == 0 && (left != NULL && left->leaf == 0) && left->link_count > 1) {
+        left_swap(my_tree, target->parent, target, left, left_index);
+        left_push(my_tree, target->parent, target, left, left_index);
+        check++;
+    }
+    if (check == 0 && (right != NULL && right->leaf == 0) && right->link_count > 1) {
+        right_swap(my_tree, target->parent, target, right, right_index);
+        right_push(my_tree, target->parent, target, right, right_index);
+        check++;
+    }
+    if (check == 0) {
+        if (left != NULL) {
+            target = left_merge(my_tree, target->parent, target, left, left_index);
+        } else if (right != NULL) {
+            target = right_merge(my_tree, target->parent, target, right, right_index-1);
+        }
+        check++;
+    }
+    if (target->parent->link_count <= 0) {
+        rearrange_keys(my_tree, target->parent, key);
+    }
+    return 0;
+}
+
+/*
+* Unlinks key_values[flag_index] of flag and rebalances, the caller holds the tree lock
+*/
+int remove_key(struct btree* my_tree, struct btree_node* flag, int flag_index, uint32_t key) {
+
+    struct btree_node* swap = NULL;
+    struct btree_node* target = flag;
+    adjust_counts(flag, -(int64_t)(is_tombstone(flag->key_values[flag_index]) == 0));
+    //Only the removed record leaves the index, the predecessor moved up below keeps its address
+    index_remove(my_tree, flag->key_values[flag_index]->key);
+
+    if(flag->leaf != 1) {
+
+        swap = btree_search(my_tree->largest_key, my_tree, flag->children[flag_index]);
+        free_key(my_tree, flag->key_values[flag_index]);
+
+        //The predecessor moves up into flag, only the nodes below flag lose it
+        int64_t moved = is_tombstone(swap->key_values[swap->link_count-1]) == 0;
+        for (struct btree_node* node = swap; node != flag; node = node->parent) {
+            node->live_count -= moved;
+        }
+
+        flag->key_values[flag_index] = swap->key_values[swap->link_count-1];
+        swap->key_values[swap->link_count-1] = NULL;
+
+        swap->link_count -= 1;
+        invalidate_keys(flag);
+        invalidate_keys(swap);
+        target = swap;
+        
+    } else {
+        delete_key(my_tree, flag, flag_index);
+    }
+    if (target->link_count >= 1) {
+        return 0;
+    }
+    return rearrange_keys(my_tree, target, key);
+}
+
+/*
+* Queues a buried key for the maintenance thread, which is woken once a budget worth is waiting. The caller holds
+* the tree lock
+*/
+void queue_tombstone(struct btree* my_tree, uint32_t key) {
+
+    struct btree_maintenance* maintenance = &my_tree->maintenance;
+    if (maintenance->count == maintenance->capacity) {
+        maintenance->capacity = maintenance->capacity == 0 ? MAINTENANCE_BUDGET : maintenance->capacity*2;
+        maintenance->keys = realloc(maintenance->keys, sizeof(uint32_t)*maintenance->capacity);
+    }
+    maintenance->keys[maintenance->count] = key;
+    maintenance->count += 1;
+
+    if (maintenance->count == my_tree->config.maintenance_budget) {
+        pthread_mutex_lock(&maintenance->mutex);
+        pthread_cond_signal(&maintenance->wake);
+        pthread_mutex_unlock(&maintenance->mutex);
+    }
+}
+
+/*
+* Notes that keys [lo, hi] were deleted so the next checkpoint replays it, the caller holds the tree lock. A range
+* touching the last one noted is folded into it, so ascending deletes log a single range.
+*/
+void checkpoint_deleted(struct btree* my_tree, uint32_t lo, uint32_t hi) {
+
+    struct btree_checkpointer* checkpoint = &my_tree->checkpoint;
+    if (my_tree->config.checkpoint_path == NULL) {
+        return;
+    }
+    if (checkpoint->count > 0) {
+        struct checkpoint_range* last = &checkpoint->ranges[checkpoint->count-1];
+        if (lo <= (uint64_t)last->hi+1 && (uint64_t)hi+1 >= last->lo) {
+            last->lo = lo < last->lo ? lo : last->lo;
+            last->hi = hi > last->hi ? hi : last->hi;
+            return;
+        }
+    }
+    if (checkpoint->count == checkpoint->capacity) {
+        checkpoint->capacity = checkpoint->capacity == 0 ? MAINTENANCE_BUDGET : checkpoint->capacity*2;
+        checkpoint->ranges = realloc(checkpoint->ranges, sizeof(struct checkpoint_range)*checkpoint->capacity);
+    }
+    checkpoint->ranges[checkpoint->count].lo = lo;
+    checkpoint->ranges[checkpoint->count].hi = hi;
+    checkpoint->count += 1;
+}
+
+/*
+* Drops the payload and keystream of a record but keeps its slot, the caller holds the tree lock
+*/
+void bury_key(struct btree* my_tree, struct dict* record) {
+
+    keystream_release(my_tree, record->stream);
+    if (record->data != record->inline_data) {
+        free(record->data);
+        record->data = NULL;
+        __atomic_fetch_sub(&my_tree->data_bytes, record->capacity, __ATOMIC_RELAXED);
+        record->capacity = 0;
+    }
+    record->stream = NULL;
+    record->size = 0;
+    queue_tombstone(my_tree, record->key);
+}
+
+int btree_delete(uint32_t key, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    HIST_START(start);
+    lock_tree(my_tree);
+    HIST_RECORD(my_tree, BTREE_OP_DELETE, BTREE_PHASE_LOCK, start);
+
+    //Checked under the lock, maintenance and range deletes can empty the tree at any time
+    if (my_tree->root == NULL) {
+        pthread_mutex_unlock(&my_tree->mutex);
+        HIST_RECORD(my_tree, BTREE_OP_DELETE, BTREE_PHASE_TOTAL, start);
+        return 1;
+    }
+    HIST_START(descent);
+    struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
+    HIST_RECORD(my_tree, BTREE_OP_DELETE, BTREE_PHASE_DESCENT, descent);
+    
+    int flag_index = flag == NULL ? -1 : retreive_key(flag, key);
+    if (flag_index == -1 || is_tombstone(flag->key_values[flag_index]) == 1) {
+        pthread_mutex_unlock(&my_tree->mutex);
+        HIST_RECORD(my_tree, BTREE_OP_DELETE, BTREE_PHASE_TOTAL, start);
+        return 1;
+    }
+
+    HIST_START(structure);
+    int ret = 0;
+    plaintext_drop(my_tree, key);
+    filter_update(my_tree, key, -1);
+    checkpoint_deleted(my_tree, key, key);
+    if (my_tree->config.tombstone_deletes != 0) {
+        bury_key(my_tree, flag->key_values[flag_index]);
+        adjust_counts(flag, -1);
+    } else {
+        ret = remove_key(my_tree, flag, flag_index, key);
+    }
+    HIST_RECORD(my_tree, BTREE_OP_DELETE, BTREE_PHASE_STRUCTURE, structure);
+    pthread_mutex_unlock(&my_tree->mutex);
+    HIST_RECORD(my_tree, BTREE_OP_DELETE, BTREE_PHASE_TOTAL, start);
+    return ret;
+}
+
+int compare_keys(const void* a, const void* b) {
+
+    uint32_t left = *(const uint32_t*)a;
+    uint32_t right = *(const uint32_t*)b;
+    return (left > right) - (left < right);
+}
+
+/*
+* Unlinks up to budget buried records under one hold of the tree lock. The batch is sorted and buried keys close
+* enough that their range holds at most budget*branching live records are rebuilt together by compact_range, so
+* the underfull nodes they leave are merged once per range instead of once per key. A buried key with no neighbour
+* in reach is unlinked on its own. Returns the number of queue entries consumed, entries for keys that were revived
+* or already removed count but unlink nothing.
+*/
+uint32_t compact_tombstones(struct btree* my_tree, uint32_t budget, uint64_t* removed) {
+
+    struct btree_maintenance* maintenance = &my_tree->maintenance;
+    lock_tree(my_tree);
+    uint32_t consumed = budget < maintenance->count ? budget : maintenance->count;
+    maintenance->count -= consumed;
+
+    //The batch is sorted in place past the end of the queue, nothing is queued while the lock is held
+    uint32_t* keys = maintenance->keys + maintenance->count;
+    qsort(keys, consumed, sizeof(uint32_t), compare_keys);
+    uint32_t buried = 0;
+    for (uint32_t i = 0; i < consumed; i++) {
+        if (buried > 0 && keys[buried-1] == keys[i]) {
+            continue;
+        }
+        struct btree_node* flag = btree_search(keys[i], my_tree, my_tree->root);
+        int flag_index = flag == NULL ? -1 : retreive_key(flag, keys[i]);
+        if (flag_index != -1 && is_tombstone(flag->key_values[flag_index]) == 1) {
+            keys[buried++] = keys[i];
+        }
+    }
+
+    //Ranks count live records only, so unlinking a range leaves the rank of every later buried key unchanged and
+    //the rank that ends one group is the base of the next
+    uint64_t reach = (uint64_t)budget*my_tree->branching;
+    uint32_t first = 0;
+    uint64_t base = buried > 0 ? count_below(my_tree->root, keys[0]) : 0;
+    while (first < buried) {
+
+        uint32_t last = first;
+        uint64_t next = 0;
+        while (last+1 < buried) {
+            next = count_below(my_tree->root, keys[last+1]);
+            if (next - base > reach) {
+                break;
+            }
+            last++;
+        }
+        if (last == first) {
+            struct btree_node* flag = btree_search(keys[first], my_tree, my_tree->root);
+            remove_key(my_tree, flag, retreive_key(flag, keys[first]), keys[first]);
+            *removed += 1;
+        } else {
+            *removed += compact_range(my_tree, keys[first], keys[last]);
+        }
+        first = last+1;
+        base = next;
+    }
+    pthread_mutex_unlock(&my_tree->mutex);
+    return consumed;
+}
+
+/*
+* Removes every buried record now instead of waiting for the maintenance thread. Returns the number removed
+*/
+uint64_t btree_compact(void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    uint64_t removed = 0;
+    while (compact_tombstones(my_tree, my_tree->config.maintenance_budget, &removed) > 0);
+    return removed;
+}
+
+/*
+* Absolute CLOCK_REALTIME time ms milliseconds from now, for pthread_cond_timedwait
+*/
+void deadline_after(struct timespec* deadline, uint64_t ms) {
+
+    clock_gettime(CLOCK_REALTIME, deadline);
+    uint64_t nsec = deadline->tv_nsec + (ms % 1000)*1000000ULL;
+    deadline->tv_sec += ms/1000 + nsec/1000000000ULL;
+    deadline->tv_nsec = nsec % 1000000000ULL;
+}
+
+/*
+* Wakes every maintenance_interval_ms, or early once a budget worth of tombstones is queued, and compacts in
+* budget sized batches so request threads get the tree lock back between batches
+*/
+void* maintenance_worker(void* arg) {
+
+    struct btree* my_tree = (struct btree*)arg;
+    struct btree_maintenance* maintenance = &my_tree->maintenance;
+    uint64_t interval = my_tree->config.maintenance_interval_ms;
+
+    pthread_mutex_lock(&maintenance->mutex);
+    while (maintenance->stopping == 0) {
+
+        struct timespec deadline;
+        deadline_after(&deadline, interval);
+        pthread_cond_timedwait(&maintenance->wake, &maintenance->mutex, &deadline);
+        if (maintenance->stopping != 0) {
+            break;
+        }
+        pthread_mutex_unlock(&maintenance->mutex);
+
+        uint64_t removed = 0;
+        while (compact_tombstones(my_tree, my_tree->config.maintenance_budget, &removed) > 0) {
+            sched_yield();
+        }
+        pthread_mutex_lock(&maintenance->mutex);
+    }
+    pthread_mutex_unlock(&maintenance->mutex);
+    return NULL;
+}
+
+void free_maintenance(struct btree* my_tree) {
+
+    struct btree_maintenance* maintenance = &my_tree->maintenance;
+    if (maintenance->running == 1) {
+        pthread_mutex_lock(&maintenance->mutex);
+        maintenance->stopping = 1;
+        pthread_cond_signal(&maintenance->wake);
+        pthread_mutex_unlock(&maintenance->mutex);
+        pthread_join(maintenance->thread, NULL);
+    }
+    pthread_mutex_destroy(&maintenance->mutex);
+    pthread_cond_destroy(&maintenance->wake);
+    free(maintenance->keys);
+}
+
+int tree_height(struct btree_node* node) {
+
+    if (node == NULL) {
+        return -1;
+    }
+    int height = 0;
+    while (node->leaf == 0) {
+        node = node->children[0];
+        height++;
+    }
+    return height;
+}
+
+/*
+* Splits an overfull node and carries the median up until every node on the path fits again. Returns the root
+*/
+struct btree_node* split_upward(struct btree* my_tree, struct btree_node* node) {
+
+    while (node->link_count > my_tree->branching-1) {
+
+        int median = node->link_count/2;
+        struct btree_node* right = create_node(my_tree);
+        my_tree->node_count += 1;
+        my_tree->counters.splits += 1;
+
+        right->leaf = node->leaf;
+        right->link_count = node->link_count-median-1;
+        memmove(right->key_values, node->key_values+median+1, sizeof(struct dict*)*right->link_count);
+        if (node->leaf == 0) {
+            right->child_count = node->child_count-median-1;
+            memmove(right->children, node->children+median+1, sizeof(struct btree_node*)*right->child_count);
+            for (int i = 0; i < right->child_count; i++) {
+                right->children[i]->parent = right;
+            }
+            node->child_count = median+1;
+        }
+        struct dict* up = node->key_values[median];
+        node->link_count = median;
+        invalidate_keys(node);
+        recount_node(node);
+        recount_node(right);
+
+        struct btree_node* parent = node->parent;
+        if (parent == NULL) {
+            parent = create_node(my_tree);
+            my_tree->node_count += 1;
+            my_tree->counters.root_growths += 1;
+            parent->leaf = 0;
+            parent->children[0] = node;
+            parent->child_count = 1;
+            parent->live_count = node->live_count + right->live_count + (is_tombstone(up) == 0);
+            parent->max_stamp = node->max_stamp > right->max_stamp ? node->max_stamp : right->max_stamp;
+            raise_stamps(parent, up->stamp);
+            node->parent = parent;
+        }
+        int pos = retreive_child(parent, node);
+        memmove(parent->key_values+pos+1, parent->key_values+pos, sizeof(struct dict*)*(parent->link_count-pos));
+        parent->key_values[pos] = up;
+        parent->link_count += 1;
+        invalidate_keys(parent);
+        memmove(parent->children+pos+2, parent->children+pos+1, sizeof(struct btree_node*)*(parent->child_count-pos-1));
+        parent->children[pos+1] = right;
+        parent->child_count += 1;
+        right->parent = parent;
+
+        node = parent;
+    }
+    while (node->parent != NULL) {
+        node = node->parent;
+    }
+    return node;
+}
+
+/*
+* Joins two trees around a separator, every key of left is below sep and every key of right above it. The
+* shorter tree is hung off the spine of the taller one, so only that one path may split.
+*/
+struct btree_part join_trees(struct btree* my_tree, struct btree_part left, struct dict* sep, struct btree_part right) {
+
+    struct btree_part joined;
+    if (left.root != NULL && left.height == right.height) {
+        joined.root = create_node(my_tree);
+        my_tree->node_count += 1;
+        my_tree->counters.root_growths += 1;
+
+        joined.root->leaf = 0;
+        joined.root->key_values[0] = sep;
+        joined.root->link_count = 1;
+        joined.root->children[0] = left.root;
+        joined.root->children[1] = right.root;
+        joined.root->child_count = 2;
+        left.root->parent = joined.root;
+        right.root->parent = joined.root;
+        recount_node(joined.root);
+        joined.height = left.height+1;
+        return joined;
+    }
+    if (left.root == NULL && right.root == NULL) {
+        joined.root = create_node(my_tree);
+        my_tree->node_count += 1;
+        joined.root->key_values[0] = sep;
+        joined.root->link_count = 1;
+        recount_node(joined.root);
+        joined.height = 0;
+        return joined;
+    }
+
+    struct btree_node* spine;
+    struct btree_part hung = left.height > right.height ? right : left;
+    uint64_t added = (is_tombstone(sep) == 0) + (hung.root != NULL ? hung.root->live_count : 0);
+    if (left.height > right.height) {
+        spine = left.root;
+        for (int h = left.height; h > right.height+1; h--) {
+            spine = spine->children[spine->child_count-1];
+        }
+        spine->key_values[spine->link_count] = sep;
+        spine->link_count += 1;
+        invalidate_keys(spine);
+        if (right.root != NULL) {
+            spine->children[spine->child_count] = right.root;
+            spine->child_count += 1;
+            right.root->parent = spine;
+        }
+        joined = left;
+    } else {
+        spine = right.root;
+        for (int h = right.height; h > left.height+1; h--) {
+            spine = spine->children[0];
+        }
+        memmove(spine->key_values+1, spine->key_values, sizeof(struct dict*)*spine->link_count);
+        spine->key_values[0] = sep;
+        spine->link_count += 1;
+        invalidate_keys(spine);
+        if (left.root != NULL) {
+            memmove(spine->children+1, spine->children, sizeof(struct btree_node*)*spine->child_count);
+            spine->children[0] = left.root;
+            spine->child_count += 1;
+            left.root->parent = spine;
+        }
+        joined = right;
+    }
+    adjust_counts(spine, added);
+    raise_stamps(spine, hung.root != NULL && hung.root->max_stamp > sep->stamp ? hung.root->max_stamp : sep->stamp);
+    struct btree_node* root = split_upward(my_tree, spine);
+    if (root != joined.root) {
+        joined.root = root;
+        joined.height += 1;
+    }
+    return joined;
+}
+
+/*
+* Node holding keys [from, to) and children [from, to] of source, or the lone child when the range has no keys
+*/
+struct btree_part slice_node(struct btree* my_tree, struct btree_node* source, int height, int from, int to, struct btree_node* reuse) {
+
+    struct btree_part part;
+    if (from == to) {
+        part.root = source->children[from];
+        part.root->parent = NULL;
+        part.height = height-1;
+        return part;
+    }
+    struct btree_node* node = reuse;
+    if (node == NULL) {
+        node = create_node(my_tree);
+        my_tree->node_count += 1;
+        node->leaf = 0;
+    }
+    memmove(node->key_values, source->key_values+from, sizeof(struct dict*)*(to-from));
+    memmove(node->children, source->children+from, sizeof(struct btree_node*)*(to-from+1));
+    node->link_count = to-from;
+    node->child_count = to-from+1;
+    invalidate_keys(node);
+    node->parent = NULL;
+    for (int i = 0; i < node->child_count; i++) {
+        node->children[i]->parent = node;
+    }
+    recount_node(node);
+    part.root = node;
+    part.height = height;
+    return part;
+}
+
+/*
+* Splits a tree into the keys below key and the keys from key upwards. Each level on the search path is cut in
+* two and the halves are joined back onto the pieces coming up from below, nothing off the path is touched.
+*/
+void split_tree(struct btree* my_tree, struct btree_part tree, uint32_t key, struct btree_part* left, struct btree_part* right) {
+
+    struct btree_part empty = {NULL, -1};
+    *left = empty;
+    *right = empty;
+    struct btree_node* node = tree.root;
+    if (node == NULL) {
+        return;
+    }
+    node->parent = NULL;
+
+    int n = node->link_count;
+    int i = 0;
+    while (i < n && node->key_values[i]->key < key) {
+        i++;
+    }
+
+    if (node->leaf == 1) {
+        if (i == 0) {
+            *right = tree;
+        } else if (i == n) {
+            *left = tree;
+        } else {
+            struct btree_node* upper = create_node(my_tree);
+            my_tree->node_count += 1;
+            memmove(upper->key_values, node->key_values+i, sizeof(struct dict*)*(n-i));
+            upper->link_count = n-i;
+            node->link_count = i;
+            invalidate_keys(node);
+            recount_node(node);
+            recount_node(upper);
+            left->root = node;
+            left->height = 0;
+            right->root = upper;
+            right->height = 0;
+        }
+        return;
+    }
+
+    struct btree_part child = {node->children[i], tree.height-1};
+    struct btree_part child_left;
+    struct btree_part child_right;
+    split_tree(my_tree, child, key, &child_left, &child_right);
+
+    //Slice the keys around the split child out of node before reusing it for one of the halves
+    struct dict* left_sep = i > 0 ? node->key_values[i-1] : NULL;
+    struct dict* right_sep = i < n ? node->key_values[i] : NULL;
+    struct btree_part left_part = empty;
+    struct btree_part right_part = empty;
+    char reused = 0;
+    if (i < n) {
+        right_part = slice_node(my_tree, node, tree.height, i+1, n, NULL);
+    }
+    if (i > 0) {
+        reused = i-1 > 0;
+        left_part = slice_node(my_tree, node, tree.height, 0, i-1, reused == 1 ? node : NULL);
+    }
+    if (reused == 0) {
+        node->link_count = 0;
+        free_node(my_tree, node);
+        my_tree->node_count -= 1;
+    }
+
+    *left = left_sep != NULL ? join_trees(my_tree, left_part, left_sep, child_left) : child_left;
+    *right = right_sep != NULL ? join_trees(my_tree, child_right, right_sep, right_part) : child_right;
+}
+
+/*
+* Joins two trees without a separator by splitting the smallest key off the right one
+*/
+struct btree_part concat_trees(struct btree* my_tree, struct btree_part left, struct btree_part right) {
+
+    if (left.root == NULL) {
+        return right;
+    }
+    if (right.root == NULL) {
+        return left;
+    }
+    struct btree_node* smallest = right.root;
+    while (smallest->leaf == 0) {
+        smallest = smallest->children[0];
+    }
+    uint32_t min_key = smallest->key_values[0]->key;
+
+    struct btree_part first = right;
+    struct btree_part rest = {NULL, -1};
+    if (min_key != UINT32_MAX) {
+        split_tree(my_tree, right, min_key+1, &first, &rest);
+    }
+    struct dict* sep = first.root->key_values[0];
+    first.root->link_count = 0;
+    free_node(my_tree, first.root);
+    my_tree->node_count -= 1;
+
+    return join_trees(my_tree, left, sep, rest);
+}
+
+/*
+* Frees a detached subtree with all of its records in one pass, taking the live keys out of the filter. Returns the
+* number of live records freed
+*/
+uint64_t reclaim_subtree(struct btree* my_tree, struct btree_node* node) {
+
+    if (node == NULL) {
+        return 0;
+    }
+    uint64_t count = 0;
+    for (int i = 0; i < node->link_count; i++) {
+        index_remove(my_tree, node->key_values[i]->key);
+        if (is_tombstone(node->key_values[i]) == 0) {
+            filter_update(my_tree, node->key_values[i]->key, -1);
+            count += 1;
+        }
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        count += reclaim_subtree(my_tree, node->children[i]);
+    }
+    free_node(my_tree, node);
+    my_tree->node_count -= 1;
+    return count;
+}
+
+/*
+* Deletes every key in [lo, hi]. Subtrees entirely inside the range are detached and freed whole, only the two
+* boundary paths are rebuilt. Returns the number of keys deleted.
+*/
+uint64_t btree_delete_range(uint32_t lo, uint32_t hi, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (lo > hi) {
+        return 0;
+    }
+    lock_tree(my_tree);
+    if (my_tree->root == NULL) {
+        pthread_mutex_unlock(&my_tree->mutex);
+        return 0;
+    }
+    struct btree_part whole = {my_tree->root, tree_height(my_tree->root)};
+    struct btree_part below;
+    struct btree_part rest;
+    struct btree_part inside;
+    struct btree_part above = {NULL, -1};
+
+    split_tree(my_tree, whole, lo, &below, &rest);
+    if (hi == UINT32_MAX) {
+        inside = rest;
+    } else {
+        split_tree(my_tree, rest, hi+1, &inside, &above);
+    }
+    uint64_t deleted = reclaim_subtree(my_tree, inside.root);
+    plaintext_drop_range(my_tree, lo, hi);
+    if (deleted > 0) {
+        checkpoint_deleted(my_tree, lo, hi);
+    }
+
+    my_tree->root = concat_trees(my_tree, below, above).root;
+    pthread_mutex_unlock(&my_tree->mutex);
+    return deleted;
+}
+
+/*
+* Smallest and largest key stored under node, tombstones included. The tree must not be empty
+*/
+uint32_t min_key(struct btree_node* node) {
+
+    while (node->leaf == 0) {
+        node = node->children[0];
+    }
+    return node->key_values[0]->key;
+}
+
+uint32_t max_key(struct btree_node* node) {
+
+    while (node->leaf == 0) {
+        node = node->children[node->child_count-1];
+    }
+    return node->key_values[node->link_count-1]->key;
+}
+
+/*
+* Appends every record under node to records in key order
+*/
+void collect_records(struct btree_node* node, struct dict** records, uint64_t* count) {
+
+    for (int i = 0; i < node->link_count; i++) {
+        if (node->leaf == 0) {
+            collect_records(node->children[i], records, count);
+        }
+        records[*count] = node->key_values[i];
+        *count += 1;
+    }
+    if (node->leaf == 0) {
+        collect_records(node->children[node->link_count], records, count);
+    }
+}
+
+/*
+* Frees the nodes of a subtree but not its records, which the caller has taken
+*/
+void release_nodes(struct btree* my_tree, struct btree_node* node) {
 
-    if (flag->parent->child_count+1 <= my_tree->branching || flag->parent->key_values[link_pos]->key > 
-    flag->key_values[0]->key) {
-    
-        //Creating a right sibling, adding sibling to the parent
-        struct btree_node* right = create_node(my_tree);
-        int child_pos = child_shift(flag->parent, my_tree, flag->key_values[median]->key);
-        flag->parent->children[child_pos] = right;
-        flag->parent->child_count++;
+    for (int i = 0; i < node->child_count; i++) {
+        release_nodes(my_tree, node->children[i]);
+    }
+    free(node);
+    my_tree->node_count -= 1;
+}
 
-        create_right_node(my_tree, flag, right, median, 0);
+/*
+* Bulk loads sorted records into a new tree, one level at a time from the leaves up. Every level is spread evenly
+* over as few nodes as fit, so nodes end up nearly full. Linear in count.
+*/
+struct btree_part build_tree(struct btree* my_tree, struct dict** records, uint64_t count) {
+
+    struct btree_part part = {NULL, -1};
+    if (count == 0) {
+        return part;
+    }
+    uint64_t fanout = my_tree->branching;
+    uint64_t width = (count + fanout) / fanout;
+    struct btree_node** level = malloc(sizeof(struct btree_node*)*width);
+    struct dict** seps = malloc(sizeof(struct dict*)*width);
+
+    //Leaves share count-(width-1) records, the records between them go up as separators
+    uint64_t next = 0;
+    uint64_t per_leaf = (count - (width-1)) / width;
+    uint64_t extra = (count - (width-1)) % width;
+    for (uint64_t i = 0; i < width; i++) {
+        struct btree_node* leaf = create_node(my_tree);
         my_tree->node_count += 1;
-    } 
-    if (flag->parent->link_count > my_tree->branching-1)  {
-        split_node(pos, flag->parent, my_tree);
+        leaf->link_count = per_leaf + (i < extra);
+        memmove(leaf->key_values, records+next, sizeof(struct dict*)*leaf->link_count);
+        next += leaf->link_count;
+        recount_node(leaf);
+        level[i] = leaf;
+        if (i+1 < width) {
+            seps[i] = records[next++];
+        }
+    }
+    part.height = 0;
+
+    //Each upper level takes up to branching children per node, the separators between groups go up again
+    while (width > 1) {
+        uint64_t parents = (width + fanout-1) / fanout;
+        uint64_t per_parent = width / parents;
+        extra = width % parents;
+        uint64_t child = 0;
+        for (uint64_t i = 0; i < parents; i++) {
+            struct btree_node* parent = create_node(my_tree);
+            my_tree->node_count += 1;
+            parent->leaf = 0;
+            parent->child_count = per_parent + (i < extra);
+            parent->link_count = parent->child_count-1;
+            for (int c = 0; c < parent->child_count; c++) {
+                parent->children[c] = level[child+c];
+                level[child+c]->parent = parent;
+                if (c < parent->link_count) {
+                    parent->key_values[c] = seps[child+c];
+                }
+            }
+            child += parent->child_count;
+            recount_node(parent);
+            level[i] = parent;
+            if (i+1 < parents) {
+                seps[i] = seps[child-1];
+            }
+        }
+        width = parents;
+        part.height += 1;
+    }
+    part.root = level[0];
+    free(level);
+    free(seps);
+    return part;
+}
+
+/*
+* Number of records under node, buried ones included
+*/
+uint64_t count_records(struct btree_node* node) {
+
+    uint64_t count = node->link_count;
+    for (int i = 0; i < node->child_count; i++) {
+        count += count_records(node->children[i]);
+    }
+    return count;
+}
+
+/*
+* Rebuilds [lo, hi] without its buried records. The range is cut out along its two boundary paths, the live records
+* in it are bulk loaded into nearly full nodes and joined back in, so only the boundary paths are left underfull.
+* The caller holds the tree lock. Returns the number of buried records freed.
+*/
+uint64_t compact_range(struct btree* my_tree, uint32_t lo, uint32_t hi) {
+
+    struct btree_part whole = {my_tree->root, tree_height(my_tree->root)};
+    struct btree_part below;
+    struct btree_part rest;
+    struct btree_part inside;
+    struct btree_part above = {NULL, -1};
+
+    split_tree(my_tree, whole, lo, &below, &rest);
+    if (hi == UINT32_MAX) {
+        inside = rest;
+    } else {
+        split_tree(my_tree, rest, hi+1, &inside, &above);
+    }
+    uint64_t freed = 0;
+    if (inside.root != NULL) {
+        struct dict** records = malloc(sizeof(struct dict*)*count_records(inside.root));
+        uint64_t count = 0;
+        collect_records(inside.root, records, &count);
+        release_nodes(my_tree, inside.root);
+
+        uint64_t live = 0;
+        for (uint64_t i = 0; i < count; i++) {
+            if (is_tombstone(records[i]) == 1) {
+                index_remove(my_tree, records[i]->key);
+                free_key(my_tree, records[i]);
+                freed += 1;
+            } else {
+                records[live++] = records[i];
+            }
+        }
+        inside = build_tree(my_tree, records, live);
+        free(records);
+    }
+    my_tree->root = concat_trees(my_tree, concat_trees(my_tree, below, inside), above).root;
+    return freed;
+}
+
+/*
+* Moves every keystream of other, current and superseded, into the cache of my_tree without touching a block.
+* Where both caches hold the same key and nonce the longer entry stays current and the other is kept superseded
+* until its records let go of it. Both tree locks are held.
+*/
+void adopt_keystreams(struct btree* my_tree, struct btree* other) {
+
+    struct keystream_cache* cache = my_tree->keystreams;
+    struct keystream_cache* source = other->keystreams;
+    pthread_mutex_lock(&cache->mutex);
+    pthread_mutex_lock(&source->mutex);
+    for (uint32_t i = 0; i < source->bucket_count; i++) {
+        struct keystream* current = source->buckets[i];
+        while (current != NULL) {
+            struct keystream* next = current->next;
+            struct keystream** slot = keystream_slot(cache, current->key, current->nonce);
+            if (*slot == NULL) {
+                current->next = NULL;
+                *slot = current;
+                cache->count += 1;
+                if (cache->count > cache->bucket_count*2) {
+                    keystream_grow(cache);
+                }
+            } else if (current->num_blocks > (*slot)->num_blocks) {
+                current->next = (*slot)->next;
+                (*slot)->next = NULL;
+                *slot = current;
+            } else {
+                current->next = NULL;
+            }
+            current = next;
+        }
+        source->buckets[i] = NULL;
+    }
+    cache->bytes += source->bytes;
+    source->bytes = 0;
+    source->count = 0;
+    pthread_mutex_unlock(&source->mutex);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/*
+* Shifts the byte accounting of one record from one store to another
+*/
+void move_record_bytes(struct btree* from, struct btree* to, struct dict* record) {
+
+    uint64_t header = sizeof(struct dict);
+    uint64_t blob = 0;
+    if (record->data == record->inline_data) {
+        header += record->capacity;
+    } else {
+        blob = record->capacity;
+    }
+    __atomic_fetch_sub(&from->record_bytes, header, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&from->data_bytes, blob, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->record_bytes, header, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&to->data_bytes, blob, __ATOMIC_RELAXED);
+}
+
+/*
+* Enters the records of a subtree taken from another store into the filter and the hash index of my_tree
+*/
+void adopt_records(struct btree* my_tree, struct btree_node* node) {
+
+    for (int i = 0; i < node->link_count; i++) {
+        struct dict* record = node->key_values[i];
+        if (is_tombstone(record) == 0) {
+            filter_update(my_tree, record->key, 1);
+        }
+        index_put(my_tree, record);
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        adopt_records(my_tree, node->children[i]);
+    }
+}
+
+/*
+* Merges the records of two stores by key and bulk loads the result into my_tree. Returns 1, with neither store
+* changed, if a key is live in both. Tombstones are dropped on the way.
+*/
+int merge_records(struct btree* my_tree, struct btree* other) {
+
+    uint64_t mine_count = 0;
+    uint64_t other_count = 0;
+    struct dict** mine = malloc(sizeof(struct dict*)*((uint64_t)my_tree->node_count*(my_tree->branching-1) + 1));
+    struct dict** theirs = malloc(sizeof(struct dict*)*((uint64_t)other->node_count*(other->branching-1) + 1));
+    if (my_tree->root != NULL) {
+        collect_records(my_tree->root, mine, &mine_count);
+    }
+    if (other->root != NULL) {
+        collect_records(other->root, theirs, &other_count);
+    }
+    for (uint64_t i = 0, j = 0; i < mine_count && j < other_count;) {
+        if (mine[i]->key == theirs[j]->key && is_tombstone(mine[i]) == 0 && is_tombstone(theirs[j]) == 0) {
+            free(mine);
+            free(theirs);
+            return 1;
+        }
+        mine[i]->key <= theirs[j]->key ? i++ : j++;
+    }
+
+    if (my_tree->root != NULL) {
+        release_nodes(my_tree, my_tree->root);
+    }
+    if (other->root != NULL) {
+        release_nodes(other, other->root);
+    }
+    struct dict** merged = malloc(sizeof(struct dict*)*(mine_count + other_count + 1));
+    uint64_t count = 0;
+    uint64_t i = 0;
+    uint64_t j = 0;
+    while (i < mine_count || j < other_count) {
+        char take_mine = j == other_count || (i < mine_count && mine[i]->key <= theirs[j]->key);
+        struct dict* record = take_mine == 1 ? mine[i++] : theirs[j++];
+        if (is_tombstone(record) == 1) {
+            if (take_mine == 1) {
+                index_remove(my_tree, record->key);
+            }
+            free_key(my_tree, record);
+            continue;
+        }
+        if (take_mine == 0) {
+            filter_update(my_tree, record->key, 1);
+            index_put(my_tree, record);
+        }
+        merged[count++] = record;
+    }
+    //Every tombstone is gone, the queued keys would only be skipped
+    my_tree->maintenance.count = 0;
+    my_tree->root = build_tree(my_tree, merged, count).root;
+
+    free(mine);
+    free(theirs);
+    free(merged);
+    return 0;
+}
+
+/*
+* Moves every record of other into my_tree and closes other, no value is decrypted or encrypted again. When the key
+* ranges do not overlap and both stores use the same node layout, the trees are concatenated along one spine in
+* O(log n). Otherwise the records are merged in key order and bulk loaded, linear in both sizes. Keystreams move
+* with their records. Returns 1, leaving both stores as they were, if a key is live in both or either store is
+* missing. Nothing else may use other during the call.
+*/
+int btree_merge_stores(void * helper, void * other_helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    struct btree* other = (struct btree*)other_helper;
+    if (my_tree == NULL || other == NULL || my_tree == other) {
+        return 1;
+    }
+    btree_async_drain(other);
+
+    //Address order, so two merges of the same pair in opposite directions cannot deadlock
+    struct btree* first = my_tree < other ? my_tree : other;
+    struct btree* second = my_tree < other ? other : my_tree;
+    lock_tree(first);
+    lock_tree(second);
+
+    char same_layout = my_tree->branching == other->branching && my_tree->node_size == other->node_size &&
+    my_tree->node_align == other->node_align && my_tree->config.compress_keys == other->config.compress_keys;
+    char disjoint = my_tree->root == NULL || other->root == NULL || max_key(my_tree->root) < min_key(other->root) ||
+    max_key(other->root) < min_key(my_tree->root);
+
+    if (same_layout == 1 && disjoint == 1) {
+        struct btree_part mine = {my_tree->root, tree_height(my_tree->root)};
+        struct btree_part theirs = {other->root, tree_height(other->root)};
+        //The only per record work, and only when the filter or index has to learn the new keys
+        if (other->root != NULL && (my_tree->filter.cells != NULL || my_tree->index.slots != NULL)) {
+            adopt_records(my_tree, other->root);
+        }
+        for (uint32_t i = 0; i < other->maintenance.count; i++) {
+            queue_tombstone(my_tree, other->maintenance.keys[i]);
+        }
+        my_tree->node_count += other->node_count;
+        other->node_count = 0;
+        if (mine.root != NULL && theirs.root != NULL && max_key(theirs.root) < min_key(mine.root)) {
+            my_tree->root = concat_trees(my_tree, theirs, mine).root;
+        } else {
+            my_tree->root = concat_trees(my_tree, mine, theirs).root;
+        }
+    } else if (merge_records(my_tree, other) != 0) {
+        pthread_mutex_unlock(&second->mutex);
+        pthread_mutex_unlock(&first->mutex);
+        return 1;
+    }
+    other->root = NULL;
+
+    adopt_keystreams(my_tree, other);
+    __atomic_fetch_add(&my_tree->record_bytes, __atomic_exchange_n(&other->record_bytes, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&my_tree->data_bytes, __atomic_exchange_n(&other->data_bytes, 0, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    //Stamps only have to differ per value, new writes continue past both sequences
+    uint32_t stamp = __atomic_load_n(&other->write_stamp, __ATOMIC_RELAXED);
+    uint32_t current = __atomic_load_n(&my_tree->write_stamp, __ATOMIC_RELAXED);
+    while (stamp > current && !__atomic_compare_exchange_n(&my_tree->write_stamp, &current, stamp, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (other->largest_key > my_tree->largest_key) {
+        my_tree->largest_key = other->largest_key;
+    }
+    //Adopted records keep stamps from the other sequence, only a full image is sure to hold them
+    my_tree->checkpoint.full = 1;
+    enforce_budget(my_tree);
+    pthread_mutex_unlock(&second->mutex);
+    pthread_mutex_unlock(&first->mutex);
+
+    close_store(other);
+    return 0;
+}
+
+/*
+* Gives the records of a subtree moving to another store their own keystreams there. Entries are copied, or left
+* evicted, rather than regenerated, and records sharing a keystream share the copy. Returns the nodes in the
+* subtree.
+*/
+uint32_t move_subtree(struct btree* from, struct btree* to, struct btree_node* node) {
+
+    struct keystream_cache* cache = to->keystreams;
+    uint32_t nodes = 1;
+    for (int i = 0; i < node->link_count; i++) {
+        struct dict* record = node->key_values[i];
+        move_record_bytes(from, to, record);
+        index_remove(from, record->key);
+        index_put(to, record);
+        if (is_tombstone(record) == 1) {
+            queue_tombstone(to, record->key);
+            continue;
+        }
+        filter_update(from, record->key, -1);
+        filter_update(to, record->key, 1);
+
+        struct keystream* source = record->stream;
+        pthread_mutex_lock(&cache->mutex);
+        struct keystream** slot = keystream_slot(cache, source->key, source->nonce);
+        if (*slot != NULL && (*slot)->num_blocks >= source->num_blocks) {
+            (*slot)->refs += 1;
+            record->stream = *slot;
+        } else {
+            struct keystream* stream = malloc(sizeof(struct keystream));
+            memmove(stream->key, source->key, sizeof(uint32_t)*4);
+            stream->nonce = source->nonce;
+            stream->num_blocks = source->num_blocks;
+            stream->refs = 1;
+            stream->pins = 0;
+            stream->recent = 0;
+            stream->blocks = NULL;
+            //Blocks are only freed under the source tree lock, which is held
+            uint64_t* blocks = __atomic_load_n(&source->blocks, __ATOMIC_ACQUIRE);
+            if (blocks != NULL) {
+                stream->blocks = malloc(sizeof(uint64_t)*(stream->num_blocks > 0 ? stream->num_blocks : 1));
+                memcpy(stream->blocks, blocks, sizeof(uint64_t)*stream->num_blocks);
+                cache->bytes += sizeof(uint64_t)*stream->num_blocks;
+            }
+            if (*slot != NULL) {
+                stream->next = (*slot)->next;
+                (*slot)->next = NULL;
+                *slot = stream;
+            } else {
+                stream->next = NULL;
+                *slot = stream;
+                cache->count += 1;
+                if (cache->count > cache->bucket_count*2) {
+                    keystream_grow(cache);
+                }
+            }
+            record->stream = stream;
+        }
+        pthread_mutex_unlock(&cache->mutex);
+        keystream_release(from, source);
+    }
+    for (int i = 0; i < node->child_count; i++) {
+        nodes += move_subtree(from, to, node->children[i]);
+    }
+    return nodes;
+}
+
+/*
+* Moves every key from pivot upwards into a new store with the same configuration and returns it, or NULL if the
+* store could not be created. The tree is cut along the root to pivot path. Records keep their ciphertext. Their
+* keystreams are copied into the new store, so that part is linear in the records moved. Both stores come out
+* with exact node counts and largest keys.
+*/
+void * btree_split_store(void * helper, uint32_t pivot) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (my_tree == NULL) {
+        return NULL;
+    }
+    //The new store does not inherit the image file, two stores writing one file would corrupt it
+    struct btree_config config = my_tree->config;
+    config.checkpoint_path = NULL;
+    struct btree* other = init_store_config(&config);
+    if (other == NULL) {
+        return NULL;
+    }
+    //The new store's maintenance thread is already running and compacts the tombstones queued into it, so its lock
+    //is held for the whole move. Nothing else can reach the new store yet and that thread takes no other lock, so
+    //taking it second is safe whatever the address order.
+    lock_tree(my_tree);
+    lock_tree(other);
+    if (my_tree->root != NULL) {
+        struct btree_part whole = {my_tree->root, tree_height(my_tree->root)};
+        struct btree_part below;
+        struct btree_part above;
+        split_tree(my_tree, whole, pivot, &below, &above);
+        my_tree->root = below.root;
+        if (above.root != NULL) {
+            other->node_count = move_subtree(my_tree, other, above.root);
+            my_tree->node_count -= other->node_count;
+            other->root = above.root;
+            other->largest_key = max_key(above.root);
+        }
+        my_tree->largest_key = below.root != NULL ? max_key(below.root) : 0;
+        plaintext_drop_range(my_tree, pivot, UINT32_MAX);
+        if (above.root != NULL) {
+            checkpoint_deleted(my_tree, pivot, UINT32_MAX);
+        }
+    }
+    other->write_stamp = __atomic_load_n(&my_tree->write_stamp, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&other->mutex);
+    pthread_mutex_unlock(&my_tree->mutex);
+    return other;
+}
+
+/*
+* Returns 1 if config has a checkpoint_key, the all zero key counts as none
+*/
+int checkpoint_keyed(struct btree_config* config) {
+
+    return (config->checkpoint_key[0] | config->checkpoint_key[1] | config->checkpoint_key[2] | config->checkpoint_key[3]) != 0;
+}
+
+/*
+* Wraps a record key for the image, its two TEA blocks chained CBC style under wrapping with a zero IV. A key always
+* wraps the same way, which shows which records share one but nothing of the key itself
+*/
+void wrap_key(uint32_t wrapping[4], uint32_t key[4], uint32_t wrapped[4]) {
+
+    encrypt_tea(key, wrapped, wrapping);
+    uint32_t chained[2] = {key[2] ^ wrapped[0], key[3] ^ wrapped[1]};
+    encrypt_tea(chained, wrapped+2, wrapping);
+}
+
+void unwrap_key(uint32_t wrapping[4], uint32_t wrapped[4], uint32_t key[4]) {
+
+    //decrypt_tea works in place on its input
+    uint32_t blocks[4];
+    memmove(blocks, wrapped, sizeof(uint32_t)*4);
+    decrypt_tea(blocks+2, key+2, wrapping);
+    decrypt_tea(blocks, key, wrapping);
+    key[2] ^= wrapped[0];
+    key[3] ^= wrapped[1];
+}
+
+/*
+* The header check block for wrapping, the segment magic and end frame magic encrypted under it
+*/
+void checkpoint_check(uint32_t wrapping[4], uint32_t check[2]) {
+
+    uint32_t plain[2] = {BTREE_CHECKPOINT_MAGIC, BTREE_CHECKPOINT_END};
+    encrypt_tea(plain, check, wrapping);
+}
+
+/*
+* Copies the live records of the subtree under node that are newer than batch->since into the batch, in key order
+* starting at batch->cursor. Subtrees whose max_stamp is not newer are skipped without being read. Keys are copied
+* in the clear, wrap_batch wraps them once the tree lock is released. Returns 1 once the batch is full, with cursor
+* left at the first record that did not fit.
+*/
+int collect_dirty(struct btree_node* node, struct checkpoint_batch* batch) {
+
+    if (batch->full == 0 && node->max_stamp <= batch->since) {
+        return 0;
+    }
+    int i = 0;
+    while (i < node->link_count && node->key_values[i]->key < batch->cursor) {
+        i++;
+    }
+    for (; i <= node->link_count; i++) {
+        if (node->leaf == 0 && collect_dirty(node->children[i], batch) == 1) {
+            return 1;
+        }
+        if (i == node->link_count) {
+            break;
+        }
+        struct dict* record = node->key_values[i];
+        if (is_tombstone(record) == 0 && (batch->full == 1 || record->stamp > batch->since)) {
+            size_t cipher = sizeof(uint64_t)*((record->size + (8-1))/8);
+            size_t needed = sizeof(struct btree_checkpoint_record) + cipher;
+            if (batch->records == CHECKPOINT_BATCH_RECORDS || (batch->records > 0 && batch->used + needed > batch->capacity)) {
+                return 1;
+            }
+            //A value larger than a whole batch goes out on its own
+            if (batch->used + needed > batch->capacity) {
+                batch->capacity = batch->used + needed;
+                batch->buffer = realloc(batch->buffer, batch->capacity);
+            }
+            struct btree_checkpoint_record entry;
+            entry.key = record->key;
+            entry.size = record->size;
+            memcpy(entry.wrapped_key, record->encrypt_key, sizeof(entry.wrapped_key));
+            entry.nonce = record->nonce;
+            memcpy(batch->buffer + batch->used, &entry, sizeof(struct btree_checkpoint_record));
+            memcpy(batch->buffer + batch->used + sizeof(struct btree_checkpoint_record), record->data, cipher);
+            batch->used += needed;
+            batch->records += 1;
+        }
+        batch->cursor = (uint64_t)record->key + 1;
+    }
+    return 0;
+}
+
+/*
+* Wraps the record keys collect_dirty copied into the batch, in place
+*/
+void wrap_batch(struct checkpoint_batch* batch) {
+
+    size_t offset = sizeof(struct btree_checkpoint_frame);
+    for (uint32_t i = 0; i < batch->records; i++) {
+        struct btree_checkpoint_record entry;
+        memcpy(&entry, batch->buffer + offset, sizeof(struct btree_checkpoint_record));
+        uint32_t key[4];
+        memcpy(key, entry.wrapped_key, sizeof(key));
+        wrap_key(batch->wrapping, key, entry.wrapped_key);
+        memcpy(batch->buffer + offset, &entry, sizeof(struct btree_checkpoint_record));
+        offset += sizeof(struct btree_checkpoint_record) + sizeof(uint64_t)*((entry.size + (8-1))/8);
+    }
+}
+
+/*
+* Writes one segment, the caller holds the checkpoint mutex. The tree lock is only held to hand over the delete
+* log, to copy one batch at a time and to publish the result, key wrapping and the file writes happen with it
+* released. A full image goes to a temporary file renamed over the old one, so a failed checkpoint never loses the
+* last good image. Returns 1 on an I/O error, after which the next checkpoint is full.
+*/
+int run_checkpoint(struct btree* my_tree) {
+
+    struct btree_checkpointer* checkpoint = &my_tree->checkpoint;
+    const char* path = my_tree->config.checkpoint_path;
+    uint64_t start = monotonic_ns();
+
+    //The start stamp and the delete log are taken together, every change lands in this segment or the next
+    lock_tree(my_tree);
+    uint32_t stamp = __atomic_load_n(&my_tree->write_stamp, __ATOMIC_RELAXED);
+    char full = checkpoint->full == 1 || stamp < checkpoint->since || checkpoint->file_bytes > 2*checkpoint->full_bytes;
+    struct btree_checkpoint_header header;
+    header.magic = BTREE_CHECKPOINT_MAGIC;
+    header.flags = full == 1 ? BTREE_CHECKPOINT_FULL : 0;
+    header.sequence = ++checkpoint->sequence;
+    header.since = full == 1 ? 0 : checkpoint->since;
+    header.stamp = stamp;
+    header.ranges = full == 1 ? 0 : checkpoint->count;
+    checkpoint_check(my_tree->config.checkpoint_key, header.key_check);
+    struct checkpoint_range* ranges = checkpoint->ranges;
+    checkpoint->ranges = NULL;
+    checkpoint->count = 0;
+    checkpoint->capacity = 0;
+    checkpoint->full = 0;
+    pthread_mutex_unlock(&my_tree->mutex);
+
+    char* temporary = NULL;
+    int fd;
+    if (full == 1) {
+        temporary = malloc(strlen(path) + sizeof(".tmp"));
+        sprintf(temporary, "%s.tmp", path);
+        fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    } else {
+        fd = open(path, O_WRONLY | O_APPEND);
+    }
+    int failed = fd < 0;
+    uint64_t bytes = sizeof(struct btree_checkpoint_header) + sizeof(struct checkpoint_range)*header.ranges;
+    if (failed == 0) {
+        failed = write_chunk(&header, sizeof(struct btree_checkpoint_header), &fd) != 0 ||
+        write_chunk(ranges, sizeof(struct checkpoint_range)*header.ranges, &fd) != 0;
+    }
+    free(ranges);
+
+    struct checkpoint_batch batch;
+    batch.capacity = CHECKPOINT_BATCH_BYTES;
+    batch.buffer = malloc(batch.capacity);
+    batch.since = header.since;
+    batch.full = full;
+    batch.wrapping = my_tree->config.checkpoint_key;
+    batch.cursor = 0;
+    uint64_t records = 0;
+    uint64_t batches = 0;
+    while (failed == 0 && batch.cursor <= UINT32_MAX) {
+        batch.used = sizeof(struct btree_checkpoint_frame);
+        batch.records = 0;
+        lock_tree(my_tree);
+        if (my_tree->root == NULL || collect_dirty(my_tree->root, &batch) == 0) {
+            batch.cursor = (uint64_t)UINT32_MAX + 1;
+        }
+        pthread_mutex_unlock(&my_tree->mutex);
+        batches++;
+        if (batch.records > 0) {
+            wrap_batch(&batch);
+            struct btree_checkpoint_frame frame = {BTREE_CHECKPOINT_FRAME, batch.records, batch.used - sizeof(struct btree_checkpoint_frame)};
+            memcpy(batch.buffer, &frame, sizeof(struct btree_checkpoint_frame));
+            failed = write_chunk(batch.buffer, batch.used, &fd);
+            records += batch.records;
+            bytes += batch.used;
+        }
+    }
+    free(batch.buffer);
+
+    if (failed == 0) {
+        struct btree_checkpoint_frame end = {BTREE_CHECKPOINT_END, 0, 0};
+        failed = write_chunk(&end, sizeof(struct btree_checkpoint_frame), &fd) != 0 || fsync(fd) != 0;
+        bytes += sizeof(struct btree_checkpoint_frame);
+    }
+    if (fd >= 0 && close(fd) != 0) {
+        failed = 1;
+    }
+    if (full == 1) {
+        if (failed == 0 && rename(temporary, path) != 0) {
+            failed = 1;
+        }
+        if (failed == 1) {
+            unlink(temporary);
+        }
+        free(temporary);
+    }
+
+    lock_tree(my_tree);
+    struct btree_checkpoint_stats* stats = &checkpoint->stats;
+    stats->batches += batches;
+    if (failed == 1) {
+        checkpoint->full = 1;
+        stats->failures += 1;
+        pthread_mutex_unlock(&my_tree->mutex);
+        return 1;
+    }
+    checkpoint->since = stamp;
+    checkpoint->file_bytes = full == 1 ? bytes : checkpoint->file_bytes + bytes;
+    if (full == 1) {
+        checkpoint->full_bytes = bytes;
+    }
+    stats->checkpoints += 1;
+    stats->full_checkpoints += full;
+    stats->last_duration_ns = monotonic_ns() - start;
+    stats->total_duration_ns += stats->last_duration_ns;
+    stats->last_bytes = bytes;
+    stats->total_bytes += bytes;
+    stats->last_records = records;
+    stats->last_ranges = header.ranges;
+    stats->stamp = stamp;
+    pthread_mutex_unlock(&my_tree->mutex);
+    return 0;
+}
+
+/*
+* Wakes every checkpoint_interval_ms and writes a checkpoint, request threads only wait for one batch copy at a time
+*/
+void* checkpoint_worker(void* arg) {
+
+    struct btree* my_tree = (struct btree*)arg;
+    struct btree_checkpointer* checkpoint = &my_tree->checkpoint;
+
+    pthread_mutex_lock(&checkpoint->mutex);
+    while (checkpoint->stopping == 0) {
+
+        struct timespec deadline;
+        deadline_after(&deadline, my_tree->config.checkpoint_interval_ms);
+        pthread_cond_timedwait(&checkpoint->wake, &checkpoint->mutex, &deadline);
+        if (checkpoint->stopping != 0) {
+            break;
+        }
+        run_checkpoint(my_tree);
+    }
+    pthread_mutex_unlock(&checkpoint->mutex);
+    return NULL;
+}
+
+/*
+* Takes a private copy of the image path from the configuration and starts the checkpoint thread if an interval
+* is set
+*/
+void start_checkpointer(struct btree* my_tree) {
+
+    if (my_tree->config.checkpoint_path == NULL) {
+        return;
+    }
+    my_tree->config.checkpoint_path = strdup(my_tree->config.checkpoint_path);
+    if (my_tree->config.checkpoint_interval_ms != 0) {
+        my_tree->checkpoint.running = 1;
+        pthread_create(&my_tree->checkpoint.thread, NULL, &checkpoint_worker, my_tree);
+    }
+}
+
+void init_checkpointer(struct btree* my_tree) {
+
+    struct btree_checkpointer* checkpoint = &my_tree->checkpoint;
+    memset(checkpoint, 0, sizeof(struct btree_checkpointer));
+    pthread_mutex_init(&checkpoint->mutex, NULL);
+    pthread_cond_init(&checkpoint->wake, NULL);
+    checkpoint->full = 1;
+    start_checkpointer(my_tree);
+}
+
+void free_checkpointer(struct btree* my_tree) {
+
+    struct btree_checkpointer* checkpoint = &my_tree->checkpoint;
+    if (checkpoint->running == 1) {
+        pthread_mutex_lock(&checkpoint->mutex);
+        checkpoint->stopping = 1;
+        pthread_cond_signal(&checkpoint->wake);
+        pthread_mutex_unlock(&checkpoint->mutex);
+        pthread_join(checkpoint->thread, NULL);
+    }
+    pthread_mutex_destroy(&checkpoint->mutex);
+    pthread_cond_destroy(&checkpoint->wake);
+    free(checkpoint->ranges);
+    free((char*)my_tree->config.checkpoint_path);
+}
+
+/*
+* Writes a checkpoint now, waiting for one the background thread is running. The first checkpoint, the first after
+* a merge or a failure, and any taken once the appended segments outgrow twice the last full image, rewrite the
+* whole image. The others append only records changed, and ranges deleted, since the last one. Returns 1 if the
+* store has no checkpoint path or the image could not be written.
+*/
+int btree_checkpoint(void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (my_tree == NULL || my_tree->config.checkpoint_path == NULL) {
+        return 1;
+    }
+    pthread_mutex_lock(&my_tree->checkpoint.mutex);
+    int result = run_checkpoint(my_tree);
+    pthread_mutex_unlock(&my_tree->checkpoint.mutex);
+    return result;
+}
+
+int btree_checkpoint_stats(void * helper, struct btree_checkpoint_stats * stats) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (my_tree == NULL || stats == NULL) {
+        return 1;
+    }
+    lock_tree(my_tree);
+    *stats = my_tree->checkpoint.stats;
+    pthread_mutex_unlock(&my_tree->mutex);
+    return 0;
+}
+
+/*
+* Walks the frames of the segment whose header was just read without applying anything. Returns 0 if the segment
+* reaches its end frame
+*/
+int scan_segment(FILE* file, struct btree_checkpoint_header* header) {
+
+    if (fseeko(file, (off_t)(sizeof(struct checkpoint_range)*header->ranges), SEEK_CUR) != 0) {
+        return 1;
+    }
+    struct btree_checkpoint_frame frame;
+    while (fread(&frame, sizeof(struct btree_checkpoint_frame), 1, file) == 1) {
+        if (frame.magic == BTREE_CHECKPOINT_END) {
+            return 0;
+        }
+        if (frame.magic != BTREE_CHECKPOINT_FRAME || fseeko(file, (off_t)frame.bytes, SEEK_CUR) != 0) {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+/*
+* Builds a record read from an image with its key unwrapped and its ciphertext as stored. The keystream entry is
+* only reserved, the first decrypt builds it
+*/
+struct dict* load_record(struct btree* my_tree, struct btree_checkpoint_record* entry, const void* cipher) {
+
+    uint32_t encryption_key[4];
+    unwrap_key(my_tree->config.checkpoint_key, entry->wrapped_key, encryption_key);
+    uint32_t block_num = (entry->size + (8-1))/8;
+    struct dict* record = alloc_record(my_tree, entry->key, entry->size, encryption_key, entry->nonce);
+    memcpy(record->data, cipher, sizeof(uint64_t)*block_num);
+    record->stream = keystream_reserve(my_tree, encryption_key, entry->nonce, block_num);
+    return record;
+}
+
+/*
+* Replaces the whole tree with the records of a full segment, which come in key order. They are bulk loaded into
+* nearly full nodes instead of linked one at a time
+*/
+void load_segment_tree(struct btree* my_tree, struct dict** records, uint64_t count) {
+
+    lock_tree(my_tree);
+    struct btree_part part = build_tree(my_tree, records, count);
+    my_tree->root = part.root;
+    my_tree->largest_key = count > 0 ? records[count-1]->key : 0;
+    for (uint64_t i = 0; i < count; i++) {
+        filter_update(my_tree, records[i]->key, 1);
+        index_put(my_tree, records[i]);
+    }
+    enforce_budget(my_tree);
+    pthread_mutex_unlock(&my_tree->mutex);
+}
+
+/*
+* Applies a segment checked by scan_segment. A full one is gathered and bulk loaded over an emptied tree, an
+* incremental one deletes its ranges and then puts each record in place of any record under its key. Returns 1 if
+* the file could not be read or a full segment is out of key order, a failed full segment leaves the tree empty.
+*/
+int replay_segment(struct btree* my_tree, FILE* file, struct btree_checkpoint_header* header) {
+
+    char full = (header->flags & BTREE_CHECKPOINT_FULL) != 0;
+    if (full == 1 && my_tree->root != NULL) {
+        btree_delete_range(0, UINT32_MAX, my_tree);
+    }
+    for (uint64_t i = 0; i < header->ranges; i++) {
+        struct checkpoint_range range;
+        if (fread(&range, sizeof(struct checkpoint_range), 1, file) != 1) {
+            return 1;
+        }
+        btree_delete_range(range.lo, range.hi, my_tree);
+    }
+    struct btree_checkpoint_frame frame;
+    void* cipher = NULL;
+    size_t capacity = 0;
+    struct dict** loaded = NULL;
+    uint64_t count = 0;
+    uint64_t loaded_capacity = 0;
+    int failed = 1;
+    char broken = 0;
+    while (broken == 0 && fread(&frame, sizeof(struct btree_checkpoint_frame), 1, file) == 1) {
+        if (frame.magic == BTREE_CHECKPOINT_END) {
+            failed = 0;
+            break;
+        }
+        for (uint32_t i = 0; broken == 0 && i < frame.records; i++) {
+            struct btree_checkpoint_record entry;
+            if (fread(&entry, sizeof(struct btree_checkpoint_record), 1, file) != 1) {
+                broken = 1;
+                break;
+            }
+            size_t size = sizeof(uint64_t)*((entry.size + (8-1))/8);
+            if (size > capacity) {
+                capacity = size;
+                cipher = realloc(cipher, capacity);
+            }
+            if (size > 0 && fread(cipher, size, 1, file) != 1) {
+                broken = 1;
+                break;
+            }
+            if (full == 1 && count > 0 && loaded[count-1]->key >= entry.key) {
+                broken = 1;
+                break;
+            }
+            struct dict* record = load_record(my_tree, &entry, cipher);
+            if (full == 1) {
+                if (count == loaded_capacity) {
+                    loaded_capacity = loaded_capacity == 0 ? CHECKPOINT_BATCH_RECORDS : loaded_capacity*2;
+                    loaded = realloc(loaded, sizeof(struct dict*)*loaded_capacity);
+                }
+                loaded[count++] = record;
+                continue;
+            }
+            btree_delete(entry.key, my_tree);
+            lock_tree(my_tree);
+            int result = link_key(my_tree, record);
+            pthread_mutex_unlock(&my_tree->mutex);
+            if (result != 0) {
+                free_key(my_tree, record);
+            }
+        }
+    }
+    if (failed == 0 && full == 1) {
+        load_segment_tree(my_tree, loaded, count);
+    } else {
+        for (uint64_t i = 0; i < count; i++) {
+            free_key(my_tree, loaded[i]);
+        }
+    }
+    free(loaded);
+    free(cipher);
+    return failed;
+}
+
+/*
+* Builds a store with config from the image at path, replaying every complete segment in order. Values are not
+* encrypted again and their keystreams are left to the first decrypt. config->checkpoint_key must be the key the
+* image was written with, segments written under another key are not replayed. Once loaded the store checkpoints
+* to config->checkpoint_path, which may be path itself, starting with a full image. Returns NULL if path holds no
+* complete segment under checkpoint_key.
+*/
+void * btree_restore(const char * path, struct btree_config * config) {
+
+    if (checkpoint_keyed(config) == 0) {
+        return NULL;
+    }
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    //Checkpointing starts after the load, a checkpoint of a half loaded store could replace the image being read
+    struct btree_config loading = *config;
+    loading.checkpoint_path = NULL;
+    struct btree* my_tree = init_store_config(&loading);
+    if (my_tree == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    uint32_t check[2];
+    checkpoint_check(config->checkpoint_key, check);
+    uint64_t segments = 0;
+    struct btree_checkpoint_header header;
+    while (fread(&header, sizeof(struct btree_checkpoint_header), 1, file) == 1 && header.magic == BTREE_CHECKPOINT_MAGIC) {
+        if (header.key_check[0] != check[0] || header.key_check[1] != check[1]) {
+            break;
+        }
+        off_t start = ftello(file);
+        if (scan_segment(file, &header) != 0 || fseeko(file, start, SEEK_SET) != 0) {
+            break;
+        }
+        if (replay_segment(my_tree, file, &header) != 0) {
+            break;
+        }
+        segments++;
+    }
+    fclose(file);
+    if (segments == 0) {
+        close_store(my_tree);
+        return NULL;
+    }
+    my_tree->config.checkpoint_path = config->checkpoint_path;
+    start_checkpointer(my_tree);
+    return my_tree;
+}
+
+/*
+* Live keys below key in the subtree of node, one descent using the subtree counts
+*/
+uint64_t count_below(struct btree_node* node, uint32_t key) {
+
+    uint64_t count = 0;
+    while (node != NULL) {
+        int i = 0;
+        for (; i < node->link_count && node->key_values[i]->key < key; i++) {
+            count += is_tombstone(node->key_values[i]) == 0;
+            if (node->leaf == 0) {
+                count += node->children[i]->live_count;
+            }
+        }
+        if (node->leaf == 1 || (i < node->link_count && node->key_values[i]->key == key)) {
+            if (node->leaf == 0) {
+                count += node->children[i]->live_count;
+            }
+            break;
+        }
+        node = node->children[i];
     }
-    return;
-}   
+    return count;
+}
 
-int btree_insert(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper) {
+/*
+* Number of live keys smaller than key, which is the position key has or would have in sorted order
+*/
+uint64_t btree_rank(uint32_t key, void * helper) {
 
     struct btree* my_tree = (struct btree*)helper;
-    pthread_mutex_lock(&my_tree->mutex);
+    lock_tree(my_tree);
+    uint64_t rank = count_below(my_tree->root, key);
+    pthread_mutex_unlock(&my_tree->mutex);
+    return rank;
+}
 
-    struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
-    
-    if (my_tree->root == NULL) {
-        flag = create_node(my_tree);
-        my_tree->node_count += 1;
-        my_tree->root = flag;
-    }
-    if (retreive_key(flag, key) != -1) {
+/*
+* Stores the live key at position index of sorted order (from 0) in key. Returns 1 if index is past the end
+*/
+int btree_select(uint64_t index, uint32_t * key, void * helper) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    lock_tree(my_tree);
+    struct btree_node* node = my_tree->root;
+    if (node == NULL || index >= node->live_count) {
         pthread_mutex_unlock(&my_tree->mutex);
         return 1;
     }
-    if (key > my_tree->largest_key) {
-        my_tree->largest_key = key;
+    while (node != NULL) {
+        int i = 0;
+        for (; i < node->link_count; i++) {
+            if (node->leaf == 0) {
+                if (index < node->children[i]->live_count) {
+                    break;
+                }
+                index -= node->children[i]->live_count;
+            }
+            if (is_tombstone(node->key_values[i]) == 0) {
+                if (index == 0) {
+                    *key = node->key_values[i]->key;
+                    pthread_mutex_unlock(&my_tree->mutex);
+                    return 0;
+                }
+                index -= 1;
+            }
+        }
+        node = node->leaf == 0 ? node->children[i] : NULL;
     }
-    
-    struct dict* new_key = create_key(key, plaintext, count, encryption_key, nonce, my_tree);
-    int pos = key_shift(flag, my_tree, key);
+    pthread_mutex_unlock(&my_tree->mutex);
+    return 1;
+}
 
-    flag->key_values[pos] = new_key;
-    flag->link_count += 1;
+/*
+* Number of live keys in [lo, hi], two descents instead of an export
+*/
+uint64_t btree_count_range(uint32_t lo, uint32_t hi, void * helper) {
 
-    if (flag->link_count <= my_tree->branching-1) {
-        pthread_mutex_unlock(&my_tree->mutex);
-        return 0;
-    } else {
-        split_node(pos, flag, my_tree);
-        pthread_mutex_unlock(&my_tree->mutex);
+    struct btree* my_tree = (struct btree*)helper;
+    if (lo > hi) {
         return 0;
     }
+    lock_tree(my_tree);
+    uint64_t count = 0;
+    if (my_tree->root != NULL) {
+        uint64_t upper = hi == UINT32_MAX ? my_tree->root->live_count : count_below(my_tree->root, hi+1);
+        count = upper - count_below(my_tree->root, lo);
+    }
     pthread_mutex_unlock(&my_tree->mutex);
-    return 1;
+    return count;
 }
 
-int btree_retrieve(uint32_t key, struct info * found, void * helper) {
+/*
+* Encryption stage of the async pipeline. Workers take inserts in submission order and encrypt them without
+* holding the tree lock, several records can be in this stage at once.
+*/
+void async_complete(struct btree_async* async, struct btree_job* job) {
 
-    struct btree* my_tree = (struct btree*)helper;
+    if (job->callback != NULL) {
+        job->callback(&job->completion);
+        free(job);
+    } else {
+        pthread_mutex_lock(&async->mutex);
+        job->next = NULL;
+        if (async->completions_tail == NULL) {
+            async->completions = job;
+        } else {
+            async->completions_tail->next = job;
+        }
+        async->completions_tail = job;
+        pthread_mutex_unlock(&async->mutex);
+    }
+    pthread_mutex_lock(&async->mutex);
+    async->outstanding -= 1;
+    if (async->outstanding == 0) {
+        pthread_cond_broadcast(&async->idle);
+    }
+    pthread_mutex_unlock(&async->mutex);
+}
+
+/*
+* Tree stage of an async decrypt, the caller holds the tree lock. The ciphertext is copied into output here, in
+* ticket order, and the keystream is referenced and pinned so a worker can XOR it after the lock is released.
+* Leaves job->stream NULL when the plaintext cache already answered. Returns 1 if the key does not exist.
+*/
+int capture_decrypt(struct btree* my_tree, struct btree_job* job) {
+
+    job->stream = NULL;
     if (my_tree->root == NULL) {
         return 1;
     }
-    pthread_mutex_lock(&my_tree->mutex);
-    struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
+    struct dict* record = find_record(my_tree, job->completion.key, BTREE_OP_DECRYPT);
+    if (record == NULL) {
+        return 1;
+    }
+    if (plaintext_lookup(my_tree, record, job->completion.output) == 0) {
+        return 0;
+    }
+    memcpy(job->completion.output, record->data, record->size);
+    job->count = record->size;
+    pthread_mutex_lock(&my_tree->keystreams->mutex);
+    record->stream->refs += 1;
+    record->stream->pins += 1;
+    pthread_mutex_unlock(&my_tree->keystreams->mutex);
+    job->stream = record->stream;
+    return 0;
+}
 
-    int i = 0;
-    char check = 0;
-    for (;i < flag->link_count; i++) {
-        if (flag->key_values[i]->key == key) {
-            check = 1;
+/*
+* Worker stage of an async decrypt, XORs the captured ciphertext in output with the pinned keystream
+*/
+void finish_decrypt(struct btree* my_tree, struct btree_job* job) {
+
+    uint64_t* blocks = __atomic_load_n(&job->stream->blocks, __ATOMIC_ACQUIRE);
+    if (blocks == NULL) {
+        keystream_restore(my_tree, job->stream);
+        blocks = __atomic_load_n(&job->stream->blocks, __ATOMIC_ACQUIRE);
+    }
+    __atomic_store_n(&job->stream->recent, 1, __ATOMIC_RELAXED);
+    xor_bytes((BYTE*)job->completion.output, (const BYTE*)job->completion.output, (const BYTE*)blocks, job->count);
+    keystream_unpin(my_tree, job->stream);
+    keystream_release(my_tree, job->stream);
+}
+
+/*
+* Hands a job to the workers, the caller holds the async mutex
+*/
+void push_pending(struct btree_async* async, struct btree_job* job) {
+
+    job->next_pending = NULL;
+    if (async->pending_tail == NULL) {
+        async->pending = job;
+    } else {
+        async->pending_tail->next_pending = job;
+    }
+    async->pending_tail = job;
+    pthread_cond_signal(&async->work);
+}
+
+/*
+* Encrypts insert records before the tree stage and finishes decrypts after it
+*/
+void* async_worker(void* arg) {
+
+    struct btree* my_tree = (struct btree*)arg;
+    struct btree_async* async = my_tree->async;
+
+    pthread_mutex_lock(&async->mutex);
+    while (1) {
+        while (async->pending == NULL && async->stopping == 0) {
+            pthread_cond_wait(&async->work, &async->mutex);
+        }
+        if (async->pending == NULL) {
             break;
         }
+        struct btree_job* job = async->pending;
+        async->pending = job->next_pending;
+        if (async->pending == NULL) {
+            async->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&async->mutex);
+
+        if (job->completion.op == BTREE_OP_DECRYPT) {
+            finish_decrypt(my_tree, job);
+            async_complete(async, job);
+            pthread_mutex_lock(&async->mutex);
+            continue;
+        }
+        job->record = create_key(job->completion.key, job->plaintext, job->count, job->encrypt_key, job->nonce, my_tree);
+
+        pthread_mutex_lock(&async->mutex);
+        job->ready = 1;
+        if (job == async->order) {
+            pthread_cond_signal(&async->ready);
+        }
     }
-    if (check == 1) {
-        found->size = flag->key_values[i]->size;
-        found->nonce = flag->key_values[i]->nonce;
-        found->data = flag->key_values[i]->data;
-        memmove(found->key, flag->key_values[i]->encrypt_key, sizeof(uint32_t)*4);
+    pthread_mutex_unlock(&async->mutex);
+    return NULL;
+}
+
+/*
+* Tree stage of the async pipeline. Jobs are applied strictly in ticket order, every ready job at the head of
+* the queue is applied under one acquisition of the tree lock while later records are still being encrypted.
+* A decrypt only captures its ciphertext here, the XOR goes back to the workers.
+*/
+void* async_applier(void* arg) {
 
+    struct btree* my_tree = (struct btree*)arg;
+    struct btree_async* async = my_tree->async;
+
+    pthread_mutex_lock(&async->mutex);
+    while (1) {
+        while ((async->order == NULL || async->order->ready == 0) && async->stopping == 0) {
+            pthread_cond_wait(&async->ready, &async->mutex);
+        }
+        if (async->order == NULL || async->order->ready == 0) {
+            break;
+        }
+        struct btree_job* batch = async->order;
+        struct btree_job* last = batch;
+        while (last->next != NULL && last->next->ready == 1) {
+            last = last->next;
+        }
+        async->order = last->next;
+        if (async->order == NULL) {
+            async->order_tail = NULL;
+        }
+        last->next = NULL;
+        pthread_mutex_unlock(&async->mutex);
+
+        lock_tree(my_tree);
+        for (struct btree_job* job = batch; job != NULL; job = job->next) {
+            if (job->completion.op == BTREE_OP_INSERT) {
+                job->completion.result = job->record == NULL ? 1 : link_key(my_tree, job->record);
+            } else {
+                job->completion.result = capture_decrypt(my_tree, job);
+            }
+        }
         pthread_mutex_unlock(&my_tree->mutex);
-        return 0;
+
+        while (batch != NULL) {
+            struct btree_job* next = batch->next;
+            if (batch->completion.op == BTREE_OP_INSERT && batch->record != NULL && batch->completion.result != 0) {
+                free_key(my_tree, batch->record);
+            }
+            if (batch->completion.op == BTREE_OP_DECRYPT && batch->stream != NULL) {
+                pthread_mutex_lock(&async->mutex);
+                push_pending(async, batch);
+                pthread_mutex_unlock(&async->mutex);
+            } else {
+                async_complete(async, batch);
+            }
+            batch = next;
+        }
+        pthread_mutex_lock(&async->mutex);
     }
-    pthread_mutex_unlock(&my_tree->mutex);
-    return 1;
+    pthread_mutex_unlock(&async->mutex);
+    return NULL;
 }
 
-int btree_decrypt(uint32_t key, void * output, void * helper) {
+/*
+* Queues a job and returns its ticket, starting the worker threads on first use
+*/
+uint64_t async_submit(struct btree* my_tree, struct btree_job* job) {
+
+    struct btree_async* async = my_tree->async;
+    pthread_mutex_lock(&async->mutex);
+    if (async->started == 0) {
+        async->started = 1;
+        for (int i = 0; i < async->worker_count; i++) {
+            pthread_create(&async->workers[i], NULL, &async_worker, my_tree);
+        }
+        pthread_create(&async->applier, NULL, &async_applier, my_tree);
+    }
+    async->next_ticket += 1;
+    job->completion.ticket = async->next_ticket;
+    async->outstanding += 1;
 
-    struct btree* my_tree = (struct btree*)helper;
-    if (my_tree->root == NULL) {
-        return 1;
+    job->next = NULL;
+    if (async->order_tail == NULL) {
+        async->order = job;
+    } else {
+        async->order_tail->next = job;
     }
-    pthread_mutex_lock(&my_tree->mutex);
-    struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
+    async->order_tail = job;
 
-    int i = 0;
-    char check = 0;
-    for (;i < flag->link_count; i++) {
-        if (flag->key_values[i]->key == key) {
-            check = 1;
-            break;
+    if (job->ready == 1) {
+        if (job == async->order) {
+            pthread_cond_signal(&async->ready);
         }
+    } else {
+        push_pending(async, job);
     }
-    if (check == 1) {
-        
-        int block_num = ((flag->key_values[i]->size + (8-1))/8);
-        uint64_t* text = (uint64_t*)malloc(sizeof(uint64_t)*block_num);
+    uint64_t ticket = job->completion.ticket;
+    pthread_mutex_unlock(&async->mutex);
+    return ticket;
+}
 
-        uint64_t* encrypted = (uint64_t*)flag->key_values[i]->data;
-        uint64_t* cipher_key = (uint64_t*)flag->key_values[i]->tmp2;
-        for(int j = 0; j < block_num; j++) {
-            text[j] = encrypted[j] ^ cipher_key[j];
-        }
-        memmove(output, text, flag->key_values[i]->size);
-        free(text);
+/*
+* Queues an insert and returns its ticket, or 0 if count is too large. A worker encrypts the value, then the tree
+* stage links it in ticket order. plaintext is read by the worker, so it must stay valid and unchanged until the
+* completion is delivered to callback, or to btree_async_poll when callback is NULL. A key key_present already finds
+* skips the workers and fails in ticket order, queued jobs only ever add keys so it would fail there anyway.
+*/
+uint64_t btree_insert_async(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, btree_callback callback, void * context, void * helper) {
 
-        pthread_mutex_unlock(&my_tree->mutex);
+    struct btree* my_tree = (struct btree*)helper;
+    if (count > UINT32_MAX) {
         return 0;
     }
-    pthread_mutex_unlock(&my_tree->mutex);
-    return 1;
+    struct btree_job* job = calloc(1, sizeof(struct btree_job));
+    job->completion.op = BTREE_OP_INSERT;
+    job->completion.key = key;
+    job->completion.context = context;
+    job->callback = callback;
+    job->plaintext = plaintext;
+    job->count = count;
+    memmove(job->encrypt_key, encryption_key, sizeof(uint32_t)*4);
+    job->nonce = nonce;
+    job->ready = key_present(my_tree, key);
+
+    return async_submit(my_tree, job);
 }
 
-void delete_key(struct btree_node* flag, int index) {
+/*
+* Queues a decrypt of key into output and returns its ticket. The value read is the one key holds after every
+* earlier ticket has been applied, but the XOR runs on a worker, so the completion can arrive after those of later
+* tickets. output must hold the whole value and stay valid until the completion is delivered, its contents are
+* undefined before then.
+*/
+uint64_t btree_decrypt_async(uint32_t key, void * output, btree_callback callback, void * context, void * helper) {
 
-    free(flag->key_values[index]->data);
-    free(flag->key_values[index]->tmp2);
-    free(flag->key_values[index]);
+    struct btree* my_tree = (struct btree*)helper;
 
-    flag->key_values[index] = NULL;
-    memmove(flag->key_values+index, flag->key_values+(index+1), sizeof(struct dict*)*(flag->link_count-(index)));
+    //Decryption only needs the cached keystream, so the job goes straight to the tree stage
+    struct btree_job* job = calloc(1, sizeof(struct btree_job));
+    job->completion.op = BTREE_OP_DECRYPT;
+    job->completion.key = key;
+    job->completion.output = output;
+    job->completion.context = context;
+    job->callback = callback;
+    job->ready = 1;
 
-    flag->link_count -= 1;
+    return async_submit(my_tree, job);
 }
 
-void left_swap(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* left, int target_index) {
+/*
+* Takes the oldest completion of a job submitted without a callback. Returns 1 if there is none yet
+*/
+int btree_async_poll(void * helper, struct btree_completion * completion) {
 
-    target->key_values[0] = parent->key_values[target_index];
-    parent->key_values[target_index] = left->key_values[left->link_count-1];
-    left->key_values[left->link_count-1] = NULL;
+    struct btree* my_tree = (struct btree*)helper;
+    struct btree_async* async = my_tree->async;
 
-    target->link_count += 1;
-    left->link_count -= 1;
+    pthread_mutex_lock(&async->mutex);
+    struct btree_job* job = async->completions;
+    if (job == NULL) {
+        pthread_mutex_unlock(&async->mutex);
+        return 1;
+    }
+    async->completions = job->next;
+    if (async->completions == NULL) {
+        async->completions_tail = NULL;
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    *completion = job->completion;
+    free(job);
+    return 0;
 }
 
-void right_swap(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* right, int target_index) {
+/*
+* Blocks until every job submitted so far has completed, callbacks included
+*/
+void btree_async_drain(void * helper) {
 
-    target->key_values[0] = parent->key_values[target_index-1];
-    parent->key_values[target_index-1] = right->key_values[0];
-    memmove(right->key_values, right->key_values+1, sizeof(struct dict*)*(right->link_count-1));
+    struct btree* my_tree = (struct btree*)helper;
+    struct btree_async* async = my_tree->async;
 
-    target->link_count += 1;
-    right->link_count -= 1;
+    pthread_mutex_lock(&async->mutex);
+    while (async->outstanding != 0) {
+        pthread_cond_wait(&async->idle, &async->mutex);
+    }
+    pthread_mutex_unlock(&async->mutex);
 }
 
-void left_push(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* left, int target_index) {
+void free_async(struct btree* my_tree) {
 
-    struct btree_node* largest_child = left->children[left->child_count-1];
-    memmove(target->children+1, target->children, sizeof(struct btree_node*)*(target->child_count));
-    target->children[0] = largest_child;
-    left->children[left->child_count-1] = NULL;
-    largest_child->parent = target;
+    struct btree_async* async = my_tree->async;
+    btree_async_drain(my_tree);
 
-    target->child_count += 1;
-    left->child_count -= 1;
+    pthread_mutex_lock(&async->mutex);
+    async->stopping = 1;
+    pthread_cond_broadcast(&async->work);
+    pthread_cond_broadcast(&async->ready);
+    pthread_mutex_unlock(&async->mutex);
+    if (async->started == 1) {
+        for (int i = 0; i < async->worker_count; i++) {
+            pthread_join(async->workers[i], NULL);
+        }
+        pthread_join(async->applier, NULL);
+    }
+    while (async->completions != NULL) {
+        struct btree_job* next = async->completions->next;
+        free(async->completions);
+        async->completions = next;
+    }
+    pthread_mutex_destroy(&async->mutex);
+    pthread_cond_destroy(&async->work);
+    pthread_cond_destroy(&async->ready);
+    pthread_cond_destroy(&async->idle);
+    free(async->workers);
+    free(async);
 }
 
-void right_push(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* right, int target_index) {
-
-    struct btree_node* smallest_child = right->children[0];
-    target->children[target->child_count] = smallest_child;
-    memmove(right->children, right->children+1, sizeof(struct btree_node*)*(right->child_count-1));
-    smallest_child->parent = target;
+/*
+* Keys of one node for an export, buried records are left out since their slots are gone once maintenance catches up
+*/
+struct node export_node(struct btree_node* current) {
 
-    target->child_count += 1;
-    right->child_count -= 1;
+    struct node new_node = {.num_keys = 0};
+    new_node.keys = (uint32_t*)malloc(sizeof(uint32_t)*current->link_count);
+    for (int i = 0; i < current->link_count; i++) {
+        if (is_tombstone(current->key_values[i]) == 0) {
+            new_node.keys[new_node.num_keys] = current->key_values[i]->key;
+            new_node.num_keys += 1;
+        }
+    }
+    return new_node;
 }
 
-struct btree_node* left_merge(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* left, int target_index) {
-
-    left->key_values[1] = parent->key_values[target_index];
-    parent->children[target_index+1] = NULL;
-    left->parent = parent;
+void preorder_traversal(struct btree_node* current, struct btree* my_tree, int* count, struct node* list) {
 
-    memmove(parent->key_values+target_index, parent->key_values+target_index+1, sizeof(struct dict*)*(parent->link_count-(target_index+1)));
+    if (current == NULL) {
+        return;
+    }
+    list[*count] = export_node(current);
+    for (int i = 0; i < current->child_count; i++) {
+        *count += 1;
+        preorder_traversal(current->children[i], my_tree, count, list);
+    }
+    return;
+}
 
-    memmove(parent->children+target_index+1, parent->children+target_index+2, sizeof(struct btree_node*)*(parent->child_count-(target_index+1)));
-    memmove(left->children+left->child_count, target->children, sizeof(struct btree_node*)*(target->child_count));
+/*
+* Exports current into the task's list, or passes its live records to the visitor, then does the same for every
+* child in order
+*/
+void walk_subtree(struct traversal_task* task, struct btree_node* current) {
 
-    for (int i = 0; i < target->child_count; i++) {
-        target->children[i]->parent = left;
+    if (task->visitor == NULL) {
+        if (task->count == task->capacity) {
+            task->capacity = task->capacity == 0 ? 64 : task->capacity*2;
+            task->list = realloc(task->list, sizeof(struct node)*task->capacity);
+        }
+        task->list[task->count] = export_node(current);
+        task->count += 1;
+    } else {
+        for (int i = 0; i < current->link_count; i++) {
+            if (is_tombstone(current->key_values[i]) == 0) {
+                task->visitor(current->key_values[i], task->context);
+                task->visited += 1;
+            }
+        }
+    }
+    for (int i = 0; i < current->child_count; i++) {
+        walk_subtree(task, current->children[i]);
     }
+}
 
-    parent->link_count -= 1;
-    parent->child_count -= 1;
-    my_tree->node_count -= 1;
-    left->link_count += 1;
-    target->link_count -= 1;
-    left->child_count += target->child_count;
-    free_node(target);
+void* traversal_worker(void* arg) {
 
-    return left;
+    struct traversal_task* task = (struct traversal_task*)arg;
+    walk_subtree(task, task->root);
+    return NULL;
 }
 
-struct btree_node* right_merge(struct btree* my_tree, struct btree_node* parent, struct btree_node* target, struct btree_node* right, int target_index) {
+/*
+* Goes down level by level until a level has TRAVERSAL_TASKS_PER_CORE subtrees for every crypto core, so the
+* pool can balance uneven subtrees. Stores that level's nodes left to right, which is also their preorder, in
+* *roots and returns its depth. Returns 0 when a single core or a small tree is better walked by the caller.
+*/
+int plan_traversal(struct btree* my_tree, struct btree_node*** roots, uint32_t* count) {
 
-    right->key_values[1] = right->key_values[0];
-    right->key_values[0] = parent->key_values[target_index];
-    right->parent = parent;
-    
-    memmove(parent->children+target_index, parent->children+target_index+1, sizeof(struct btree_node*)*(parent->child_count-(target_index+1)));
-    memmove(parent->key_values+target_index, parent->key_values+target_index+1, sizeof(struct dict*)*(parent->link_count-(target_index+1)));
+    uint32_t target = my_tree->config.crypto_cores*TRAVERSAL_TASKS_PER_CORE;
+    if (my_tree->config.crypto_cores <= 1 || my_tree->root == NULL || my_tree->node_count < target) {
+        return 0;
+    }
+    struct btree_node** level = malloc(sizeof(struct btree_node*)*my_tree->node_count);
+    struct btree_node** next = malloc(sizeof(struct btree_node*)*my_tree->node_count);
+    level[0] = my_tree->root;
+    uint32_t width = 1;
+    int depth = 0;
+    while (width < target && level[0]->leaf == 0) {
+        uint32_t next_width = 0;
+        for (uint32_t i = 0; i < width; i++) {
+            memmove(next+next_width, level[i]->children, sizeof(struct btree_node*)*level[i]->child_count);
+            next_width += level[i]->child_count;
+        }
+        struct btree_node** swap = level;
+        level = next;
+        next = swap;
+        width = next_width;
+        depth++;
+    }
+    free(next);
+    *roots = level;
+    *count = width;
+    return depth;
+}
 
-    memmove(right->children+target->child_count, right->children, sizeof(struct btree_node*)*(right->child_count));
-    memmove(right->children, target->children, sizeof(struct btree_node*)*(target->child_count));
+/*
+* Runs one pool task per subtree root. The tasks array is returned for the caller to stitch and free
+*/
+struct traversal_task* run_traversal(struct btree* my_tree, struct btree_node** roots, uint32_t count, btree_visitor visitor, void * context) {
+
+    struct traversal_task* tasks = calloc(count, sizeof(struct traversal_task));
+    void** args = malloc(sizeof(void*)*count);
+    for (uint32_t i = 0; i < count; i++) {
+        tasks[i].root = roots[i];
+        tasks[i].visitor = visitor;
+        tasks[i].context = context;
+        args[i] = &tasks[i];
+    }
+    pool_run(my_tree, &traversal_worker, args, count);
+    free(args);
+    return tasks;
+}
 
-    for (int i = 0; i < target->child_count; i++) {
-        target->children[i]->parent = right;
+/*
+* Preorder walk of the levels above the split, copying each subtree's export in where its root would be. Also
+* used for the visitor, where only the top levels are visited here.
+*/
+void stitch_traversal(struct btree_node* current, int depth, int split, struct traversal_task* tasks, uint32_t* next, struct traversal_task* top) {
+
+    if (depth == split) {
+        struct traversal_task* task = &tasks[*next];
+        *next += 1;
+        if (top->visitor == NULL) {
+            memmove(top->list + top->count, task->list, sizeof(struct node)*task->count);
+            top->count += task->count;
+            free(task->list);
+        }
+        top->visited += task->visited;
+        return;
+    }
+    if (top->visitor == NULL) {
+        top->list[top->count] = export_node(current);
+        top->count += 1;
+    } else {
+        for (int i = 0; i < current->link_count; i++) {
+            if (is_tombstone(current->key_values[i]) == 0) {
+                top->visitor(current->key_values[i], top->context);
+                top->visited += 1;
+            }
+        }
+    }
+    for (int i = 0; i < current->child_count; i++) {
+        stitch_traversal(current->children[i], depth+1, split, tasks, next, top);
     }
+}
 
-    target->link_count -= 1;
-    parent->child_count -= 1;
-    parent->link_count -= 1;
-    my_tree->node_count -= 1;
-    right->link_count += 1;
-    right->child_count += target->child_count;
-    free_node(target);
+/*
+* Exports every node in preorder. Large trees are split into subtrees exported on the crypto pool and stitched
+* back in order, the result is the same as the serial walk.
+*/
+uint64_t btree_export(void * helper, struct node ** list) {
+    
+    struct btree* my_tree = (struct btree*)helper;
+    lock_tree(my_tree);
+    if (my_tree->node_count == 0 || my_tree->root == NULL) {
+        pthread_mutex_unlock(&my_tree->mutex);
+        return 0;
+    }
+    *list = malloc(sizeof(struct node)*my_tree->node_count);
 
-    return right;
+    struct btree_node** roots;
+    uint32_t count;
+    int split = plan_traversal(my_tree, &roots, &count);
+    if (split == 0) {
+        int index = 0;
+        preorder_traversal(my_tree->root, my_tree, &index, *list);
+        pthread_mutex_unlock(&my_tree->mutex);
+        return index+1;
+    }
+    struct traversal_task* tasks = run_traversal(my_tree, roots, count, NULL, NULL);
+    struct traversal_task top = {.list = *list};
+    uint32_t next = 0;
+    stitch_traversal(my_tree->root, 0, split, tasks, &next, &top);
+    pthread_mutex_unlock(&my_tree->mutex);
+
+    free(tasks);
+    free(roots);
+    return top.count;
 }
 
-int rearrange_keys(struct btree* my_tree, struct btree_node* target, uint32_t key) {
+/*
+* Calls visitor once for every live record, from the crypto pool threads when the tree is large enough, in no
+* particular order. The tree lock is held throughout, so the visitor must not call back into the store. Returns
+* the number of records visited.
+*/
+uint64_t btree_for_each(void * helper, btree_visitor visitor, void * context) {
 
-    if (target == my_tree->root && target->link_count < 1) {
-        my_tree->root = target->children[0];
-        free_node(target);
-        my_tree->node_count -= 1;
+    struct btree* my_tree = (struct btree*)helper;
+    lock_tree(my_tree);
+    struct traversal_task top = {.root = my_tree->root, .visitor = visitor, .context = context};
+    if (my_tree->root == NULL) {
+        pthread_mutex_unlock(&my_tree->mutex);
         return 0;
     }
+    struct btree_node** roots;
+    uint32_t count;
+    int split = plan_traversal(my_tree, &roots, &count);
+    if (split == 0) {
+        walk_subtree(&top, my_tree->root);
+        pthread_mutex_unlock(&my_tree->mutex);
+        return top.visited;
+    }
+    struct traversal_task* tasks = run_traversal(my_tree, roots, count, visitor, context);
+    uint32_t next = 0;
+    stitch_traversal(my_tree->root, 0, split, tasks, &next, &top);
+    pthread_mutex_unlock(&my_tree->mutex);
 
-    int left_index = (retreive_child(target->parent, target)-1);
-    int right_index = (left_index+2);
+    free(tasks);
+    free(roots);
+    return top.visited;
+}
 
-    struct btree_node* left = NULL;
-    struct btree_node* right = NULL;
-    if (left_index >= 0) {
-         left = target->parent->children[left_index];
-    }
-    if (target->parent->child_count-1 >= right_index) {
-        right = target->parent->children[right_index];
-    }
+void collect_stats(struct btree_node* current, uint32_t level, struct btree_stats* stats) {
 
-    int check = 0;
-    if (left != NULL && (left->link_count > 1 && left->leaf == 1)) {
-        left_swap(my_tree, target->parent, target, left, left_index);
-        check++;
+    if (current == NULL) {
+        return;
     }
-    if ((right != NULL && check == 0) && (right->link_count > 1 && right->leaf == 1)) {
-        right_swap(my_tree, target->parent, target, right, right_index);
-        check++;
+    if (level+1 > stats->height) {
+        stats->height = level+1;
     }
-    if (check == 0 && (left != NULL && left->leaf == 0) && left->link_count > 1) {
-        left_swap(my_tree, target->parent, target, left, left_index);
-        left_push(my_tree, target->parent, target, left, left_index);
-        check++;
+    if (level < BTREE_MAX_LEVELS) {
+        stats->level_nodes[level] += 1;
     }
-    if (check == 0 && (right != NULL && right->leaf == 0) && right->link_count > 1) {
-        right_swap(my_tree, target->parent, target, right, right_index);
-        right_push(my_tree, target->parent, target, right, right_index);
-        check++;
+    stats->node_count += 1;
+    if (current->leaf == 0 && current->keys_packed == 1) {
+        stats->packed_nodes[current->key_width == 0 ? 2 : current->key_width-1] += 1;
     }
-    if (check == 0) {
-        if (left != NULL) {
-            target = left_merge(my_tree, target->parent, target, left, left_index);
-        } else if (right != NULL) {
-            target = right_merge(my_tree, target->parent, target, right, right_index-1);
+
+    for (int i = 0; i < current->link_count; i++) {
+        if (is_tombstone(current->key_values[i]) == 1) {
+            stats->tombstones += 1;
+        } else {
+            stats->key_count += 1;
         }
-        check++;
+        stats->payload_bytes += current->key_values[i]->size;
     }
-    if (target->parent->link_count <= 0) {
-        rearrange_keys(my_tree, target->parent, key);
+    for (int i = 0; i < current->child_count; i++) {
+        collect_stats(current->children[i], level+1, stats);
     }
-    return 0;
 }
 
-int btree_delete(uint32_t key, void * helper) {
+int btree_stats(void * helper, struct btree_stats * stats) {
 
-    struct btree* my_tree = (struct btree*)helper;
-    if (my_tree->root == NULL) {
+    if (helper == NULL || stats == NULL) {
         return 1;
     }
-    pthread_mutex_lock(&my_tree->mutex);
+    struct btree* my_tree = (struct btree*)helper;
+    memset(stats, 0, sizeof(struct btree_stats));
 
-    struct btree_node* flag = btree_search(key, my_tree, my_tree->root);
-    
-    int flag_index = retreive_key(flag, key);
-    if (flag == NULL || flag_index == -1) {
-        pthread_mutex_unlock(&my_tree->mutex);
-        return 1;
+    lock_tree(my_tree);
+    collect_stats(my_tree->root, 0, stats);
+    if (stats->node_count > 0 && my_tree->branching > 1) {
+        stats->fill_factor = (double)(stats->key_count + stats->tombstones) / ((double)stats->node_count*(my_tree->branching-1));
     }
+    stats->counters = my_tree->counters;
+    pthread_mutex_unlock(&my_tree->mutex);
 
-    struct btree_node* swap = NULL;
-    struct btree_node* target = flag;
+    pthread_mutex_lock(&my_tree->keystreams->mutex);
+    stats->keystream_bytes = my_tree->keystreams->bytes;
+    stats->keystream_entries = my_tree->keystreams->count;
+    pthread_mutex_unlock(&my_tree->keystreams->mutex);
 
-    if(flag->leaf != 1) {
+    stats->crypto_block_ns = my_tree->config.crypto_block_ns;
+    stats->crypto_dispatch_ns = my_tree->config.crypto_dispatch_ns;
+    stats->crypto_cores = my_tree->config.crypto_cores;
+    stats->crypto_cpus = my_tree->crypto->cpus;
 
-        swap = btree_search(my_tree->largest_key, my_tree, flag->children[flag_index]);
-        free(flag->key_values[flag_index]->data);
-        free(flag->key_values[flag_index]->tmp2);
-        free(flag->key_values[flag_index]);
+    stats->branching = my_tree->branching;
+    stats->node_size = my_tree->node_size;
+    stats->node_align = my_tree->node_align;
 
-        flag->key_values[flag_index] = swap->key_values[swap->link_count-1];
-        swap->key_values[swap->link_count-1] = NULL;
+    stats->counters.mutex_waits = __atomic_load_n(&my_tree->counters.mutex_waits, __ATOMIC_RELAXED);
+    stats->counters.mutex_wait_ns = __atomic_load_n(&my_tree->counters.mutex_wait_ns, __ATOMIC_RELAXED);
 
-        swap->link_count -= 1;
-        target = swap;
-        
-    } else {
-        delete_key(flag, flag_index);
+    stats->filter_queries = __atomic_load_n(&my_tree->filter.queries, __ATOMIC_RELAXED);
+    stats->filter_negatives = __atomic_load_n(&my_tree->filter.negatives, __ATOMIC_RELAXED);
+    stats->filter_false_positives = __atomic_load_n(&my_tree->filter.false_positives, __ATOMIC_RELAXED);
+    if (stats->filter_negatives + stats->filter_false_positives > 0) {
+        stats->filter_fpr = (double)stats->filter_false_positives / (stats->filter_negatives + stats->filter_false_positives);
     }
-    if (target->link_count >= 1) {
+    return 0;
+}
 
-        pthread_mutex_unlock(&my_tree->mutex);
-        return 0;
+/*
+* Memory held by the store, split by what it is used for. Returns 1 for a NULL store
+*/
+int btree_memory(void * helper, struct btree_memory * memory) {
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (my_tree == NULL) {
+        return 1;
     }
-    int ret = rearrange_keys(my_tree, target, key);
+    lock_tree(my_tree);
+    pthread_mutex_lock(&my_tree->keystreams->mutex);
+    memory->keystream_bytes = my_tree->keystreams->bytes;
+    pthread_mutex_unlock(&my_tree->keystreams->mutex);
+    memory->node_bytes = (uint64_t)my_tree->node_count*my_tree->node_size;
+    memory->record_bytes = __atomic_load_n(&my_tree->record_bytes, __ATOMIC_RELAXED);
+    memory->data_bytes = __atomic_load_n(&my_tree->data_bytes, __ATOMIC_RELAXED);
+    memory->plaintext_bytes = my_tree->plaintext.bytes;
+    memory->filter_bytes = my_tree->filter.cells != NULL ? (uint64_t)my_tree->filter.mask+1 : 0;
+    memory->index_bytes = my_tree->index.slots != NULL ? sizeof(struct hash_slot)*((uint64_t)my_tree->index.mask+1) : 0;
+    memory->plaintext_hits = my_tree->plaintext.hits;
+    memory->plaintext_misses = my_tree->plaintext.misses;
+    memory->total_bytes = memory_used(my_tree, memory->keystream_bytes);
     pthread_mutex_unlock(&my_tree->mutex);
-    return ret;
+
+    memory->budget = my_tree->config.memory_budget;
+    memory->evictions = __atomic_load_n(&my_tree->evictions, __ATOMIC_RELAXED);
+    memory->restores = __atomic_load_n(&my_tree->restores, __ATOMIC_RELAXED);
+    return 0;
 }
 
-void preorder_traversal(struct btree_node* current, struct btree* my_tree, int* count, struct node* list) {
+int btree_histogram(void * helper, int op, int phase, struct btree_histogram * hist) {
 
-    if (current == NULL) {
-        return;
+    struct btree* my_tree = (struct btree*)helper;
+    if (my_tree == NULL || my_tree->histograms == NULL || hist == NULL) {
+        return 1;
     }
-    struct node new_node = {.num_keys = current->link_count};
-    new_node.keys = (uint32_t*)malloc(sizeof(uint32_t)*new_node.num_keys);
-    
-    for (int i = 0; i < current->link_count; i++) {
-       new_node.keys[i] = current->key_values[i]->key;
+    if (op < 0 || op >= BTREE_OP_COUNT || phase < 0 || phase >= BTREE_PHASE_COUNT) {
+        return 1;
     }
+    struct btree_histogram* source = &my_tree->histograms[op*BTREE_PHASE_COUNT + phase];
 
-    list[*count] = new_node;
-    for (int i = 0; i < current->child_count; i++) {
-        *count += 1;
-        preorder_traversal(current->children[i], my_tree, count, list);
+    hist->count = __atomic_load_n(&source->count, __ATOMIC_RELAXED);
+    hist->sum_ns = __atomic_load_n(&source->sum_ns, __ATOMIC_RELAXED);
+    hist->max_ns = __atomic_load_n(&source->max_ns, __ATOMIC_RELAXED);
+    for (int i = 0; i < BTREE_HIST_BUCKETS; i++) {
+        hist->buckets[i] = __atomic_load_n(&source->buckets[i], __ATOMIC_RELAXED);
     }
-    return;
+    return 0;
 }
 
-uint64_t btree_export(void * helper, struct node ** list) {
-    
-    struct btree* my_tree = (struct btree*)helper;
-    if (my_tree->node_count == 0 || my_tree->root == NULL) {
+uint64_t btree_histogram_percentile(struct btree_histogram * hist, double percentile) {
+
+    uint64_t total = 0;
+    for (int i = 0; i < BTREE_HIST_BUCKETS; i++) {
+        total += hist->buckets[i];
+    }
+    if (total == 0) {
         return 0;
     }
-    struct btree_node* root = my_tree->root;
+    uint64_t rank = (uint64_t)(percentile * (total-1));
+    uint64_t seen = 0;
+    for (int i = 0; i < BTREE_HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen > rank) {
+            return histogram_bucket_floor(i);
+        }
+    }
+    return hist->max_ns;
+}
 
-    *list = malloc(sizeof(struct node)*my_tree->node_count);
-    int count = 0;
-    preorder_traversal(root, my_tree, &count, *list);
-    return count+1;
+int btree_histogram_dump(void * helper, const char * path) {
+
+    static const char* op_names[BTREE_OP_COUNT] = {"insert", "retrieve", "decrypt", "delete"};
+    static const char* phase_names[BTREE_PHASE_COUNT] = {"total", "lock", "descent", "structure", "crypto"};
+
+    struct btree* my_tree = (struct btree*)helper;
+    if (my_tree == NULL || my_tree->histograms == NULL) {
+        return 1;
+    }
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return 1;
+    }
+    struct btree_histogram* hist = malloc(sizeof(struct btree_histogram));
+
+    //One summary row per op/phase followed by its non-empty buckets
+    fprintf(file, "op,phase,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+    for (int op = 0; op < BTREE_OP_COUNT; op++) {
+        for (int phase = 0; phase < BTREE_PHASE_COUNT; phase++) {
+            btree_histogram(helper, op, phase, hist);
+            if (hist->count == 0) {
+                continue;
+            }
+            fprintf(file, "%s,%s,%llu,%llu,%llu,%llu,%llu,%llu\n", op_names[op], phase_names[phase],
+            (unsigned long long)hist->count, (unsigned long long)(hist->sum_ns/hist->count),
+            (unsigned long long)btree_histogram_percentile(hist, 0.50),
+            (unsigned long long)btree_histogram_percentile(hist, 0.99),
+            (unsigned long long)btree_histogram_percentile(hist, 0.999), (unsigned long long)hist->max_ns);
+        }
+    }
+    fprintf(file, "\nop,phase,bucket_floor_ns,count\n");
+    for (int op = 0; op < BTREE_OP_COUNT; op++) {
+        for (int phase = 0; phase < BTREE_PHASE_COUNT; phase++) {
+            btree_histogram(helper, op, phase, hist);
+            for (int i = 0; i < BTREE_HIST_BUCKETS; i++) {
+                if (hist->buckets[i] != 0) {
+                    fprintf(file, "%s,%s,%llu,%llu\n", op_names[op], phase_names[phase],
+                    (unsigned long long)histogram_bucket_floor(i), (unsigned long long)hist->buckets[i]);
+                }
+            }
+        }
+    }
+    free(hist);
+    fclose(file);
+    return 0;
 }
 
 void encrypt_tea(uint32_t plain[2], uint32_t cipher[2], uint32_t key[4]) {
@@ -673,6 +4656,18 @@ void decrypt_tea(uint32_t cipher[2], uint32_t plain[2], uint32_t key[4]) {
     return;
 }
 
+uint64_t tea_keystream_block(uint32_t key[4], uint64_t nonce, uint64_t index) {
+
+    //memcpy rather than pointer casts, the casts break strict aliasing once optimised
+    uint64_t tmp1 = index ^ nonce;
+    uint32_t tmp3[2];
+    memcpy(tmp3, &tmp1, sizeof(uint64_t));
+
+    encrypt_tea(tmp3, tmp3, key);
+    memcpy(&tmp1, tmp3, sizeof(uint64_t));
+    return tmp1;
+}
+
 void* thread_encrypt(void* arg) {
 
     struct arguments* flag = (struct arguments*)arg;
@@ -681,155 +4676,441 @@ void* thread_encrypt(void* arg) {
     int n = flag->end;
 
     for (; i < n; i++) {
-        uint64_t tmp1 = i ^ flag->nonce;
-
-        uint32_t tmp3[2];
-        tmp3[0] = ((int32_t *) &tmp1)[0]; 
-        tmp3[1] = ((int32_t *) &tmp1)[1];
-
-        encrypt_tea(tmp3, tmp3, flag->key);
-        flag->tmp2[i] = *(uint64_t*)tmp3;
-        flag->cipher[i] = flag->plain[i] ^ *(uint64_t*)tmp3;
+        uint64_t tmp3 = tea_keystream_block(flag->key, flag->nonce, i);
+        flag->tmp2[i - flag->window] = tmp3;
+        if (flag->plain != NULL) {
+            flag->cipher[i] = flag->plain[i] ^ tmp3;
+        }
     }
     free(flag);
 
     return NULL;
 }
 
-void btree_encrpyt(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks, void * helper, uint64_t* tmp2) {
+void* thread_noop(void* arg) {
 
-    struct btree* my_tree = (struct btree*)helper;
+    return arg;
+}
 
-    int block_num;
-    if (num_blocks < my_tree->n_processors) {
-        block_num = ((num_blocks + (my_tree->n_processors-1))/my_tree->n_processors);
-    } else {
-        block_num = (num_blocks/my_tree->n_processors);
+//TEA and thread start costs are properties of the machine, so they are measured once per process
+static pthread_once_t calibration_once = PTHREAD_ONCE_INIT;
+static uint32_t calibrated_block_ns;
+static uint32_t calibrated_dispatch_ns;
+
+void measure_crypto() {
+
+    uint32_t key[4] = {0, 0, 0, 0};
+    volatile uint64_t sink = 0;
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < CALIBRATION_BLOCKS; i++) {
+        sink ^= tea_keystream_block(key, 0, i);
     }
-    int start = 0;
-    int end = block_num;
+    uint64_t elapsed = (monotonic_ns() - start)/CALIBRATION_BLOCKS;
+    calibrated_block_ns = elapsed > 0 ? elapsed : 1;
+
+    start = monotonic_ns();
+    for (int i = 0; i < CALIBRATION_DISPATCHES; i++) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, &thread_noop, NULL);
+        pthread_join(thread, NULL);
+    }
+    elapsed = (monotonic_ns() - start)/CALIBRATION_DISPATCHES;
+    calibrated_dispatch_ns = elapsed > 0 ? elapsed : 1;
+}
 
-    int i = 0;
-    for (; i < my_tree->n_processors; i++) {
+void calibrate_crypto(struct btree* my_tree) {
 
-        struct arguments* args = malloc(sizeof(struct arguments));
-        args->plain = plain;
-        args->nonce = nonce;
-        args->cipher = cipher;
-        args->start = start;
-        args->end = end;
-        args->tmp2 = tmp2;
-        memmove(args->key, key, sizeof(uint32_t)*4);
+    struct btree_config* config = &my_tree->config;
+    if (config->crypto_cores == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        config->crypto_cores = online > 0 ? online : 1;
+    }
+    if (config->crypto_cores > my_tree->n_processors) {
+        config->crypto_cores = my_tree->n_processors;
+    }
+    if (config->crypto_block_ns == 0 || config->crypto_dispatch_ns == 0) {
+        pthread_once(&calibration_once, &measure_crypto);
+    }
+    if (config->crypto_block_ns == 0) {
+        config->crypto_block_ns = calibrated_block_ns;
+    }
+    if (config->crypto_dispatch_ns == 0) {
+        config->crypto_dispatch_ns = calibrated_dispatch_ns;
+    }
+}
 
-        if (end > num_blocks) {
-            free(args);
-            break;
+/*
+* Chunk count for num_blocks of CTR work. With c chunks a run costs about work/c + c*dispatch, which is lowest
+* at c = sqrt(work/dispatch). The result is capped by the cores not already taken by other in-flight encryptions.
+*/
+uint32_t plan_chunks(struct btree* my_tree, uint32_t num_blocks) {
+
+    uint32_t busy = __atomic_load_n(&my_tree->crypto_active, __ATOMIC_RELAXED);
+    uint32_t available = my_tree->config.crypto_cores > busy ? my_tree->config.crypto_cores - busy : 1;
+
+    uint64_t work = (uint64_t)num_blocks * my_tree->config.crypto_block_ns;
+    uint64_t dispatch = my_tree->config.crypto_dispatch_ns;
+    uint32_t chunks = 1;
+    while (chunks < available && chunks < num_blocks && (uint64_t)(chunks+1)*(chunks+1)*dispatch <= work) {
+        chunks++;
+    }
+    return chunks;
+}
+
+void crypto_push(struct crypto_deque* deque, struct crypto_task* task) {
+
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count == deque->capacity) {
+        struct crypto_task* tasks = malloc(sizeof(struct crypto_task)*deque->capacity*2);
+        for (uint32_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->capacity];
         }
-        pthread_create(&my_tree->pool[i], NULL, &thread_encrypt, args);
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->capacity *= 2;
+    }
+    deque->tasks[(deque->head + deque->count) % deque->capacity] = *task;
+    deque->count += 1;
+    pthread_mutex_unlock(&deque->mutex);
+}
+
+/*
+* Takes a task from the tail (owner) or the head (thief) of a deque. Returns 1 if it was empty
+*/
+int crypto_pop(struct crypto_deque* deque, struct crypto_task* task, char steal) {
 
-        start += block_num;
-        end += block_num;
-        if ((i == my_tree->n_processors-1) && end < num_blocks) {
-            end += 1;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->count == 0) {
+        pthread_mutex_unlock(&deque->mutex);
+        return 1;
+    }
+    if (steal == 1) {
+        *task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+    } else {
+        *task = deque->tasks[(deque->head + deque->count - 1) % deque->capacity];
+    }
+    deque->count -= 1;
+    pthread_mutex_unlock(&deque->mutex);
+    return 0;
+}
+
+/*
+* Finds work for a thread, its own deque first when it has one (own < worker_count), then every other deque
+*/
+int crypto_find(struct crypto_pool* pool, uint32_t own, struct crypto_task* task) {
+
+    if (own < pool->worker_count && crypto_pop(&pool->deques[own], task, 0) == 0) {
+        __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    for (uint32_t i = 1; i <= pool->worker_count; i++) {
+        uint32_t victim = (own + i) % pool->worker_count;
+        if (crypto_pop(&pool->deques[victim], task, 1) == 0) {
+            __atomic_fetch_sub(&pool->queued, 1, __ATOMIC_RELAXED);
+            return 0;
         }
-    }   
+    }
+    return 1;
+}
 
-    for (int j = 0; j < i; j++) {
-        pthread_join(my_tree->pool[j], NULL);
-    }   
-    return;
+void crypto_run(struct crypto_pool* pool, struct crypto_task* task) {
+
+    uint32_t* remaining = task->remaining;
+    task->routine(task->args);
+    //The submitter checks remaining under the pool mutex before waiting, so the broadcast cannot be missed
+    if (__atomic_fetch_sub(remaining, 1, __ATOMIC_RELEASE) == 1) {
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->mutex);
+    }
 }
 
-void* thread_decrypt(void* arg) {
+struct crypto_worker_args {
 
-    struct arguments* flag = (struct arguments*)arg;
+    struct crypto_pool* pool;
+    uint32_t index;
+};
 
-    int i = flag->start;
-    int n = flag->end;
+void* crypto_worker(void* arg) {
 
-    for (; i < n; i++) {
-        uint64_t tmp1 = i ^ flag->nonce;
-  
-        uint32_t tmp3[2];
-        tmp3[0] = ((int32_t *) &tmp1)[0]; 
-        tmp3[1] = ((int32_t *) &tmp1)[1];
+    struct crypto_worker_args* self = (struct crypto_worker_args*)arg;
+    struct crypto_pool* pool = self->pool;
+    uint32_t index = self->index;
+    free(self);
 
-        encrypt_tea(tmp3, tmp3, flag->key);
-        flag->plain[i] = flag->cipher[i] ^ *(uint64_t*)tmp3;
+    struct crypto_task task;
+    while (1) {
+        if (crypto_find(pool, index, &task) == 0) {
+            crypto_run(pool, &task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->mutex);
+        while (__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) <= 0 && pool->stopping == 0) {
+            pthread_cond_wait(&pool->wake, &pool->mutex);
+        }
+        char stopping = pool->stopping;
+        pthread_mutex_unlock(&pool->mutex);
+        if (stopping == 1 && __atomic_load_n(&pool->queued, __ATOMIC_RELAXED) <= 0) {
+            break;
+        }
     }
-    free(flag);
     return NULL;
 }
 
-void btree_decryption(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_t * plain, uint32_t num_blocks, void* helper) {
+/*
+* Resolves crypto_cpus and request_cpus against the CPUs this process may run on. With a CPU set, crypto_cores
+* is capped to one worker per CPU in it plus the calling thread. A set left empty by the exclusion is ignored.
+*/
+void plan_affinity(struct btree* my_tree) {
 
-    struct btree* my_tree = (struct btree*)helper;
+    struct btree_config* config = &my_tree->config;
+    CPU_ZERO(&my_tree->crypto->cpus);
+    if (CPU_COUNT(&config->crypto_cpus) == 0 && CPU_COUNT(&config->request_cpus) == 0) {
+        return;
+    }
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &cpus) != 0) {
+        return;
+    }
+    if (CPU_COUNT(&config->crypto_cpus) != 0) {
+        CPU_AND(&cpus, &cpus, &config->crypto_cpus);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &config->request_cpus)) {
+            CPU_CLR(cpu, &cpus);
+        }
+    }
+    uint32_t workers = CPU_COUNT(&cpus);
+    if (workers == 0) {
+        return;
+    }
+    my_tree->crypto->cpus = cpus;
+    if (config->crypto_cores > workers+1) {
+        config->crypto_cores = workers+1;
+    }
+}
 
-    int block_num;
-    if (num_blocks < my_tree->n_processors) {
-        block_num = ((num_blocks + (my_tree->n_processors-1))/my_tree->n_processors);
-    } else {
-        block_num = (num_blocks/my_tree->n_processors);
+/*
+* CPU of the resolved set for worker index, round robin over the set. Returns -1 when workers are unpinned
+*/
+int worker_cpu(struct crypto_pool* pool, uint32_t index) {
+
+    uint32_t size = CPU_COUNT(&pool->cpus);
+    if (size == 0) {
+        return -1;
+    }
+    uint32_t nth = index % size;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &pool->cpus)) {
+            if (nth == 0) {
+                return cpu;
+            }
+            nth--;
+        }
     }
-    int start = 0;
-    int end = block_num;
+    return -1;
+}
 
-    int i = 0;
-    for (; i < my_tree->n_processors; i++) {
+/*
+* One worker per usable core besides the caller, which always helps with its own call
+*/
+void crypto_pool_start(struct btree* my_tree) {
+
+    struct crypto_pool* pool = my_tree->crypto;
+    pool->worker_count = my_tree->config.crypto_cores > 1 ? my_tree->config.crypto_cores-1 : 1;
+    pool->deques = calloc(pool->worker_count, sizeof(struct crypto_deque));
+    pool->workers = malloc(sizeof(pthread_t)*pool->worker_count);
+    for (uint32_t i = 0; i < pool->worker_count; i++) {
+        pthread_mutex_init(&pool->deques[i].mutex, NULL);
+        pool->deques[i].capacity = CRYPTO_DEQUE_CAPACITY;
+        pool->deques[i].tasks = malloc(sizeof(struct crypto_task)*CRYPTO_DEQUE_CAPACITY);
+    }
+    for (uint32_t i = 0; i < pool->worker_count; i++) {
+        struct crypto_worker_args* args = malloc(sizeof(struct crypto_worker_args));
+        args->pool = pool;
+        args->index = i;
+        //Pinned through the attributes so a worker never starts on, or migrates to, another CPU
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        int cpu = worker_cpu(pool, i);
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &set);
+        }
+        pthread_create(&pool->workers[i], &attr, &crypto_worker, args);
+        pthread_attr_destroy(&attr);
+    }
+    pool->started = 1;
+}
+
+void free_crypto_pool(struct crypto_pool* pool) {
+
+    if (pool->started == 1) {
+        pthread_mutex_lock(&pool->mutex);
+        pool->stopping = 1;
+        pthread_cond_broadcast(&pool->wake);
+        pthread_mutex_unlock(&pool->mutex);
+        for (uint32_t i = 0; i < pool->worker_count; i++) {
+            pthread_join(pool->workers[i], NULL);
+            pthread_mutex_destroy(&pool->deques[i].mutex);
+            free(pool->deques[i].tasks);
+        }
+        free(pool->deques);
+        free(pool->workers);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool);
+}
+
+/*
+* Spreads count tasks over the worker deques, starting the pool if needed, and runs tasks from any deque until
+* none is left, then sleeps until the workers finish the ones they hold. Uneven tasks are rebalanced by stealing.
+*/
+void pool_run(struct btree* my_tree, void* (*routine)(void*), void** args, uint32_t count) {
+
+    struct crypto_pool* pool = my_tree->crypto;
+    uint32_t remaining = count;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->started == 0) {
+        crypto_pool_start(my_tree);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        struct crypto_task task = {.routine = routine, .args = args[i], .remaining = &remaining};
+        crypto_push(&pool->deques[pool->next_deque], &task);
+        pool->next_deque = (pool->next_deque + 1) % pool->worker_count;
+    }
+    __atomic_fetch_add(&pool->queued, count, __ATOMIC_RELAXED);
+    uint32_t thief = pool->next_deque;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->mutex);
+
+    struct crypto_task task;
+    while (crypto_find(pool, pool->worker_count + thief, &task) == 0) {
+        crypto_run(pool, &task);
+    }
+    pthread_mutex_lock(&pool->mutex);
+    while (__atomic_load_n(&remaining, __ATOMIC_ACQUIRE) != 0) {
+        pthread_cond_wait(&pool->done, &pool->mutex);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+* Splits blocks [start, end) into CRYPTO_TASKS_PER_CHUNK ranges per planned chunk and runs them on the pool,
+* a single chunk never leaves the calling thread
+*/
+void parallel_ctr(struct btree* my_tree, void* (*routine)(void*), struct arguments* base, uint32_t start, uint32_t end) {
 
+    uint32_t num_blocks = end - start;
+    if (num_blocks == 0) {
+        return;
+    }
+    uint32_t chunks = plan_chunks(my_tree, num_blocks);
+    if (chunks == 1) {
         struct arguments* args = malloc(sizeof(struct arguments));
-        args->plain = plain;
-        args->nonce = nonce;
-        args->cipher = cipher;
+        *args = *base;
         args->start = start;
         args->end = end;
-        memmove(args->key, key, sizeof(uint32_t)*4);
+        routine(args);
+        return;
+    }
+    __atomic_fetch_add(&my_tree->crypto_active, chunks, __ATOMIC_RELAXED);
 
-        if (end > num_blocks) {
-            free(args);
-            break;
-        }
-        pthread_create(&my_tree->pool[i], NULL, &thread_decrypt, args);
+    uint32_t tasks = chunks*CRYPTO_TASKS_PER_CHUNK < num_blocks ? chunks*CRYPTO_TASKS_PER_CHUNK : num_blocks;
+    void** ranges = malloc(sizeof(void*)*tasks);
+    for (uint32_t i = 0; i < tasks; i++) {
+        struct arguments* args = malloc(sizeof(struct arguments));
+        *args = *base;
+        args->start = start + (uint64_t)num_blocks*i/tasks;
+        args->end = start + (uint64_t)num_blocks*(i+1)/tasks;
+        ranges[i] = args;
+    }
+    pool_run(my_tree, routine, ranges, tasks);
+    free(ranges);
+    __atomic_fetch_sub(&my_tree->crypto_active, chunks, __ATOMIC_RELAXED);
+}
 
-        start += block_num;
-        end += block_num;
-        if ((i == my_tree->n_processors-1) && end < num_blocks) {
-            end += 1;
-        }
-    }   
-    for (int j = 0; j < i; j++) {
-        pthread_join(my_tree->pool[j], NULL);
-    }   
+void btree_encrpyt(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks, void * helper, uint64_t* tmp2) {
+
+    struct arguments args = {.plain = plain, .nonce = nonce, .cipher = cipher, .tmp2 = tmp2};
+    memmove(args.key, key, sizeof(uint32_t)*4);
+
+    parallel_ctr((struct btree*)helper, &thread_encrypt, &args, 0, num_blocks);
     return;
 }
 
-void my_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks, uint64_t* tmp2) {
+void fill_keystream(struct btree* my_tree, uint32_t key[4], uint64_t nonce, uint64_t* tmp2, uint32_t start, uint32_t end) {
 
-    for (int i = 0; i < num_blocks; i++) {
-        uint64_t tmp1 = i ^ nonce;
+    if (start >= end) {
+        return;
+    }
+    struct arguments args = {.plain = NULL, .nonce = nonce, .cipher = NULL, .tmp2 = tmp2};
+    memmove(args.key, key, sizeof(uint32_t)*4);
+
+    parallel_ctr(my_tree, &thread_encrypt, &args, start, end);
+}
+
+/*
+* fill_keystream for blocks [start, end) into window, which holds block start at index 0
+*/
+void fill_keystream_window(struct btree* my_tree, uint32_t key[4], uint64_t nonce, uint64_t* window, uint32_t start, uint32_t end) {
+
+    if (start >= end) {
+        return;
+    }
+    struct arguments args = {.plain = NULL, .nonce = nonce, .cipher = NULL, .tmp2 = window, .window = start};
+    memmove(args.key, key, sizeof(uint32_t)*4);
+
+    parallel_ctr(my_tree, &thread_encrypt, &args, start, end);
+}
+
+void* thread_decrypt(void* arg) {
+
+    struct arguments* flag = (struct arguments*)arg;
 
-        uint32_t tmp3[2];
-        tmp3[0] = ((int32_t *) &tmp1)[0]; 
-        tmp3[1] = ((int32_t *) &tmp1)[1];
+    int i = flag->start;
+    int n = flag->end;
 
-        encrypt_tea(tmp3, tmp3, key);
-        tmp2[i] = *(uint64_t*)tmp3;
-        cipher[i] = plain[i] ^ *(uint64_t*)tmp3;
+    for (; i < n; i++) {
+        uint64_t tmp3 = tea_keystream_block(flag->key, flag->nonce, i);
+        flag->plain[i] = flag->cipher[i] ^ tmp3;
     }
+    free(flag);
+    return NULL;
+}
+
+void btree_decryption(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_t * plain, uint32_t num_blocks, void* helper) {
+
+    struct arguments args = {.plain = plain, .nonce = nonce, .cipher = cipher, .tmp2 = NULL};
+    memmove(args.key, key, sizeof(uint32_t)*4);
+
+    parallel_ctr((struct btree*)helper, &thread_decrypt, &args, 0, num_blocks);
     return;
 }
 
-void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks) {
+void my_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks, uint64_t* tmp2) {
 
     for (int i = 0; i < num_blocks; i++) {
-        uint64_t tmp1 = i ^ nonce;
+        uint64_t tmp3 = tea_keystream_block(key, nonce, i);
+        tmp2[i] = tmp3;
+        cipher[i] = plain[i] ^ tmp3;
+    }
+    return;
+}
 
-        uint32_t tmp3[2];
-        tmp3[0] = ((int32_t *) &tmp1)[0]; 
-        tmp3[1] = ((int32_t *) &tmp1)[1];
+void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t * cipher, uint32_t num_blocks) {
 
-        encrypt_tea(tmp3, tmp3, key);
-        cipher[i] = plain[i] ^ *(uint64_t*)tmp3;
+    for (int i = 0; i < num_blocks; i++) {
+        uint64_t tmp3 = tea_keystream_block(key, nonce, i);
+        cipher[i] = plain[i] ^ tmp3;
     }
     return;
 }
@@ -837,14 +5118,8 @@ void encrypt_tea_ctr(uint64_t * plain, uint32_t key[4], uint64_t nonce, uint64_t
 void decrypt_tea_ctr(uint64_t * cipher, uint32_t key[4], uint64_t nonce, uint64_t * plain, uint32_t num_blocks) {
     
     for (int i = 0; i < num_blocks; i++) {
-        uint64_t tmp1 = i ^ nonce;
-
-        uint32_t tmp3[2];
-        tmp3[0] = ((int32_t *) &tmp1)[0]; 
-        tmp3[1] = ((int32_t *) &tmp1)[1];
-
-        encrypt_tea(tmp3, tmp3, key);
-        plain[i] = cipher[i] ^ *(uint64_t*)tmp3;
+        uint64_t tmp3 = tea_keystream_block(key, nonce, i);
+        plain[i] = cipher[i] ^ tmp3;
     }
     return;
 }
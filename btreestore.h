@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdlib.h>
 
 struct info {
@@ -20,15 +21,91 @@ struct node {
     uint32_t * keys;
 };
 
+struct keystream {
+
+    uint32_t key[4];
+    uint64_t nonce;
+    uint32_t num_blocks;
+    uint32_t refs; //Records (and in-flight extensions) using this keystream
+    uint32_t pins; //Holders reading blocks outside the tree lock, a pinned entry is never evicted
+    char recent; //Second chance bit for the eviction sweep, set whenever blocks are used
+    uint64_t * blocks; //TEA(block index ^ nonce) for blocks [0, num_blocks), NULL once evicted
+
+    struct keystream* next;
+};
+
+struct keystream_cache {
+
+    pthread_mutex_t mutex;
+    struct keystream** buckets;
+    uint32_t bucket_count;
+    uint32_t count;
+    uint64_t bytes;
+    uint32_t clock; //Bucket the next eviction sweep starts from
+};
+
+struct plaintext {
+
+    uint32_t key;
+    uint32_t stamp; //Stamp of the record value this copy was decrypted from
+    uint32_t size;
+    char recent; //Second chance bit, set on every hit
+    struct plaintext* next;
+
+    unsigned char data[];
+};
+
+//Decrypted copies of recently read values, guarded by the tree mutex like the records themselves
+struct plaintext_cache {
+
+    struct plaintext** buckets; //NULL while the cache is disabled
+    uint32_t bucket_count;
+    uint32_t count;
+    uint64_t bytes; //Entry allocations, headers included
+    uint32_t clock; //Bucket the next eviction sweep starts from
+    uint64_t hits;
+    uint64_t misses;
+};
+
+//Counting Bloom filter over the live keys. Cells change under the tree mutex, lookups read them without it
+struct key_filter {
+
+    uint8_t* cells; //NULL while the filter is disabled, a cell that reaches 255 stays there
+    uint32_t mask; //Cell count minus one, the count is a power of two
+    uint8_t probes;
+
+    //Relaxed atomics
+    uint64_t queries;
+    uint64_t negatives; //Lookups answered absent without the tree lock
+    uint64_t false_positives; //Lookups the filter let through for keys that were not there
+};
+
+struct hash_slot {
+
+    uint32_t key;
+    struct dict* record; //NULL for an empty slot
+};
+
+//Open addressing table from key to record, linear probing. Guarded by the tree mutex, the tree stays authoritative
+struct hash_index {
+
+    struct hash_slot* slots; //NULL while the index is disabled
+    uint32_t mask; //Slot count minus one, the count is a power of two
+    uint32_t count; //Records in the tree, tombstones included
+};
+
 struct dict {
 
-    size_t size; //Size of stored data in bytes
+    uint32_t key;
+    uint32_t size; //Size of stored data in bytes
+    uint32_t capacity; //Bytes allocated for data, an in-place rewrite can leave it above size
+    uint32_t stamp; //Store wide write sequence number, a new value always gets a new stamp
     uint32_t encrypt_key[4]; //Encryption key
     uint64_t nonce; //Nonce data
-    void * data; //Encrypted stored data
-    uint64_t * tmp2;
-    
-    uint32_t key;
+    struct keystream * stream; //Shared with every record under the same key and nonce, NULL for a tombstone
+    void * data; //Encrypted stored data, either inline_data or a separate blob, NULL for a buried blob
+
+    uint64_t inline_data[]; //Small payloads live in the same allocation as the header
 };
 
 struct btree_node {
@@ -38,24 +115,398 @@ struct btree_node {
     
     char leaf;
 
-    struct btree_node** children;
+    //Packed copy of the keys for search, base plus 8 or 16 bit deltas. Only used with compress_keys.
+    //The small fields sit in the padding after leaf so the header stays one slot shorter
+    char keys_packed; //Cleared whenever the node's keys change, the next search repacks
+    uint8_t key_width; //Bytes per delta, 0 when the span does not fit and search reads the records
+    uint32_t key_base;
+
+    struct btree_node** children; //Both arrays follow the header in the same allocation
     struct dict** key_values;
     struct btree_node* parent;
+    uint8_t* key_deltas;
+
+    uint64_t live_count; //Live records in this node and every node below it, tombstones excluded
+    uint32_t max_stamp; //Newest record stamp in this node and below, checkpoints skip subtrees not newer than their last run
 
 
 };
 
+#define BTREE_MAX_LEVELS 32
+
+struct btree_counters {
+
+    uint64_t splits; //split_node calls, including root splits
+    uint64_t root_growths; //create_new_root calls
+    uint64_t merges; //left_merge and right_merge calls
+    uint64_t rotations; //left_swap and right_swap calls
+
+    uint64_t mutex_waits; //Lock acquisitions that found the mutex held
+    uint64_t mutex_wait_ns; //Time spent blocked on the mutex
+};
+
+struct btree_stats {
+
+    uint32_t height;
+    uint32_t node_count;
+    uint32_t level_nodes[BTREE_MAX_LEVELS]; //Node count per level, root first
+
+    uint64_t key_count; //Live records only
+    uint64_t tombstones; //Deleted records still holding a slot
+    double fill_factor; //Average occupied slots (tombstones included) per node over branching-1
+    uint64_t payload_bytes;
+    uint64_t keystream_bytes; //Shared keystreams, counted once
+    uint32_t keystream_entries;
+
+    uint32_t crypto_block_ns;
+    uint32_t crypto_dispatch_ns;
+    uint32_t crypto_cores;
+    cpu_set_t crypto_cpus; //CPUs the crypto workers are pinned to, empty when unpinned
+
+    uint16_t branching;
+    uint32_t node_size;
+    uint32_t node_align;
+    uint32_t packed_nodes[3]; //Nodes searched with 8 bit deltas, 16 bit deltas and the record fallback
+
+    uint64_t filter_queries; //Lookups that consulted the negative lookup filter
+    uint64_t filter_negatives;
+    uint64_t filter_false_positives;
+    double filter_fpr; //False positives over every lookup for an absent key, 0 until one is seen
+
+    struct btree_counters counters;
+};
+
+//Latency histograms are compiled out unless built with -DBTREE_HISTOGRAMS
+#define BTREE_HIST_SUB_BITS 4
+#define BTREE_HIST_BUCKETS ((64-BTREE_HIST_SUB_BITS+1) << BTREE_HIST_SUB_BITS)
+
+#define BTREE_OP_INSERT 0
+#define BTREE_OP_RETRIEVE 1
+#define BTREE_OP_DECRYPT 2
+#define BTREE_OP_DELETE 3
+#define BTREE_OP_COUNT 4
+
+#define BTREE_PHASE_TOTAL 0
+#define BTREE_PHASE_LOCK 1 //Waiting for the tree mutex
+#define BTREE_PHASE_DESCENT 2 //btree_search
+#define BTREE_PHASE_STRUCTURE 3 //Splits, merges and rotations
+#define BTREE_PHASE_CRYPTO 4 //Encryption or decryption
+#define BTREE_PHASE_COUNT 5
+
+struct btree_histogram {
+
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[BTREE_HIST_BUCKETS]; //Log-linear: 2^SUB_BITS linear buckets per power of two
+};
+
+struct btree_config {
+
+    uint16_t branching; //Ignored when node_bytes is set
+    uint32_t node_bytes; //Target node size, the fanout is derived from it. 0 sizes nodes from branching
+    char compress_keys; //Keep a delta packed key array in every node for btree_search
+    uint8_t n_processors;
+    uint32_t inline_threshold; //Payloads up to this many bytes are stored inside the record
+
+    //Encryption cost model, zero fields take values measured by the first init_store_config of the process
+    uint32_t crypto_block_ns; //TEA cost of one 8 byte block
+    uint32_t crypto_dispatch_ns; //Cost of handing one chunk to another thread
+    uint32_t crypto_cores; //Cores encryption may spread over, at most n_processors
+    cpu_set_t crypto_cpus; //Crypto workers are pinned one per CPU from this set, built with CPU_SET. Empty is every CPU
+    cpu_set_t request_cpus; //CPUs kept for request threads, taken out of crypto_cpus. Both empty leaves workers unpinned
+
+    uint8_t async_workers; //Encryption threads behind the async API, 0 uses n_processors
+
+    char tombstone_deletes; //btree_delete only marks records, a maintenance thread removes them later
+    uint32_t maintenance_budget; //Tombstones removed per hold of the tree lock, 0 is rejected
+    uint32_t maintenance_interval_ms; //Maintenance thread wake up period, 0 is rejected
+
+    uint64_t memory_budget; //Bytes, 0 is unlimited. Above it cached plaintext, then keystreams, are dropped
+    uint64_t plaintext_cache_bytes; //Decrypted values kept for btree_decrypt, 0 disables. They sit unencrypted
+    uint32_t filter_keys; //Expected live keys, sizes the filter that rejects missing keys before the lock. 0 disables
+    char hash_index; //Keep a key to record hash table so point lookups skip the tree descent
+
+    const char * checkpoint_path; //Image file for btree_checkpoint, copied by init_store_config. NULL disables
+    uint32_t checkpoint_key[4]; //Wraps the record keys written to the image, required with checkpoint_path and by btree_restore
+    uint32_t checkpoint_interval_ms; //Background checkpoint period, 0 leaves checkpoints to btree_checkpoint
+};
+
+struct btree_memory {
+
+    uint64_t node_bytes;
+    uint64_t record_bytes; //Record headers with their inline payloads
+    uint64_t data_bytes; //Separately allocated ciphertext
+    uint64_t keystream_bytes; //Cached keystream blocks, evicted after the plaintext cache
+    uint64_t plaintext_bytes; //Plaintext cache entries
+    uint64_t filter_bytes; //Negative lookup filter cells
+    uint64_t index_bytes; //Hash index slots
+    uint64_t total_bytes;
+    uint64_t budget; //0 when unlimited
+    uint64_t evictions; //Keystreams dropped to stay within the budget
+    uint64_t restores; //Evicted keystreams rebuilt when a record needed them
+    uint64_t plaintext_hits; //btree_decrypt calls answered from the plaintext cache
+    uint64_t plaintext_misses;
+};
+
+struct btree_maintenance {
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_t thread;
+    char running;
+    char stopping;
+
+    uint32_t* keys; //Keys buried since the last compaction, guarded by the tree mutex
+    uint32_t count;
+    uint32_t capacity;
+};
+
+//Checkpoint image layout, host byte order. Every checkpoint appends one segment: a header, the key ranges deleted
+//since the previous segment, frames of records changed since it, and an end frame. A full segment replaces
+//everything before it. Replaying the ranges and then the records of each complete segment in order rebuilds the
+//store, a segment without its end frame was cut short and is ignored along with anything after it.
+//
+//WARNING: the image holds every value's ciphertext and nonce next to its record key wrapped under checkpoint_key.
+//Whoever has both the image and checkpoint_key can decrypt the whole store, so keep checkpoint_key out of the
+//image's directory, backups and config files. Without it the image only reveals keys, sizes and which records
+//share an encryption key.
+#define BTREE_CHECKPOINT_MAGIC 0x54504B43
+#define BTREE_CHECKPOINT_FRAME 0x4D415246
+#define BTREE_CHECKPOINT_END 0x21444E45
+#define BTREE_CHECKPOINT_FULL 1
+
+struct btree_checkpoint_header {
+
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t sequence;
+    uint32_t since; //Records stamped after since are in the segment, 0 for a full one
+    uint32_t stamp; //Write stamp when the segment started, later writes may or may not be in it
+    uint64_t ranges; //struct checkpoint_range entries following the header
+    uint32_t key_check[2]; //A fixed block under checkpoint_key, btree_restore stops at a segment written under another
+};
+
+struct checkpoint_range {
+
+    uint32_t lo;
+    uint32_t hi;
+};
+
+struct btree_checkpoint_frame {
+
+    uint32_t magic; //BTREE_CHECKPOINT_FRAME, or BTREE_CHECKPOINT_END with no payload
+    uint32_t records;
+    uint64_t bytes; //Payload following the frame
+};
+
+struct btree_checkpoint_record {
+
+    uint32_t key;
+    uint32_t size; //Followed by the ciphertext, padded to whole 8 byte blocks
+    uint32_t wrapped_key[4]; //The record's encryption key under checkpoint_key
+    uint64_t nonce;
+};
+
+struct btree_checkpoint_stats {
+
+    uint64_t checkpoints; //Completed, full ones included
+    uint64_t full_checkpoints;
+    uint64_t failures; //Checkpoints abandoned on an I/O error, the next one is full
+    uint64_t last_duration_ns;
+    uint64_t total_duration_ns;
+    uint64_t last_bytes; //Bytes written by the last completed checkpoint
+    uint64_t total_bytes;
+    uint64_t last_records;
+    uint64_t last_ranges;
+    uint64_t batches; //Holds of the tree lock across every checkpoint
+    uint32_t stamp; //Every write stamped up to here is in the image
+};
+
+//Records copied in one hold of the tree lock, their keys wrapped and written out in one go once it is released
+struct checkpoint_batch {
+
+    unsigned char* buffer; //Starts with room for the frame
+    size_t used;
+    size_t capacity;
+    uint32_t records;
+    uint32_t since;
+    char full; //Every live record, whatever its stamp
+    uint32_t* wrapping; //checkpoint_key of the store
+    uint64_t cursor; //Next key to look at, past UINT32_MAX once the walk is done
+};
+
+struct btree_checkpointer {
+
+    pthread_mutex_t mutex; //Held for a whole checkpoint, so only one runs at a time
+    pthread_cond_t wake;
+    pthread_t thread;
+    char running;
+    char stopping;
+
+    //Guarded by the tree mutex
+    struct checkpoint_range* ranges; //Deleted since the running checkpoint, or the last one, started
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t since; //Start stamp of the last completed checkpoint
+    char full; //Next checkpoint rewrites the whole image
+    uint64_t sequence;
+    uint64_t file_bytes; //Image size, the next checkpoint is full once it passes twice full_bytes
+    uint64_t full_bytes;
+    struct btree_checkpoint_stats stats;
+};
+
+struct crypto_task {
+
+    void* (*routine)(void*);
+    void* args; //Handed to routine, the encryption routines free it
+    uint32_t* remaining; //Tasks of the submitting call still running
+};
+
+struct crypto_deque {
+
+    pthread_mutex_t mutex;
+    struct crypto_task* tasks; //Ring buffer, the owner pops the tail and thieves take the head
+    uint32_t head;
+    uint32_t count;
+    uint32_t capacity;
+};
+
+struct crypto_pool {
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t done; //Broadcast when the last task of a pool_run call finishes
+    int32_t queued; //Tasks sitting in deques, may dip below zero while a push is being published
+
+    struct crypto_deque* deques;
+    pthread_t* workers;
+    uint32_t worker_count;
+    uint32_t next_deque; //Round robin start for pushes
+    cpu_set_t cpus; //Resolved CPU set, worker i is pinned to its i-th CPU modulo the set size. Empty when unpinned
+    char started;
+    char stopping;
+};
+
+struct btree_ingest {
+
+    struct btree* tree;
+    struct dict* record; //Unpublished until btree_insert_finish, which gives it its keystream
+    uint64_t* scratch; //STREAM_CHUNK bytes of keystream, refilled for the blocks of each append
+    size_t written;
+};
+
+struct btree_completion {
+
+    uint64_t ticket;
+    int op; //BTREE_OP_INSERT or BTREE_OP_DECRYPT
+    uint32_t key;
+    int result; //Same return code as the synchronous call
+    void * output; //Decrypt destination passed at submission
+    void * context; //Caller data passed at submission
+};
+
+typedef void (*btree_callback)(struct btree_completion * completion);
+
+typedef int (*btree_chunk_callback)(const void * chunk, size_t len, void * context); //Nonzero stops the stream
+
+typedef void (*btree_visitor)(const struct dict * record, void * context); //May run on several threads at once
+
+struct traversal_task {
+
+    struct btree_node* root; //Subtree walked by one pool task
+    btree_visitor visitor; //NULL when exporting
+    void* context;
+
+    struct node* list; //Preorder export of the subtree, grown as it goes
+    uint32_t count;
+    uint32_t capacity;
+    uint64_t visited;
+};
+
+struct btree_job {
+
+    struct btree_completion completion;
+    btree_callback callback;
+
+    void * plaintext;
+    size_t count;
+    uint32_t encrypt_key[4];
+    uint64_t nonce;
+    struct dict * record; //Encrypted by a worker, linked by the apply stage. NULL for an insert found duplicate at submit
+    struct keystream * stream; //Decrypts only, referenced and pinned by the apply stage until a worker has XORed output
+
+    char ready; //Set once the encryption stage is finished
+    struct btree_job* next_pending;
+    struct btree_job* next;
+};
+
+struct btree_async {
+
+    pthread_mutex_t mutex;
+    pthread_cond_t work; //Signals workers that pending has jobs
+    pthread_cond_t ready; //Signals the apply stage that a job finished encrypting
+    pthread_cond_t idle; //Signals btree_async_drain that a job completed
+
+    pthread_t* workers;
+    uint8_t worker_count;
+    pthread_t applier;
+    char started;
+    char stopping;
+
+    struct btree_job* pending; //Waiting for an encryption worker, FIFO
+    struct btree_job* pending_tail;
+    struct btree_job* order; //Every job not yet applied, in ticket order
+    struct btree_job* order_tail;
+    struct btree_job* completions; //Finished jobs without a callback, waiting for btree_async_poll
+    struct btree_job* completions_tail;
+
+    uint64_t next_ticket;
+    uint64_t outstanding; //Submitted jobs not yet completed
+};
+
 struct btree {
 
+    struct btree_config config;
+
     uint16_t branching;
     uint8_t n_processors;
+    uint32_t node_size; //Bytes per node allocation, header and arrays together
+    uint32_t node_align;
 
     pthread_mutex_t mutex;
-    pthread_t* pool;
     struct btree_node* root;
 
     uint32_t node_count;
     uint32_t largest_key;
+    uint32_t write_stamp; //Last stamp handed to a record value, atomic since records are built outside the lock
+
+    //Relaxed atomics like write_stamp, nodes are accounted as node_count*node_size
+    uint64_t record_bytes;
+    uint64_t data_bytes;
+    uint64_t evictions;
+    uint64_t restores;
+
+    struct keystream_cache* keystreams;
+    struct plaintext_cache plaintext;
+    struct key_filter filter;
+    struct hash_index index;
+    uint32_t crypto_active; //Chunks currently being encrypted or decrypted, across all callers
+    struct crypto_pool* crypto; //Workers start on the first encryption split into more than one chunk
+
+    //Structural counters are only touched under mutex, the wait counters are relaxed atomics
+    struct btree_counters counters;
+    struct btree_histogram* histograms; //NULL unless built with BTREE_HISTOGRAMS
+
+    struct btree_async* async; //Worker threads start on the first async submission
+    struct btree_maintenance maintenance;
+    struct btree_checkpointer checkpoint;
+};
+
+struct btree_part {
+
+    struct btree_node* root; //Parentless subtree, NULL when empty
+    int height; //0 for a single leaf, -1 when empty
 };
 
 struct arguments {
@@ -65,6 +516,7 @@ struct arguments {
     uint64_t nonce;
     uint64_t * cipher;
     uint64_t * tmp2;
+    int window; //Block held by tmp2[0], 0 when tmp2 covers the stream from its first block
 
     int start;
     int end;
@@ -73,18 +525,78 @@ struct arguments {
 
 void * init_store(uint16_t branching, uint8_t n_processors);
 
+void btree_default_config(struct btree_config * config, uint16_t branching, uint8_t n_processors);
+
+void * init_store_config(struct btree_config * config);
+
 void close_store(void * helper);
 
 int btree_insert(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper);
 
+struct btree_ingest * btree_insert_begin(uint32_t key, uint32_t encryption_key[4], uint64_t nonce, size_t total_size, void * helper);
+
+int btree_insert_append(struct btree_ingest * ingest, const void * chunk, size_t len);
+
+int btree_insert_finish(struct btree_ingest * ingest);
+
+void btree_insert_abort(struct btree_ingest * ingest);
+
+int btree_update(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper);
+
+int btree_upsert(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, void * helper);
+
 int btree_retrieve(uint32_t key, struct info * found, void * helper);
 
 int btree_decrypt(uint32_t key, void * output, void * helper);
 
+int btree_decrypt_stream(uint32_t key, btree_chunk_callback callback, void * context, size_t chunk_size, void * helper);
+
+int btree_decrypt_to_fd(uint32_t key, int fd, void * helper);
+
 int btree_delete(uint32_t key, void * helper);
 
+uint64_t btree_rank(uint32_t key, void * helper);
+
+int btree_select(uint64_t index, uint32_t * key, void * helper);
+
+uint64_t btree_count_range(uint32_t lo, uint32_t hi, void * helper);
+
+uint64_t btree_delete_range(uint32_t lo, uint32_t hi, void * helper);
+
+uint64_t btree_compact(void * helper);
+
+int btree_merge_stores(void * helper, void * other);
+
+void * btree_split_store(void * helper, uint32_t pivot);
+
+int btree_checkpoint(void * helper);
+
+int btree_checkpoint_stats(void * helper, struct btree_checkpoint_stats * stats);
+
+void * btree_restore(const char * path, struct btree_config * config);
+
+uint64_t btree_insert_async(uint32_t key, void * plaintext, size_t count, uint32_t encryption_key[4], uint64_t nonce, btree_callback callback, void * context, void * helper);
+
+uint64_t btree_decrypt_async(uint32_t key, void * output, btree_callback callback, void * context, void * helper);
+
+int btree_async_poll(void * helper, struct btree_completion * completion);
+
+void btree_async_drain(void * helper);
+
 uint64_t btree_export(void * helper, struct node ** list);
 
+uint64_t btree_for_each(void * helper, btree_visitor visitor, void * context);
+
+int btree_stats(void * helper, struct btree_stats * stats);
+
+int btree_memory(void * helper, struct btree_memory * memory);
+
+int btree_histogram(void * helper, int op, int phase, struct btree_histogram * hist);
+
+uint64_t btree_histogram_percentile(struct btree_histogram * hist, double percentile);
+
+int btree_histogram_dump(void * helper, const char * path);
+
 void encrypt_tea(uint32_t plain[2], uint32_t cipher[2], uint32_t key[4]);
 
 void decrypt_tea(uint32_t cipher[2], uint32_t plain[2], uint32_t key[4]);
@@ -0,0 +1,230 @@
+#include "btreestore.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define KERNEL_TEA 0
+#define KERNEL_TEA_CTR 1
+#define KERNEL_MY_TEA_CTR 2
+#define KERNEL_BTREE_ENCRYPT 3
+#define KERNEL_BTREE_DECRYPT 4
+#define KERNEL_COUNT 5
+
+#define MIN_BENCH_NS 200000000ULL
+
+static const char* kernel_names[] = {"encrypt_tea", "encrypt_tea_ctr", "my_tea_ctr", "btree_encrpyt", "btree_decryption"};
+
+uint64_t bench_ns() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t bench_cycles() {
+
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+* Reference CTR keystream built only from encrypt_tea, every kernel must match it bit for bit
+*/
+void reference_ctr(uint64_t* plain, uint32_t key[4], uint64_t nonce, uint64_t* cipher, uint64_t* keystream, uint32_t num_blocks) {
+
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        uint64_t counter = i ^ nonce;
+        uint32_t block[2];
+        memcpy(block, &counter, sizeof(block));
+        encrypt_tea(block, block, key);
+        memcpy(&keystream[i], block, sizeof(uint64_t));
+        cipher[i] = plain[i] ^ keystream[i];
+    }
+}
+
+/*
+* Runs every kernel over the same input and compares it with reference_ctr. Returns the number of mismatches
+*/
+int verify_kernels(uint32_t num_blocks, uint8_t n_processors) {
+
+    uint32_t key[4] = {0x01234567, 0x89ABCDEF, 0xFEDCBA98, 0x76543210};
+    uint64_t nonce = 0x0123456789ABCDEFULL;
+
+    uint64_t* plain = malloc(sizeof(uint64_t)*num_blocks);
+    uint64_t* expected = malloc(sizeof(uint64_t)*num_blocks);
+    uint64_t* keystream = malloc(sizeof(uint64_t)*num_blocks);
+    uint64_t* cipher = malloc(sizeof(uint64_t)*num_blocks);
+    uint64_t* tmp2 = malloc(sizeof(uint64_t)*num_blocks);
+    uint64_t* output = malloc(sizeof(uint64_t)*num_blocks);
+    for (uint32_t i = 0; i < num_blocks; i++) {
+        plain[i] = i * 0x9E3779B97F4A7C15ULL;
+    }
+    reference_ctr(plain, key, nonce, expected, keystream, num_blocks);
+    //Free dispatch forces every available chunk so the threaded split is checked even on one core
+    struct btree_config config;
+    btree_default_config(&config, 4, n_processors);
+    config.crypto_block_ns = 1000;
+    config.crypto_dispatch_ns = 1;
+    config.crypto_cores = n_processors;
+    void* helper = init_store_config(&config);
+
+    int failures = 0;
+    size_t bytes = sizeof(uint64_t)*num_blocks;
+
+    encrypt_tea_ctr(plain, key, nonce, cipher, num_blocks);
+    if (memcmp(cipher, expected, bytes) != 0) {
+        fprintf(stderr, "KAT FAIL: encrypt_tea_ctr blocks=%u\n", num_blocks);
+        failures++;
+    }
+    decrypt_tea_ctr(expected, key, nonce, output, num_blocks);
+    if (memcmp(output, plain, bytes) != 0) {
+        fprintf(stderr, "KAT FAIL: decrypt_tea_ctr blocks=%u\n", num_blocks);
+        failures++;
+    }
+    memset(cipher, 0, bytes);
+    my_tea_ctr(plain, key, nonce, cipher, num_blocks, tmp2);
+    if (memcmp(cipher, expected, bytes) != 0 || memcmp(tmp2, keystream, bytes) != 0) {
+        fprintf(stderr, "KAT FAIL: my_tea_ctr blocks=%u\n", num_blocks);
+        failures++;
+    }
+    memset(cipher, 0, bytes);
+    memset(tmp2, 0, bytes);
+    btree_encrpyt(plain, key, nonce, cipher, num_blocks, helper, tmp2);
+    if (memcmp(cipher, expected, bytes) != 0 || memcmp(tmp2, keystream, bytes) != 0) {
+        fprintf(stderr, "KAT FAIL: btree_encrpyt blocks=%u threads=%d\n", num_blocks, n_processors);
+        failures++;
+    }
+    memset(output, 0, bytes);
+    btree_decryption(expected, key, nonce, output, num_blocks, helper);
+    if (memcmp(output, plain, bytes) != 0) {
+        fprintf(stderr, "KAT FAIL: btree_decryption blocks=%u threads=%d\n", num_blocks, n_processors);
+        failures++;
+    }
+    close_store(helper);
+
+    free(plain);
+    free(expected);
+    free(keystream);
+    free(cipher);
+    free(tmp2);
+    free(output);
+    return failures;
+}
+
+void run_kernel(int kernel, uint64_t* plain, uint64_t* cipher, uint64_t* tmp2, uint32_t num_blocks, void* helper) {
+
+    uint32_t key[4] = {1, 2, 3, 4};
+    if (kernel == KERNEL_TEA) {
+        for (uint32_t i = 0; i < num_blocks; i++) {
+            encrypt_tea((uint32_t*)&plain[i], (uint32_t*)&cipher[i], key);
+        }
+    } else if (kernel == KERNEL_TEA_CTR) {
+        encrypt_tea_ctr(plain, key, 5, cipher, num_blocks);
+    } else if (kernel == KERNEL_MY_TEA_CTR) {
+        my_tea_ctr(plain, key, 5, cipher, num_blocks, tmp2);
+    } else if (kernel == KERNEL_BTREE_ENCRYPT) {
+        btree_encrpyt(plain, key, 5, cipher, num_blocks, helper, tmp2);
+    } else {
+        btree_decryption(cipher, key, 5, plain, num_blocks, helper);
+    }
+}
+
+/*
+* Repeats a kernel until at least MIN_BENCH_NS has passed and prints one CSV row
+*/
+void bench_kernel(int kernel, size_t bytes, uint8_t threads) {
+
+    uint32_t num_blocks = (bytes + (8-1))/8;
+    uint64_t* plain = calloc(num_blocks, sizeof(uint64_t));
+    uint64_t* cipher = calloc(num_blocks, sizeof(uint64_t));
+    uint64_t* tmp2 = calloc(num_blocks, sizeof(uint64_t));
+    void* helper = init_store(4, threads);
+
+    run_kernel(kernel, plain, cipher, tmp2, num_blocks, helper);
+
+    uint64_t iterations = 0;
+    uint64_t start = bench_ns();
+    uint64_t start_cycles = bench_cycles();
+    uint64_t elapsed = 0;
+    do {
+        run_kernel(kernel, plain, cipher, tmp2, num_blocks, helper);
+        iterations++;
+        elapsed = bench_ns() - start;
+    } while (elapsed < MIN_BENCH_NS);
+    uint64_t cycles = bench_cycles() - start_cycles;
+
+    double total_bytes = (double)num_blocks * 8 * iterations;
+    printf("%s,%zu,%d,%llu,%.3f,%.2f,%.0f\n", kernel_names[kernel], bytes, threads, (unsigned long long)iterations,
+    elapsed/total_bytes, cycles/total_bytes, num_blocks * iterations / (elapsed/1e9));
+    fflush(stdout);
+
+    close_store(helper);
+    free(plain);
+    free(cipher);
+    free(tmp2);
+}
+
+/*
+* Verifies every kernel against the encrypt_tea reference, then prints cycles per byte and blocks per second.
+* Serial kernels run once per size, btree_encrpyt and btree_decryption run for 1..N threads.
+*/
+int main(int argc, char* argv[]) {
+
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int verify_only = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:vh")) != -1) {
+        if (opt == 't') {
+            max_threads = atoi(optarg);
+        } else if (opt == 'v') {
+            verify_only = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [-t max threads] [-v verify only]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads < 1 || max_threads > 255) {
+        max_threads = 4;
+    }
+
+    uint32_t verify_blocks[] = {1, 3, 75, 76, 512, 4099};
+    int failures = 0;
+    for (int i = 0; i < 6; i++) {
+        for (int t = 1; t <= max_threads; t *= 2) {
+            failures += verify_kernels(verify_blocks[i], t);
+        }
+    }
+    if (failures != 0) {
+        fprintf(stderr, "%d kernel mismatches\n", failures);
+        return 1;
+    }
+    fprintf(stderr, "All kernels match the encrypt_tea reference\n");
+    if (verify_only) {
+        return 0;
+    }
+
+    size_t sizes[] = {8, 64, 600, 608, 4096, 65536, 1048576};
+    printf("kernel,bytes,threads,iterations,ns_per_byte,cycles_per_byte,blocks_per_sec\n");
+    for (int s = 0; s < 7; s++) {
+        for (int kernel = 0; kernel < KERNEL_COUNT; kernel++) {
+            if (kernel < KERNEL_BTREE_ENCRYPT) {
+                bench_kernel(kernel, sizes[s], 1);
+                continue;
+            }
+            for (int t = 1; t <= max_threads; t = (t == max_threads || t*2 <= max_threads) ? t*2 : max_threads) {
+                bench_kernel(kernel, sizes[s], t);
+            }
+        }
+    }
+    return 0;
+}
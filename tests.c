@@ -1,6 +1,9 @@
+//pthread_getaffinity_np is a GNU extension
+#define _GNU_SOURCE
 #include "btreestore.h"
 
 #include <stdio.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,7 +37,7 @@ void read_retrieve(struct info* output) {
     printf("\n");
     printf("DATA: ");
     for (int i = 0; i < output->size; i++) {
-        printf("%d ", output->data + i);
+        printf("%d ", ((unsigned char*)output->data)[i]);
     }
     printf("\n");
 }
@@ -576,6 +579,1247 @@ void multithread1() {
     close_store(helper);
 }
 
+/*
+* Checks the shape and structural counters reported by btree_stats after inserts and deletes
+*/
+void stats1() {
+
+    void * helper = init_store(4, 4);
+
+    uint64_t plaintext[10];
+    uint32_t enc_key[4];
+    struct btree_stats stats;
+
+    for (int i = 0; i < 50; i++) {
+        btree_insert(i, plaintext, 10, enc_key, 5, helper);
+    }
+    for (int i = 0; i < 20; i++) {
+        btree_delete(i, helper);
+    }
+    btree_stats(helper, &stats);
+
+    printf("HEIGHT: %d\n", stats.height);
+    printf("LEVELS: ");
+    for (int i = 0; i < stats.height; i++) {
+        printf("%d ", stats.level_nodes[i]);
+    }
+    printf("\n");
+    printf("NODES: %d KEYS: %d FILL: %.2f\n", stats.node_count, (int)stats.key_count, stats.fill_factor);
+    printf("PAYLOAD: %d KEYSTREAM: %d\n", (int)stats.payload_bytes, (int)stats.keystream_bytes);
+    printf("SPLITS: %d ROOTS: %d MERGES: %d ROTATIONS: %d\n", (int)stats.counters.splits,
+    (int)stats.counters.root_growths, (int)stats.counters.merges, (int)stats.counters.rotations);
+    close_store(helper);
+}
+/*
+* Known-answer vectors for the TEA block cipher and the stored CTR ciphertext, on both sides of the threading cutoff
+*/
+void tea_kat1() {
+
+    uint32_t keys[3][4] = {{0, 0, 0, 0}, {1, 2, 3, 4}, {0x01234567, 0x89ABCDEF, 0xFEDCBA98, 0x76543210}};
+    uint32_t plains[3][2] = {{0, 0}, {1, 2}, {0xDEADBEEF, 0xCAFEBABE}};
+
+    for (int i = 0; i < 3; i++) {
+        uint32_t cipher[2];
+        uint32_t plain[2];
+        encrypt_tea(plains[i], cipher, keys[i]);
+        printf("TEA: %08x %08x", cipher[0], cipher[1]);
+        decrypt_tea(cipher, plain, keys[i]);
+        printf(" -> %08x %08x\n", plain[0], plain[1]);
+    }
+
+    void * helper = init_store(4, 4);
+    char plaintext[1000];
+    for (int i = 0; i < 1000; i++) {
+        plaintext[i] = i;
+    }
+    btree_insert(1, plaintext, 20, keys[2], 5, helper);
+    btree_insert(2, plaintext, 1000, keys[2], 0x0123456789ABCDEFULL, helper);
+
+    struct info found;
+    for (int key = 1; key <= 2; key++) {
+        btree_retrieve(key, &found, helper);
+        uint64_t* data = (uint64_t*)found.data;
+        int blocks = (found.size + (8-1))/8;
+        printf("CTR %d:", key);
+        printf(" %016llx %016llx", (unsigned long long)data[0], (unsigned long long)data[1]);
+        printf(" %016llx\n", (unsigned long long)data[blocks-1]);
+    }
+    close_store(helper);
+}
+/*
+* Checks that records under the same key and nonce share one keystream, that it is extended for longer
+* payloads without breaking shorter records, and that it is released with the last record
+*/
+void keystream1() {
+
+    void * helper = init_store(4, 4);
+
+    char plaintext[2000];
+    for (int i = 0; i < 2000; i++) {
+        plaintext[i] = i * 7;
+    }
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    uint32_t other_key[4] = {5, 6, 7, 8};
+    struct btree_stats stats;
+
+    for (int i = 0; i < 30; i++) {
+        btree_insert(i, plaintext, 10 + i, enc_key, 5, helper);
+    }
+    btree_stats(helper, &stats);
+    printf("ENTRIES: %d BYTES: %d\n", stats.keystream_entries, (int)stats.keystream_bytes);
+
+    btree_insert(100, plaintext, 2000, enc_key, 5, helper);
+    btree_insert(101, plaintext, 64, other_key, 5, helper);
+    btree_insert(102, plaintext, 64, enc_key, 6, helper);
+    btree_stats(helper, &stats);
+    printf("ENTRIES: %d BYTES: %d\n", stats.keystream_entries, (int)stats.keystream_bytes);
+
+    int keys[] = {0, 29, 100, 101, 102};
+    int sizes[] = {10, 39, 2000, 64, 64};
+    for (int i = 0; i < 5; i++) {
+        char output[2000];
+        btree_decrypt(keys[i], output, helper);
+        printf("DECRYPT %d: %s\n", keys[i], memcmp(output, plaintext, sizes[i]) == 0 ? "OK" : "MISMATCH");
+    }
+
+    for (int i = 0; i < 30; i++) {
+        btree_delete(i, helper);
+    }
+    btree_stats(helper, &stats);
+    printf("ENTRIES: %d BYTES: %d\n", stats.keystream_entries, (int)stats.keystream_bytes);
+
+    btree_delete(100, helper);
+    btree_delete(101, helper);
+    btree_delete(102, helper);
+    btree_stats(helper, &stats);
+    printf("ENTRIES: %d BYTES: %d\n", stats.keystream_entries, (int)stats.keystream_bytes);
+    close_store(helper);
+}
+/*
+* Checks round trips on both sides of the inline threshold, including an empty payload and a store with inlining off
+*/
+void inline1() {
+
+    char plaintext[700];
+    for (int i = 0; i < 700; i++) {
+        plaintext[i] = i * 3;
+    }
+    uint32_t enc_key[4] = {9, 8, 7, 6};
+    int sizes[] = {0, 1, 7, 8, 63, 64, 65, 700};
+
+    for (int threshold = 0; threshold <= 64; threshold += 64) {
+        struct btree_config config;
+        btree_default_config(&config, 4, 4);
+        config.inline_threshold = threshold;
+        void * helper = init_store_config(&config);
+
+        for (int i = 0; i < 8; i++) {
+            btree_insert(i, plaintext, sizes[i], enc_key, 5, helper);
+        }
+        printf("THRESHOLD %d:", threshold);
+        for (int i = 0; i < 8; i++) {
+            char output[700];
+            struct info found;
+            btree_retrieve(i, &found, helper);
+            btree_decrypt(i, output, helper);
+            printf(" %d:%s", found.size, memcmp(output, plaintext, sizes[i]) == 0 ? "OK" : "MISMATCH");
+        }
+        printf("\n");
+        close_store(helper);
+    }
+}
+
+/*
+* Async inserts and decrypts are applied in ticket order, so a decrypt submitted right after an insert sees it
+*/
+void decrypt_callback(struct btree_completion* completion) {
+
+    int* matches = (int*)completion->context;
+    char* output = (char*)completion->output;
+    if (completion->result == 0 && output[0] == (char)completion->key && output[999] == (char)(completion->key + 999)) {
+        *matches += 1;
+    }
+}
+
+void async1() {
+
+    void * helper = init_store(4, 4);
+    uint32_t enc_key[4] = {3, 1, 4, 1};
+    char plaintext[40][1000];
+    char output[40][1000];
+    int matches = 0;
+
+    for (int i = 0; i < 40; i++) {
+        for (int j = 0; j < 1000; j++) {
+            plaintext[i][j] = i + j;
+        }
+        btree_insert_async(i, plaintext[i], 1000, enc_key, i, NULL, NULL, helper);
+        btree_decrypt_async(i, output[i], &decrypt_callback, &matches, helper);
+    }
+    uint64_t duplicate = btree_insert_async(7, plaintext[0], 1000, enc_key, 0, NULL, NULL, helper);
+    btree_async_drain(helper);
+
+    struct btree_completion completion;
+    uint64_t last_ticket = 0;
+    int ordered = 1;
+    int inserted = 0;
+    while (btree_async_poll(helper, &completion) == 0) {
+        if (completion.ticket <= last_ticket) {
+            ordered = 0;
+        }
+        last_ticket = completion.ticket;
+        if (completion.ticket == duplicate) {
+            printf("DUPLICATE: %d\n", completion.result);
+        } else if (completion.result == 0) {
+            inserted++;
+        }
+    }
+    printf("INSERTED: %d\n", inserted);
+    printf("ORDERED: %d\n", ordered);
+    printf("DECRYPTED: %d\n", matches);
+
+    char check[1000];
+    btree_decrypt(7, check, helper);
+    printf("KEY 7: %s\n", memcmp(check, plaintext[7], 1000) == 0 ? "OK" : "MISMATCH");
+    close_store(helper);
+
+    //With the hash index a duplicate is found at submit and fails without going through the workers
+    struct btree_config config;
+    btree_default_config(&config, 4, 4);
+    config.hash_index = 1;
+    helper = init_store_config(&config);
+    btree_insert(7, plaintext[7], 1000, enc_key, 7, helper);
+    duplicate = btree_insert_async(7, plaintext[0], 1000, enc_key, 99, NULL, NULL, helper);
+    btree_async_drain(helper);
+    btree_async_poll(helper, &completion);
+    printf("INDEXED DUPLICATE: %d\n", completion.result);
+    close_store(helper);
+}
+
+/*
+* Large payload inserter, each thread uses its own nonce so every insert generates a fresh keystream
+*/
+void* thread_large_inserter(void* args) {
+
+    struct args* flag = (struct args*)args;
+
+    char plaintext[20000];
+    for (int i = 0; i < 20000; i++) {
+        plaintext[i] = flag->key + i;
+    }
+    uint32_t enc_key[4] = {2, 7, 1, 8};
+    btree_insert(flag->key, plaintext, 20000, enc_key, flag->key, flag->helper);
+
+    free(args);
+    return NULL;
+}
+
+/*
+* Concurrent large inserts on a store whose cost model always splits, so their ranges share the worker deques
+*/
+void steal1() {
+
+    struct btree_config config;
+    btree_default_config(&config, 4, 4);
+    config.crypto_block_ns = 1000;
+    config.crypto_dispatch_ns = 1;
+    config.crypto_cores = 4;
+    void * helper = init_store_config(&config);
+
+    pthread_t th[16];
+    for (int i = 0; i < 16; i++) {
+        struct args* num = malloc(sizeof(struct args));
+        num->key = i;
+        num->helper = helper;
+        pthread_create(&th[i], NULL, &thread_large_inserter, num);
+    }
+    for (int i = 0; i < 16; i++) {
+        pthread_join(th[i], NULL);
+    }
+
+    int matches = 0;
+    for (int i = 0; i < 16; i++) {
+        char output[20000];
+        btree_decrypt(i, output, helper);
+        char check = 1;
+        for (int j = 0; j < 20000; j++) {
+            if (output[j] != (char)(i + j)) {
+                check = 0;
+                break;
+            }
+        }
+        matches += check;
+    }
+    printf("MATCHES: %d\n", matches);
+    close_store(helper);
+}
+
+/*
+* Range deletes on both boundaries and the middle, then ordinary operations on the rebuilt tree
+*/
+void range1() {
+
+    void * helper = init_store(4, 4);
+    char plaintext[10] = "range";
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    for (int i = 0; i < 1000; i++) {
+        btree_insert(i, plaintext, 10, enc_key, 5, helper);
+    }
+    printf("DELETED: %llu\n", (unsigned long long)btree_delete_range(100, 199, helper));
+    printf("DELETED: %llu\n", (unsigned long long)btree_delete_range(0, 5, helper));
+    printf("DELETED: %llu\n", (unsigned long long)btree_delete_range(950, UINT32_MAX, helper));
+    printf("DELETED: %llu\n", (unsigned long long)btree_delete_range(150, 160, helper));
+    printf("DELETED: %llu\n", (unsigned long long)btree_delete_range(20, 10, helper));
+
+    int present = 0;
+    struct info found;
+    for (int i = 0; i < 1000; i++) {
+        present += btree_retrieve(i, &found, helper) == 0;
+    }
+    printf("PRESENT: %d\n", present);
+    printf("RETRIEVE 6: %d, RETRIEVE 200: %d, RETRIEVE 99: %d\n", btree_retrieve(6, &found, helper),
+    btree_retrieve(200, &found, helper), btree_retrieve(99, &found, helper));
+
+    for (int i = 100; i < 200; i++) {
+        btree_insert(i, plaintext, 10, enc_key, 5, helper);
+    }
+    for (int i = 300; i < 400; i++) {
+        btree_delete(i, helper);
+    }
+    struct btree_stats stats;
+    btree_stats(helper, &stats);
+    printf("KEYS: %llu\n", (unsigned long long)stats.key_count);
+
+    printf("DELETED: %llu\n", (unsigned long long)btree_delete_range(0, UINT32_MAX, helper));
+    btree_stats(helper, &stats);
+    printf("KEYS: %llu, NODES: %u\n", (unsigned long long)stats.key_count, stats.node_count);
+    close_store(helper);
+}
+
+/*
+* Tombstone deletes leave the structure alone until btree_compact removes the buried records
+*/
+void tombstone1() {
+
+    struct btree_config config;
+    btree_default_config(&config, 4, 4);
+    config.tombstone_deletes = 1;
+    config.maintenance_budget = 1000;
+    config.maintenance_interval_ms = 600000;
+    void * helper = init_store_config(&config);
+
+    char plaintext[100] = "tombstone";
+    uint32_t enc_key[4] = {5, 6, 7, 8};
+    for (int i = 0; i < 200; i++) {
+        btree_insert(i, plaintext, 100, enc_key, 5, helper);
+    }
+    struct btree_stats before;
+    btree_stats(helper, &before);
+    for (int i = 0; i < 150; i++) {
+        btree_delete(i, helper);
+    }
+    struct btree_stats stats;
+    btree_stats(helper, &stats);
+    printf("KEYS: %llu, TOMBSTONES: %llu, SAME NODES: %d\n", (unsigned long long)stats.key_count,
+    (unsigned long long)stats.tombstones, stats.node_count == before.node_count);
+
+    struct info found;
+    char output[100];
+    int retrieved = btree_retrieve(10, &found, helper);
+    int decrypted = btree_decrypt(10, output, helper);
+    int deleted = btree_delete(10, helper);
+    printf("RETRIEVE 10: %d, DECRYPT 10: %d, DELETE 10: %d\n", retrieved, decrypted, deleted);
+    int revived = btree_insert(10, plaintext, 100, enc_key, 5, helper);
+    int duplicate = btree_insert(10, plaintext, 100, enc_key, 5, helper);
+    printf("INSERT 10: %d, INSERT 10: %d\n", revived, duplicate);
+
+    printf("COMPACTED: %llu\n", (unsigned long long)btree_compact(helper));
+    btree_stats(helper, &stats);
+    printf("KEYS: %llu, TOMBSTONES: %llu\n", (unsigned long long)stats.key_count, (unsigned long long)stats.tombstones);
+    btree_decrypt(10, output, helper);
+    printf("DECRYPT 10: %s\n", output);
+
+    //Dense deletes are compacted by rebuilding their range, which leaves fewer nodes than the unlinked tree had
+    for (int i = 200; i < 1200; i++) {
+        btree_insert(i, plaintext, 16, enc_key, 5, helper);
+    }
+    btree_stats(helper, &before);
+    for (int i = 200; i < 1200; i++) {
+        if (i % 10 != 0) {
+            btree_delete(i, helper);
+        }
+    }
+    printf("COMPACTED: %llu\n", (unsigned long long)btree_compact(helper));
+    btree_stats(helper, &stats);
+    uint32_t correct = 0;
+    for (int i = 150; i < 1200; i++) {
+        correct += (btree_decrypt(i, output, helper) == 0) == (i < 200 || i % 10 == 0);
+    }
+    printf("KEYS: %llu, CORRECT: %u, FEWER NODES: %d\n", (unsigned long long)stats.key_count, correct,
+    stats.node_count < before.node_count);
+    close_store(helper);
+
+    config.maintenance_budget = 0;
+    printf("MAINTENANCE BUDGET 0: %s\n", init_store_config(&config) == NULL ? "REJECTED" : "ACCEPTED");
+    config.maintenance_budget = 1000;
+    config.maintenance_interval_ms = 0;
+    printf("MAINTENANCE INTERVAL 0: %s\n", init_store_config(&config) == NULL ? "REJECTED" : "ACCEPTED");
+}
+
+/*
+* Updates rewrite values in place when they fit, upserts insert missing keys
+*/
+void update1() {
+
+    void * helper = init_store(4, 4);
+    uint32_t enc_key[4] = {4, 3, 2, 1};
+    char large[500];
+    memset(large, 'L', 500);
+    large[499] = '\0';
+
+    btree_insert(1, "first", 6, enc_key, 5, helper);
+    btree_insert(2, large, 500, enc_key, 5, helper);
+
+    char output[500];
+    struct info before;
+    struct info after;
+    btree_retrieve(2, &before, helper);
+    int updated = btree_update(2, "small value", 12, enc_key, 9, helper);
+    btree_retrieve(2, &after, helper);
+    btree_decrypt(2, output, helper);
+    printf("UPDATE 2: %d, SIZE: %d, NONCE: %lu, SAME BUFFER: %d, VALUE: %s\n", updated, after.size,
+    (unsigned long)after.nonce, before.data == after.data, output);
+
+    updated = btree_update(1, large, 500, enc_key, 5, helper);
+    btree_decrypt(1, output, helper);
+    printf("UPDATE 1: %d, VALUE: %s\n", updated, memcmp(output, large, 500) == 0 ? "LARGE" : "MISMATCH");
+
+    printf("UPDATE 3: %d\n", btree_update(3, "missing", 8, enc_key, 5, helper));
+    printf("UPSERT 3: %d\n", btree_upsert(3, "inserted", 9, enc_key, 5, helper));
+    printf("UPSERT 3: %d\n", btree_upsert(3, "replaced", 9, enc_key, 5, helper));
+    btree_decrypt(3, output, helper);
+    printf("VALUE 3: %s\n", output);
+
+    for (int i = 10; i < 100; i++) {
+        btree_upsert(i, "bulk", 5, enc_key, i, helper);
+    }
+    for (int i = 10; i < 100; i++) {
+        btree_upsert(i, "again", 6, enc_key, i, helper);
+    }
+    struct btree_stats stats;
+    btree_stats(helper, &stats);
+    printf("KEYS: %llu\n", (unsigned long long)stats.key_count);
+    close_store(helper);
+}
+
+/*
+* Stores sized by node bytes derive their fanout and align every node to a cache line or page
+*/
+void nodes1() {
+
+    uint32_t sizes[] = {256, 4096, 16384};
+    uint32_t enc_key[4] = {1, 1, 2, 3};
+    for (int s = 0; s < 3; s++) {
+        struct btree_config config;
+        btree_default_config(&config, 4, 4);
+        config.node_bytes = sizes[s];
+        struct btree* helper = init_store_config(&config);
+
+        for (int i = 0; i < 5000; i++) {
+            btree_insert(i, "node", 5, enc_key, 5, helper);
+        }
+        for (int i = 0; i < 5000; i += 3) {
+            btree_delete(i, helper);
+        }
+        struct btree_stats stats;
+        btree_stats(helper, &stats);
+        int aligned = (uintptr_t)helper->root % stats.node_align == 0;
+        printf("NODE BYTES %u: BRANCHING %u, SIZE %u, ALIGN %u, ROOT ALIGNED %d, KEYS %llu\n", sizes[s],
+        stats.branching, stats.node_size, stats.node_align, aligned, (unsigned long long)stats.key_count);
+        close_store(helper);
+    }
+    struct btree_config config;
+    btree_default_config(&config, 4, 4);
+    config.node_bytes = 32;
+    printf("NODE BYTES 32: %s\n", init_store_config(&config) == NULL ? "REJECTED" : "ACCEPTED");
+}
+
+/*
+* Packed internal node keys must give the same answers as the record scan, for dense and sparse keys
+*/
+void compress1() {
+
+    uint32_t enc_key[4] = {6, 5, 4, 3};
+    for (int compress = 0; compress <= 1; compress++) {
+        struct btree_config config;
+        btree_default_config(&config, 16, 4);
+        config.compress_keys = compress;
+        void * helper = init_store_config(&config);
+
+        for (uint32_t i = 0; i < 10000; i++) {
+            btree_insert(i, "dense", 6, enc_key, 5, helper);
+        }
+        for (uint32_t i = 0; i < 1000; i++) {
+            btree_insert(100000 + i*100003, "sparse", 7, enc_key, 5, helper);
+        }
+        for (uint32_t i = 0; i < 10000; i += 7) {
+            btree_delete(i, helper);
+        }
+        int hits = 0;
+        struct info found;
+        for (uint32_t i = 0; i < 10000; i++) {
+            hits += btree_retrieve(i, &found, helper) == 0;
+        }
+        for (uint32_t i = 0; i < 1000; i++) {
+            hits += btree_retrieve(100000 + i*100003, &found, helper) == 0;
+            hits += btree_retrieve(100001 + i*100003, &found, helper) == 0;
+        }
+        struct btree_stats stats;
+        btree_stats(helper, &stats);
+        printf("COMPRESS %d: HITS %d, 8 BIT %u, 16 BIT %u, UNPACKED %u\n", compress, hits, stats.packed_nodes[0],
+        stats.packed_nodes[1], stats.packed_nodes[2]);
+        close_store(helper);
+    }
+}
+
+/*
+* Streamed inserts in uneven chunks, extending the keystream as they go, produce the same ciphertext as a single
+* btree_insert of the value
+*/
+void stream1() {
+
+    void * helper = init_store(4, 4);
+    uint32_t enc_key[4] = {7, 7, 7, 7};
+    size_t size = 100003;
+    char* plaintext = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        plaintext[i] = i * 31;
+    }
+    struct btree_ingest* ingest = btree_insert_begin(2, enc_key, 11, size, helper);
+    size_t chunks[] = {1, 7, 13, 8, 1000, 4096, 3};
+    size_t offset = 0;
+    for (int i = 0; offset < size; i = (i+1) % 7) {
+        size_t len = chunks[i] < size - offset ? chunks[i] : size - offset;
+        btree_insert_append(ingest, plaintext + offset, len);
+        offset += len;
+    }
+    printf("OVERRUN: %d\n", btree_insert_append(ingest, plaintext, 1));
+    printf("FINISH: %d\n", btree_insert_finish(ingest));
+    //Appends only generate the blocks they cover, the record's keystream is built by its first decrypt
+    struct btree_memory memory;
+    btree_memory(helper, &memory);
+    printf("KEYSTREAM BYTES: %lu\n", (unsigned long)memory.keystream_bytes);
+    btree_insert(1, plaintext, size, enc_key, 11, helper);
+
+    struct info first;
+    struct info second;
+    btree_retrieve(1, &first, helper);
+    btree_retrieve(2, &second, helper);
+    printf("CIPHERTEXT MATCH: %d\n", first.size == second.size && memcmp(first.data, second.data, (size+7)/8*8) == 0);
+
+    char* output = malloc(size);
+    btree_decrypt(2, output, helper);
+    printf("PLAINTEXT MATCH: %d\n", memcmp(output, plaintext, size) == 0);
+
+    ingest = btree_insert_begin(3, enc_key, 11, 10, helper);
+    btree_insert_append(ingest, "short", 5);
+    printf("SHORT FINISH: %d\n", btree_insert_finish(ingest));
+
+    ingest = btree_insert_begin(1, enc_key, 11, 5, helper);
+    btree_insert_append(ingest, "dupes", 5);
+    printf("DUPLICATE FINISH: %d\n", btree_insert_finish(ingest));
+
+    ingest = btree_insert_begin(4, enc_key, 11, 12, helper);
+    btree_insert_append(ingest, "inline ", 7);
+    btree_insert_append(ingest, "value", 5);
+    btree_insert_finish(ingest);
+    btree_decrypt(4, output, helper);
+    printf("INLINE: %.12s\n", output);
+
+    free(plaintext);
+    free(output);
+    close_store(helper);
+}
+
+struct collector {
+
+    char* data;
+    size_t length;
+    int chunks;
+    int stop_after; //Callback fails once this many chunks arrived, 0 never
+    void* rewrite; //Store to upsert key 1 into after the first chunk, NULL never
+};
+
+int collect_chunk(const void * chunk, size_t len, void * context) {
+
+    struct collector* c = (struct collector*)context;
+    memcpy(c->data + c->length, chunk, len);
+    c->length += len;
+    c->chunks += 1;
+    if (c->rewrite != NULL) {
+        uint32_t enc_key[4] = {7, 7, 7, 7};
+        btree_upsert(1, c->data, len, enc_key, 12, c->rewrite);
+    }
+    return c->stop_after != 0 && c->chunks >= c->stop_after;
+}
+
+/*
+* Streamed decryption to a callback and to a file descriptor returns the same plaintext as btree_decrypt, and
+* stops with an error when the callback fails or the value is rewritten between chunks
+*/
+void decrypt_stream1() {
+
+    void * helper = init_store(4, 4);
+    uint32_t enc_key[4] = {7, 7, 7, 7};
+    size_t size = 100003;
+    char* plaintext = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        plaintext[i] = i * 31;
+    }
+    btree_insert(1, plaintext, size, enc_key, 11, helper);
+    btree_insert(2, "inline value", 12, enc_key, 11, helper);
+
+    struct collector c = {.data = malloc(size)};
+    int result = btree_decrypt_stream(1, &collect_chunk, &c, 4096, helper);
+    printf("STREAM: %d CHUNKS: %d MATCH: %d\n", result, c.chunks, c.length == size && memcmp(c.data, plaintext, size) == 0);
+
+    c.length = 0;
+    c.chunks = 0;
+    result = btree_decrypt_stream(2, &collect_chunk, &c, 0, helper);
+    printf("INLINE: %d %.*s\n", result, (int)c.length, c.data);
+
+    FILE* file = tmpfile();
+    result = btree_decrypt_to_fd(1, fileno(file), helper);
+    rewind(file);
+    size_t read = fread(c.data, 1, size, file);
+    fclose(file);
+    printf("FD: %d MATCH: %d\n", result, read == size && memcmp(c.data, plaintext, size) == 0);
+
+    printf("MISSING: %d\n", btree_decrypt_stream(3, &collect_chunk, &c, 4096, helper));
+
+    c.length = 0;
+    c.chunks = 0;
+    c.stop_after = 2;
+    result = btree_decrypt_stream(1, &collect_chunk, &c, 4096, helper);
+    printf("STOPPED: %d CHUNKS: %d\n", result, c.chunks);
+
+    c.length = 0;
+    c.chunks = 0;
+    c.stop_after = 0;
+    c.rewrite = helper;
+    result = btree_decrypt_stream(1, &collect_chunk, &c, 4096, helper);
+    printf("REWRITTEN: %d CHUNKS: %d\n", result, c.chunks);
+
+    free(c.data);
+    free(plaintext);
+    close_store(helper);
+}
+
+/*
+* Rank, select and range counts agree with the keys actually stored, through splits, merges, range deletes and
+* tombstones
+*/
+void order1() {
+
+    for (int tombstones = 0; tombstones < 2; tombstones++) {
+        struct btree_config config;
+        btree_default_config(&config, 4, 4);
+        config.tombstone_deletes = tombstones;
+        void * helper = init_store_config(&config);
+        uint32_t enc_key[4] = {1, 2, 3, 4};
+
+        //Multiples of 3 from 0 to 2997, then every multiple of 9 deleted and 1200..1499 range deleted
+        for (uint32_t i = 0; i < 1000; i++) {
+            btree_insert(i*3, "value", 5, enc_key, 1, helper);
+        }
+        for (uint32_t i = 0; i < 3000; i += 9) {
+            btree_delete(i, helper);
+        }
+        btree_delete_range(1200, 1499, helper);
+
+        uint32_t key = 0;
+        int first = btree_select(0, &key, helper);
+        printf("TOMBSTONES %d: SELECT 0: %d %u", tombstones, first, key);
+        int middle = btree_select(300, &key, helper);
+        printf(" SELECT 300: %d %u", middle, key);
+        int past = btree_select(599, &key, helper);
+        printf(" SELECT 599: %d\n", past);
+
+        printf("RANK 3: %lu RANK 1500: %lu RANK 1501: %lu RANK MAX: %lu\n", btree_rank(3, helper),
+        btree_rank(1500, helper), btree_rank(1501, helper), btree_rank(UINT32_MAX, helper));
+        printf("RANGE 0-99: %lu RANGE 1000-1999: %lu RANGE ALL: %lu\n", btree_count_range(0, 99, helper),
+        btree_count_range(1000, 1999, helper), btree_count_range(0, UINT32_MAX, helper));
+
+        btree_upsert(9, "back", 4, enc_key, 1, helper);
+        btree_compact(helper);
+        printf("AFTER REVIVE AND COMPACT: RANK 10: %lu RANGE ALL: %lu\n", btree_rank(10, helper),
+        btree_count_range(0, UINT32_MAX, helper));
+        close_store(helper);
+    }
+}
+
+void sum_record(const struct dict * record, void * context) {
+
+    __atomic_fetch_add((uint64_t*)context, record->key, __ATOMIC_RELAXED);
+}
+
+/*
+* A store walked on four crypto cores exports the same preorder as one walked serially, and for_each visits every
+* live record once
+*/
+void traverse1() {
+
+    void * stores[2];
+    for (int i = 0; i < 2; i++) {
+        struct btree_config config;
+        btree_default_config(&config, 4, 4);
+        config.crypto_cores = i == 0 ? 1 : 4;
+        //Tombstones stay queued until btree_compact, so both stores compact in the same order
+        config.tombstone_deletes = 1;
+        config.maintenance_budget = UINT32_MAX;
+        config.maintenance_interval_ms = UINT32_MAX;
+        stores[i] = init_store_config(&config);
+    }
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    for (uint32_t i = 0; i < 20000; i++) {
+        uint32_t key = (i * 7919) % 20000;
+        btree_insert(key, "value", 5, enc_key, 1, stores[0]);
+        btree_insert(key, "value", 5, enc_key, 1, stores[1]);
+    }
+    for (uint32_t i = 0; i < 20000; i += 10) {
+        btree_delete(i, stores[0]);
+        btree_delete(i, stores[1]);
+    }
+    btree_compact(stores[0]);
+    btree_compact(stores[1]);
+
+    struct node* serial;
+    struct node* parallel;
+    uint64_t serial_count = btree_export(stores[0], &serial);
+    uint64_t parallel_count = btree_export(stores[1], &parallel);
+    int same = serial_count == parallel_count;
+    for (uint64_t i = 0; same == 1 && i < serial_count; i++) {
+        same = serial[i].num_keys == parallel[i].num_keys &&
+        memcmp(serial[i].keys, parallel[i].keys, sizeof(uint32_t)*serial[i].num_keys) == 0;
+    }
+    printf("NODES: %lu SAME PREORDER: %d\n", parallel_count, same);
+    for (uint64_t i = 0; i < serial_count; i++) {
+        free(serial[i].keys);
+        free(parallel[i].keys);
+    }
+    free(serial);
+    free(parallel);
+
+    for (int i = 0; i < 2; i++) {
+        uint64_t sum = 0;
+        uint64_t visited = btree_for_each(stores[i], &sum_record, &sum);
+        printf("CORES %d: VISITED %lu SUM %lu\n", i == 0 ? 1 : 4, visited, sum);
+        close_store(stores[i]);
+    }
+}
+
+/*
+* Crypto workers pinned to CPU 0 cap the cores used for encryption and report that single CPU as their affinity,
+* and a set emptied by request_cpus leaves them unpinned
+*/
+void affinity1() {
+
+    //The lowest CPU this process may run on, CPU 0 can be outside the affinity mask
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+    int lowest = 0;
+    while (lowest < CPU_SETSIZE-1 && CPU_ISSET(lowest, &allowed) == 0) {
+        lowest++;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(lowest, &mask);
+
+    struct btree_config config;
+    btree_default_config(&config, 4, 4);
+    config.crypto_block_ns = 1000;
+    config.crypto_dispatch_ns = 1;
+    config.crypto_cores = 4;
+    config.crypto_cpus = mask;
+    void * helper = init_store_config(&config);
+
+    struct btree_stats stats;
+    btree_stats(helper, &stats);
+    printf("PINNED: CORES %u LOWEST CPU ONLY %d\n", stats.crypto_cores, CPU_EQUAL(&stats.crypto_cpus, &mask));
+
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    char plaintext[4096];
+    memset(plaintext, 'p', sizeof(plaintext));
+    btree_insert(1, plaintext, sizeof(plaintext), enc_key, 1, helper);
+    char output[4096];
+    btree_decrypt(1, output, helper);
+    printf("ROUND TRIP: %d\n", memcmp(output, plaintext, sizeof(plaintext)) == 0);
+
+    struct btree* my_tree = (struct btree*)helper;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    pthread_getaffinity_np(my_tree->crypto->workers[0], sizeof(cpu_set_t), &set);
+    printf("WORKERS: %u ONLY LOWEST CPU: %d\n", my_tree->crypto->worker_count, CPU_COUNT(&set) == 1 && CPU_ISSET(lowest, &set));
+    close_store(helper);
+
+    config.request_cpus = mask;
+    helper = init_store_config(&config);
+    btree_stats(helper, &stats);
+    printf("EXCLUDED: CORES %u CPUS %d\n", stats.crypto_cores, CPU_COUNT(&stats.crypto_cpus));
+    close_store(helper);
+}
+
+/*
+* The accountant tracks records, blobs and keystreams exactly and returns to zero once everything is deleted. Under a
+* budget, keystreams are evicted to stay within it and rebuilt when a decrypt needs them.
+*/
+void memory1() {
+
+    struct btree_config config;
+    btree_default_config(&config, 8, 4);
+    void * helper = init_store_config(&config);
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    char plaintext[1000];
+    char output[1000];
+    memset(plaintext, 'm', sizeof(plaintext));
+
+    //Every record has its own nonce and so its own 125 block keystream
+    for (uint32_t i = 0; i < 200; i++) {
+        btree_insert(i, plaintext, sizeof(plaintext), enc_key, i, helper);
+    }
+    struct btree_memory memory;
+    btree_memory(helper, &memory);
+    printf("RECORDS %lu DATA %lu KEYSTREAMS %lu NODES MATCH %d TOTAL MATCH %d\n", memory.record_bytes, memory.data_bytes,
+    memory.keystream_bytes, memory.node_bytes == (uint64_t)((struct btree*)helper)->node_count*((struct btree*)helper)->node_size,
+    memory.total_bytes == memory.node_bytes + memory.record_bytes + memory.data_bytes + memory.keystream_bytes);
+    uint64_t unbounded = memory.total_bytes;
+
+    for (uint32_t i = 0; i < 200; i++) {
+        btree_delete(i, helper);
+    }
+    btree_memory(helper, &memory);
+    printf("AFTER DELETE: TOTAL %lu\n", memory.total_bytes);
+    close_store(helper);
+
+    //Room for everything but about half of the keystreams
+    config.memory_budget = unbounded - 100*1000;
+    helper = init_store_config(&config);
+    for (uint32_t i = 0; i < 200; i++) {
+        btree_insert(i, plaintext, sizeof(plaintext), enc_key, i, helper);
+    }
+    btree_memory(helper, &memory);
+    printf("BUDGET: WITHIN %d EVICTED %d\n", memory.total_bytes <= memory.budget, memory.evictions > 0);
+
+    int correct = 1;
+    for (uint32_t i = 0; i < 200; i++) {
+        btree_decrypt(i, output, helper);
+        correct &= memcmp(output, plaintext, sizeof(plaintext)) == 0;
+    }
+    btree_memory(helper, &memory);
+    printf("DECRYPTED: %d WITHIN %d RESTORED %d\n", correct, memory.total_bytes <= memory.budget, memory.restores > 0);
+    close_store(helper);
+}
+
+/*
+* Repeated decrypts are answered from the plaintext cache, updates and deletes are never served stale, and the
+* cache stays within its size. Under a memory budget cached plaintext is evicted before any keystream.
+*/
+void plaintext1() {
+
+    struct btree_config config;
+    btree_default_config(&config, 8, 4);
+    config.plaintext_cache_bytes = 4*(sizeof(struct plaintext) + 1000);
+    void * helper = init_store_config(&config);
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    char plaintext[1000];
+    char updated[1000];
+    char output[1000];
+    memset(plaintext, 'p', sizeof(plaintext));
+    memset(updated, 'u', sizeof(updated));
+
+    for (uint32_t i = 0; i < 10; i++) {
+        btree_insert(i, plaintext, sizeof(plaintext), enc_key, i, helper);
+    }
+    btree_decrypt(1, output, helper);
+    memset(output, 0, sizeof(output));
+    btree_decrypt(1, output, helper);
+    struct btree_memory memory;
+    btree_memory(helper, &memory);
+    printf("HIT: %lu MISSES %lu CORRECT %d\n", memory.plaintext_hits, memory.plaintext_misses, memcmp(output, plaintext, sizeof(plaintext)) == 0);
+
+    btree_update(1, updated, sizeof(updated), enc_key, 1, helper);
+    btree_decrypt(1, output, helper);
+    printf("AFTER UPDATE: %d\n", memcmp(output, updated, sizeof(updated)) == 0);
+    btree_delete(1, helper);
+    printf("AFTER DELETE: %d\n", btree_decrypt(1, output, helper));
+    btree_insert(1, plaintext, 8, enc_key, 1, helper);
+    btree_decrypt(1, output, helper);
+    printf("REINSERTED: %d\n", memcmp(output, plaintext, 8) == 0);
+
+    int correct = 1;
+    for (int round = 0; round < 3; round++) {
+        for (uint32_t i = 2; i < 10; i++) {
+            btree_decrypt(i, output, helper);
+            correct &= memcmp(output, plaintext, sizeof(plaintext)) == 0;
+        }
+    }
+    btree_delete_range(2, 9, helper);
+    btree_insert(5, updated, sizeof(updated), enc_key, 5, helper);
+    btree_decrypt(5, output, helper);
+    correct &= memcmp(output, updated, sizeof(updated)) == 0;
+    btree_memory(helper, &memory);
+    printf("CYCLED: %d WITHIN %d\n", correct, memory.plaintext_bytes <= config.plaintext_cache_bytes);
+    close_store(helper);
+
+    //Room for every keystream but only about one cached value
+    config.plaintext_cache_bytes = 1 << 20;
+    helper = init_store_config(&config);
+    for (uint32_t i = 0; i < 10; i++) {
+        btree_insert(i, plaintext, sizeof(plaintext), enc_key, i, helper);
+    }
+    btree_memory(helper, &memory);
+    config.memory_budget = memory.total_bytes + 1500;
+    close_store(helper);
+    helper = init_store_config(&config);
+    for (uint32_t i = 0; i < 10; i++) {
+        btree_insert(i, plaintext, sizeof(plaintext), enc_key, i, helper);
+    }
+    for (uint32_t i = 0; i < 10; i++) {
+        btree_decrypt(i, output, helper);
+    }
+    btree_memory(helper, &memory);
+    printf("BUDGET: WITHIN %d CACHED %d KEYSTREAMS EVICTED %lu\n", memory.total_bytes <= memory.budget,
+    memory.plaintext_bytes > 0, memory.evictions);
+    close_store(helper);
+}
+
+/*
+* Lookups for missing keys are rejected by the filter without reaching the tree, present keys are never rejected
+* and deleted keys, single or by range, leave the filter.
+*/
+void filter1() {
+
+    struct btree_config config;
+    btree_default_config(&config, 8, 4);
+    config.filter_keys = 1000;
+    void * helper = init_store_config(&config);
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    char plaintext[16] = "filtered value!";
+    char output[16];
+
+    for (uint32_t i = 0; i < 2000; i += 2) {
+        btree_insert(i, plaintext, sizeof(plaintext), enc_key, 1, helper);
+    }
+    int found = 1;
+    struct info info;
+    for (uint32_t i = 0; i < 2000; i += 2) {
+        found &= btree_retrieve(i, &info, helper) == 0 && btree_decrypt(i, output, helper) == 0;
+    }
+    int absent = 1;
+    for (uint32_t i = 1; i < 2000; i += 2) {
+        absent &= btree_retrieve(i, &info, helper) == 1 && btree_decrypt(i, output, helper) == 1;
+    }
+    struct btree_stats stats;
+    btree_stats(helper, &stats);
+    printf("FOUND ALL %d ABSENT %d QUERIES %lu NEGATIVES OVER 95%% %d FPR BELOW 5%% %d\n", found, absent,
+    stats.filter_queries, stats.filter_negatives*100 > 2000*95, stats.filter_fpr < 0.05);
+
+    for (uint32_t i = 0; i < 1000; i += 2) {
+        btree_delete(i, helper);
+    }
+    btree_delete_range(1000, 1499, helper);
+    uint64_t before = stats.filter_negatives;
+    for (uint32_t i = 0; i < 1500; i += 2) {
+        absent &= btree_decrypt(i, output, helper) == 1;
+    }
+    for (uint32_t i = 1500; i < 2000; i += 2) {
+        found &= btree_decrypt(i, output, helper) == 0;
+    }
+    btree_stats(helper, &stats);
+    printf("AFTER DELETE: FOUND %d ABSENT %d REJECTED OVER 95%% %d\n", found, absent, (stats.filter_negatives - before)*100 > 750*95);
+
+    struct btree_memory memory;
+    btree_memory(helper, &memory);
+    printf("FILTER BYTES %lu\n", memory.filter_bytes);
+    close_store(helper);
+}
+
+/*
+* With the hash index point lookups agree with the tree through deletes of internal keys (moved predecessors),
+* rewrites that replace the record, revived tombstones and range deletes.
+*/
+void index1() {
+
+    struct btree_config config;
+    btree_default_config(&config, 4, 4);
+    config.hash_index = 1;
+    config.tombstone_deletes = 1;
+    config.maintenance_interval_ms = UINT32_MAX;
+    config.maintenance_budget = UINT32_MAX;
+    void * helper = init_store_config(&config);
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    uint32_t values[1000];
+    char output[200];
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        values[i] = i*7;
+        btree_insert(i, &values[i], sizeof(uint32_t), enc_key, 1, helper);
+    }
+    //Buried then compacted, most of these sit in internal nodes of a branching 4 tree
+    for (uint32_t i = 0; i < 1000; i += 3) {
+        btree_delete(i, helper);
+        values[i] = UINT32_MAX;
+    }
+    btree_compact(helper);
+    //A value past the inline threshold replaces the record
+    char large[200];
+    memset(large, 'L', sizeof(large));
+    for (uint32_t i = 1; i < 1000; i += 3) {
+        btree_update(i, large, sizeof(large), enc_key, 2, helper);
+    }
+    for (uint32_t i = 2; i < 100; i += 3) {
+        btree_delete(i, helper);
+        values[i] = i*11;
+        btree_upsert(i, &values[i], sizeof(uint32_t), enc_key, 3, helper);
+    }
+    btree_delete_range(500, 599, helper);
+    for (uint32_t i = 500; i < 600; i++) {
+        values[i] = UINT32_MAX;
+    }
+
+    int correct = 1;
+    struct info info;
+    for (uint32_t i = 0; i < 1000; i++) {
+        if (values[i] == UINT32_MAX) {
+            correct &= btree_retrieve(i, &info, helper) == 1 && btree_decrypt(i, output, helper) == 1;
+        } else if (i % 3 == 1) {
+            correct &= btree_decrypt(i, output, helper) == 0 && memcmp(output, large, sizeof(large)) == 0;
+        } else {
+            correct &= btree_retrieve(i, &info, helper) == 0 && info.size == sizeof(uint32_t);
+            correct &= btree_decrypt(i, output, helper) == 0 && memcmp(output, &values[i], sizeof(uint32_t)) == 0;
+        }
+    }
+    struct btree_stats stats;
+    btree_stats(helper, &stats);
+    printf("CORRECT %d INDEXED %u RECORDS %lu\n", correct, ((struct btree*)helper)->index.count, stats.key_count + stats.tombstones);
+    close_store(helper);
+}
+
+/*
+* Prints how many of keys [lo, hi) decrypt to their own number, and whether the store's node count and largest key
+* match its tree
+*/
+void check_store(const char* name, void * helper, uint32_t lo, uint32_t hi) {
+
+    uint32_t correct = 0;
+    for (uint32_t i = lo; i < hi; i++) {
+        uint32_t value = 0;
+        correct += btree_decrypt(i, &value, helper) == 0 && value == i;
+    }
+    struct btree_stats stats;
+    btree_stats(helper, &stats);
+    struct btree* my_tree = (struct btree*)helper;
+    uint32_t largest = 0;
+    for (struct btree_node* node = my_tree->root; node != NULL; node = node->leaf ? NULL : node->children[node->child_count-1]) {
+        largest = node->key_values[node->link_count-1]->key;
+    }
+    printf("%s: KEYS %lu CORRECT %u NODES MATCH %d LARGEST %u MATCH %d\n", name, stats.key_count, correct,
+    stats.node_count == my_tree->node_count, my_tree->largest_key, my_tree->largest_key == largest);
+}
+
+/*
+* Disjoint stores are concatenated, interleaved ones and ones with another node size are merged in order, a live
+* key in both stores fails the merge and leaves both alone, and a split moves every key from the pivot up.
+*/
+void stores1() {
+
+    struct btree_config config;
+    btree_default_config(&config, 6, 4);
+    config.hash_index = 1;
+    config.filter_keys = 1000;
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    void * first = init_store_config(&config);
+    void * second = init_store_config(&config);
+    for (uint32_t i = 0; i < 600; i++) {
+        btree_insert(i, &i, sizeof(uint32_t), enc_key, i, i < 300 ? first : second);
+    }
+    struct btree_memory before;
+    struct btree_memory memory;
+    btree_memory(first, &before);
+    btree_memory(second, &memory);
+    before.record_bytes += memory.record_bytes;
+    before.keystream_bytes += memory.keystream_bytes;
+
+    printf("MERGE DISJOINT: %d\n", btree_merge_stores(first, second));
+    check_store("MERGED", first, 0, 600);
+    btree_memory(first, &memory);
+    printf("RECORDS KEPT %d KEYSTREAMS KEPT %d\n", memory.record_bytes == before.record_bytes, memory.keystream_bytes == before.keystream_bytes);
+
+    void * upper = btree_split_store(first, 150);
+    check_store("BELOW 150", first, 0, 150);
+    check_store("FROM 150", upper, 150, 600);
+    struct info info;
+    printf("MOVED OUT: %d %d\n", btree_retrieve(150, &info, first), btree_retrieve(149, &info, upper));
+
+    //Another node size forces the ordered merge even though the ranges are disjoint
+    btree_default_config(&config, 9, 4);
+    void * interleaved = init_store_config(&config);
+    for (uint32_t i = 601; i < 1200; i += 2) {
+        btree_insert(i, &i, sizeof(uint32_t), enc_key, i, interleaved);
+    }
+    for (uint32_t i = 600; i < 1200; i += 2) {
+        btree_insert(i, &i, sizeof(uint32_t), enc_key, i, upper);
+    }
+    printf("MERGE INTERLEAVED: %d\n", btree_merge_stores(upper, interleaved));
+    check_store("INTERLEAVED", upper, 150, 1200);
+    printf("RANK 1000: %lu\n", btree_rank(1000, upper));
+
+    void * clash = init_store_config(&config);
+    uint32_t value = 5;
+    btree_insert(5, &value, sizeof(uint32_t), enc_key, 5, clash);
+    printf("MERGE CLASH: %d\n", btree_merge_stores(first, clash));
+    check_store("UNCHANGED", first, 0, 150);
+    check_store("CLASH", clash, 5, 6);
+
+    close_store(clash);
+    close_store(upper);
+    close_store(first);
+}
+
+/*
+* Prints how many of keys [0, count) hold the value expected[i], a zero entry meaning the key must be absent
+*/
+void check_image(const char* name, void * helper, uint32_t* expected, uint32_t count) {
+
+    uint32_t correct = 0;
+    struct info info;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t value = 0;
+        if (expected[i] == 0) {
+            correct += btree_retrieve(i, &info, helper) == 1;
+        } else {
+            correct += btree_decrypt(i, &value, helper) == 0 && value == expected[i];
+        }
+    }
+    struct btree_stats stats;
+    btree_stats(helper, &stats);
+    printf("%s: KEYS %lu CORRECT %u\n", name, stats.key_count, correct);
+}
+
+/*
+* A full image, an incremental segment with updates, inserts and deletes, an empty one, a restore into another
+* node size, a cut off last segment, and the background thread
+*/
+void checkpoint1() {
+
+    const char* path = "/tmp/btreestore_checkpoint1.img";
+    unlink(path);
+    uint32_t wrapping[4] = {0xC0FFEE, 17, 29, 0xBADC0DE};
+    struct btree_config config;
+    btree_default_config(&config, 4, 4);
+    config.checkpoint_path = path;
+    printf("NO CHECKPOINT KEY: %s\n", init_store_config(&config) == NULL ? "REJECTED" : "ACCEPTED");
+    memcpy(config.checkpoint_key, wrapping, sizeof(wrapping));
+    void * helper = init_store_config(&config);
+    uint32_t enc_key[4] = {1, 2, 3, 4};
+    uint32_t expected[1200] = {0};
+    struct btree_checkpoint_stats stats;
+
+    for (uint32_t i = 0; i < 1000; i++) {
+        expected[i] = i*3 + 1;
+        btree_insert(i, &expected[i], sizeof(uint32_t), enc_key, i, helper);
+    }
+    printf("FULL: %d\n", btree_checkpoint(helper));
+    btree_checkpoint_stats(helper, &stats);
+    printf("CHECKPOINTS %lu FULL %lu RECORDS %lu RANGES %lu\n", stats.checkpoints, stats.full_checkpoints, stats.last_records, stats.last_ranges);
+
+    for (uint32_t i = 0; i < 1000; i += 10) {
+        expected[i] = i*5 + 2;
+        btree_update(i, &expected[i], sizeof(uint32_t), enc_key, i+1, helper);
+    }
+    for (uint32_t i = 1; i < 100; i += 2) {
+        btree_delete(i, helper);
+        expected[i] = 0;
+    }
+    btree_delete_range(800, 849, helper);
+    for (uint32_t i = 800; i < 850; i++) {
+        expected[i] = 0;
+    }
+    for (uint32_t i = 1000; i < 1100; i++) {
+        expected[i] = i*3 + 1;
+        btree_insert(i, &expected[i], sizeof(uint32_t), enc_key, i, helper);
+    }
+    printf("INCREMENTAL: %d\n", btree_checkpoint(helper));
+    btree_checkpoint_stats(helper, &stats);
+    printf("CHECKPOINTS %lu FULL %lu RECORDS %lu RANGES %lu\n", stats.checkpoints, stats.full_checkpoints, stats.last_records, stats.last_ranges);
+    printf("UNCHANGED: %d\n", btree_checkpoint(helper));
+    btree_checkpoint_stats(helper, &stats);
+    printf("CHECKPOINTS %lu FULL %lu RECORDS %lu RANGES %lu\n", stats.checkpoints, stats.full_checkpoints, stats.last_records, stats.last_ranges);
+
+    //Record keys only appear wrapped
+    FILE* file = fopen(path, "rb");
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    unsigned char* image = malloc(length);
+    fseek(file, 0, SEEK_SET);
+    int clear = fread(image, length, 1, file) == 1 ? 0 : -1;
+    fclose(file);
+    for (long i = 0; clear >= 0 && i + sizeof(enc_key) <= (size_t)length; i++) {
+        clear += memcmp(image + i, enc_key, sizeof(enc_key)) == 0;
+    }
+    printf("CLEARTEXT KEYS: %d\n", clear);
+    free(image);
+
+    struct btree_config other;
+    btree_default_config(&other, 7, 4);
+    printf("RESTORE WITHOUT KEY: %s\n", btree_restore(path, &other) == NULL ? "REJECTED" : "ACCEPTED");
+    other.checkpoint_key[0] = 1;
+    printf("RESTORE WRONG KEY: %s\n", btree_restore(path, &other) == NULL ? "REJECTED" : "ACCEPTED");
+    memcpy(other.checkpoint_key, wrapping, sizeof(wrapping));
+    void * restored = btree_restore(path, &other);
+    check_image("RESTORED", restored, expected, 1200);
+    close_store(restored);
+
+    //The end frame of the last segment is cut off, so its update is not replayed
+    uint32_t value = 7;
+    btree_update(5, &value, sizeof(uint32_t), enc_key, 9, helper);
+    btree_checkpoint(helper);
+    btree_checkpoint_stats(helper, &stats);
+    file = fopen(path, "rb+");
+    fseek(file, 0, SEEK_END);
+    printf("TRUNCATE: %d\n", ftruncate(fileno(file), ftell(file) - sizeof(struct btree_checkpoint_frame)));
+    fclose(file);
+    restored = btree_restore(path, &other);
+    check_image("CUT OFF", restored, expected, 1200);
+    close_store(restored);
+    close_store(helper);
+
+    //A split off store does not inherit the image, merging forces a full one
+    btree_default_config(&config, 4, 4);
+    config.checkpoint_path = path;
+    memcpy(config.checkpoint_key, wrapping, sizeof(wrapping));
+    config.checkpoint_interval_ms = 1;
+    helper = init_store_config(&config);
+    for (uint32_t i = 0; i < 200; i++) {
+        btree_insert(i, &i, sizeof(uint32_t), enc_key, i, helper);
+    }
+    int waited = 0;
+    do {
+        usleep(1000);
+        btree_checkpoint_stats(helper, &stats);
+    } while (stats.last_records != 200 && ++waited < 10000);
+    printf("BACKGROUND: %d\n", stats.last_records == 200);
+    void * upper = btree_split_store(helper, 100);
+    printf("SPLIT OFF: %d\n", btree_checkpoint(upper));
+    uint64_t full = stats.full_checkpoints;
+    btree_merge_stores(helper, upper);
+    btree_checkpoint(helper);
+    btree_checkpoint_stats(helper, &stats);
+    printf("MERGE FULL: %d RECORDS %lu\n", stats.full_checkpoints > full, stats.last_records);
+    close_store(helper);
+    unlink(path);
+}
 
 int main(int argc, char* argv[]) {
 
@@ -622,6 +1866,50 @@ int main(int argc, char* argv[]) {
         delete_error1();
     } else if (argv[1][0] == 'j') {
         multithread1();
+    } else if (argv[1][0] == 'k') {
+        stats1();
+    } else if (argv[1][0] == 'l') {
+        tea_kat1();
+    } else if (argv[1][0] == 'm') {
+        keystream1();
+    } else if (argv[1][0] == 'n') {
+        inline1();
+    } else if (argv[1][0] == 'o') {
+        async1();
+    } else if (argv[1][0] == 'p') {
+        steal1();
+    } else if (argv[1][0] == 'q') {
+        range1();
+    } else if (argv[1][0] == 'r') {
+        tombstone1();
+    } else if (argv[1][0] == 's') {
+        update1();
+    } else if (argv[1][0] == 't') {
+        nodes1();
+    } else if (argv[1][0] == 'u') {
+        compress1();
+    } else if (argv[1][0] == 'v') {
+        stream1();
+    } else if (argv[1][0] == 'w') {
+        decrypt_stream1();
+    } else if (argv[1][0] == 'x') {
+        order1();
+    } else if (argv[1][0] == 'y') {
+        traverse1();
+    } else if (argv[1][0] == 'z') {
+        affinity1();
+    } else if (argv[1][0] == 'A') {
+        memory1();
+    } else if (argv[1][0] == 'B') {
+        plaintext1();
+    } else if (argv[1][0] == 'C') {
+        filter1();
+    } else if (argv[1][0] == 'D') {
+        index1();
+    } else if (argv[1][0] == 'E') {
+        stores1();
+    } else if (argv[1][0] == 'F') {
+        checkpoint1();
     } 
     return 0;
 }